@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "midiplayer.h"
+#include "miditimer.h"
+#include "midiring.h"
+#include "midiscan.h"
+
+// Microbenchmarks of the loader, the VLQ decoder, the statistics scan, the playback loop and the renderer's event ring,
+// run over synthetic files. Results go to stdout one row per benchmark (CSV, or JSON lines with --json);
+// the player's own logging is discarded unless --verbose is given.
+
+#define SYNTH_DIVISION 480
+#define SYNTH_NOTE_LENGTH 30        // Ticks a chord sounds
+#define SYNTH_GAP 30                // Ticks between chords, plus up to SYNTH_JITTER
+#define SYNTH_JITTER 16
+
+#define VLQ_COUNT (4 * 1024 * 1024)
+#define RING_EVENTS (16 * 1024 * 1024)
+#define RING_CAPACITY (1 << 16)
+#define RING_BATCH 64
+
+// Shape of a generated file
+typedef struct {
+    const char* name;
+    int tracks;                 // Note tracks; a tempo track always comes first
+    int notes_per_track;
+    int polyphony;              // Notes started together in every chord
+    int tempo_changes;          // Spread evenly over the song
+    bool running_status;        // Leave out repeated status bytes, note-offs as velocity 0 note-ons
+    uint32_t seed;
+} SyntheticSpec;
+
+static const SyntheticSpec default_specs[] = {
+    { "dense", 16, 20000, 4, 100, true, 1 },
+    { "wide", 256, 1000, 1, 10, true, 2 },
+    { "chords", 8, 20000, 32, 10, true, 3 },
+    { "tempo", 4, 20000, 1, 20000, true, 4 },
+    { "no_running_status", 16, 20000, 4, 100, false, 5 },
+};
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+typedef struct {
+    FILE* out;
+    bool json;
+    int iterations;
+    bool header;
+} BenchOutput;
+
+inline __attribute__((always_inline)) static uint32_t next_random(uint32_t* state) {
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void put_byte(ByteBuffer* buffer, const uint8_t byte) {
+    if (buffer->size == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (!buffer->data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    buffer->data[buffer->size++] = byte;
+}
+
+static void put_be32(ByteBuffer* buffer, const uint32_t value) {
+    put_byte(buffer, value >> 24);
+    put_byte(buffer, value >> 16);
+    put_byte(buffer, value >> 8);
+    put_byte(buffer, value);
+}
+
+static void put_vlq(ByteBuffer* buffer, const uint32_t value) {
+    uint8_t bytes[5];
+    int count = 0;
+    uint32_t rest = value;
+    do {
+        bytes[count++] = rest & 0x7F;
+        rest >>= 7;
+    } while (rest);
+    while (count > 1) put_byte(buffer, bytes[--count] | 0x80);
+    put_byte(buffer, bytes[0]);
+}
+
+static void put_chunk(ByteBuffer* file, const char* id, const ByteBuffer* body) {
+    for (int i = 0; i < 4; i++) put_byte(file, id[i]);
+    put_be32(file, (uint32_t)body->size);
+    for (size_t i = 0; i < body->size; i++) put_byte(file, body->data[i]);
+}
+
+// Upper bound of the song length in ticks, for spreading the tempo changes out
+static uint64_t synthetic_song_ticks(const SyntheticSpec* spec) {
+    const uint64_t chords = (spec->notes_per_track + spec->polyphony - 1) / spec->polyphony;
+    return chords * (SYNTH_NOTE_LENGTH + SYNTH_GAP + SYNTH_JITTER);
+}
+
+static void put_tempo_track(ByteBuffer* track, const SyntheticSpec* spec, uint32_t* rng) {
+    const uint64_t interval = synthetic_song_ticks(spec) / (spec->tempo_changes + 1) + 1;
+    for (int i = 0; i <= spec->tempo_changes; i++) {
+        const uint32_t tempo = 300000 + next_random(rng) % 400000;
+        put_vlq(track, i == 0 ? 0 : (uint32_t)interval);
+        put_byte(track, 0xFF);
+        put_byte(track, 0x51);
+        put_byte(track, 3);
+        put_byte(track, tempo >> 16);
+        put_byte(track, tempo >> 8);
+        put_byte(track, tempo);
+    }
+    put_vlq(track, 0);
+    put_byte(track, 0xFF);
+    put_byte(track, 0x2F);
+    put_byte(track, 0);
+}
+
+static void put_note_track(ByteBuffer* track, const SyntheticSpec* spec, const int index, uint32_t* rng) {
+    const uint8_t channel = index % 16;
+    uint8_t keys[128];
+    uint8_t last_status = 0;
+    uint32_t delta = index % SYNTH_GAP;
+
+    for (int remaining = spec->notes_per_track; remaining > 0; ) {
+        const int count = remaining < spec->polyphony ? remaining : spec->polyphony;
+        remaining -= count;
+
+        for (int i = 0; i < count; i++) {
+            keys[i] = 21 + next_random(rng) % 88;
+            put_vlq(track, i == 0 ? delta : 0);
+            if (!spec->running_status || last_status != (0x90 | channel)) put_byte(track, 0x90 | channel);
+            last_status = 0x90 | channel;
+            put_byte(track, keys[i]);
+            put_byte(track, 1 + next_random(rng) % 127);
+        }
+
+        for (int i = 0; i < count; i++) {
+            put_vlq(track, i == 0 ? SYNTH_NOTE_LENGTH : 0);
+            if (spec->running_status) {
+                // Velocity 0 note-on, so the status byte can be left out
+                if (last_status != (0x90 | channel)) put_byte(track, 0x90 | channel);
+                put_byte(track, keys[i]);
+                put_byte(track, 0);
+            } else {
+                put_byte(track, 0x80 | channel);
+                put_byte(track, keys[i]);
+                put_byte(track, 64);
+            }
+        }
+
+        delta = SYNTH_GAP + next_random(rng) % SYNTH_JITTER;
+    }
+
+    put_vlq(track, 0);
+    put_byte(track, 0xFF);
+    put_byte(track, 0x2F);
+    put_byte(track, 0);
+}
+
+static bool write_synthetic_midi(const char* path, const SyntheticSpec* spec) {
+    if (spec->tracks < 1 || spec->notes_per_track < 1 || spec->polyphony < 1 || spec->polyphony > 128 ||
+        spec->tempo_changes < 0 || spec->tracks + 1 > 0xFFFF) {
+        fprintf(stderr, "Invalid synthetic file parameters\n");
+        return false;
+    }
+
+    ByteBuffer file = {0};
+    ByteBuffer track = {0};
+    uint32_t rng = spec->seed ? spec->seed : 1;
+
+    const char header[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1 };
+    for (size_t i = 0; i < sizeof(header); i++) put_byte(&file, header[i]);
+    put_byte(&file, (spec->tracks + 1) >> 8);
+    put_byte(&file, (spec->tracks + 1) & 0xFF);
+    put_byte(&file, SYNTH_DIVISION >> 8);
+    put_byte(&file, SYNTH_DIVISION & 0xFF);
+
+    put_tempo_track(&track, spec, &rng);
+    put_chunk(&file, "MTrk", &track);
+    for (int i = 0; i < spec->tracks; i++) {
+        track.size = 0;
+        put_note_track(&track, spec, i, &rng);
+        put_chunk(&file, "MTrk", &track);
+    }
+
+    FILE* out = fopen(path, "wb");
+    const bool ok = out && fwrite(file.data, 1, file.size, out) == file.size;
+    if (out) fclose(out);
+    if (!ok) fprintf(stderr, "Could not write %s\n", path);
+
+    free(track.data);
+    free(file.data);
+    return ok;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// One row: best and median of the iterations, rates from the best
+static void report(BenchOutput* output, const char* bench, const char* name, const char* unit, const uint64_t items, uint64_t* times) {
+    qsort(times, output->iterations, sizeof(uint64_t), compare_u64);
+    const uint64_t best = times[0];
+    const uint64_t median = times[output->iterations / 2];
+    const double per_item = items ? (double)best / (double)items : 0.0;
+    const double per_second = best ? (double)items * 1e9 / (double)best : 0.0;
+
+    if (output->json) {
+        fprintf(output->out, "{\"bench\":\"%s\",\"case\":\"%s\",\"unit\":\"%s\",\"items\":%llu,\"iterations\":%d,"
+            "\"best_ns\":%llu,\"median_ns\":%llu,\"ns_per_item\":%.3f,\"items_per_sec\":%.0f}\n",
+            bench, name, unit, (unsigned long long)items, output->iterations,
+            (unsigned long long)best, (unsigned long long)median, per_item, per_second);
+    } else {
+        if (output->header) {
+            fprintf(output->out, "bench,case,unit,items,iterations,best_ns,median_ns,ns_per_item,items_per_sec\n");
+            output->header = false;
+        }
+        fprintf(output->out, "%s,%s,%s,%llu,%d,%llu,%llu,%.3f,%.0f\n",
+            bench, name, unit, (unsigned long long)items, output->iterations,
+            (unsigned long long)best, (unsigned long long)median, per_item, per_second);
+    }
+    fflush(output->out);
+}
+
+static void bench_load(BenchOutput* output, const char* name, const char* path, const bool mapped) {
+    uint64_t* times = calloc(output->iterations, sizeof(uint64_t));
+    uint64_t bytes = 0;
+
+    for (int it = 0; it < output->iterations; it++) {
+        uint16_t time_div = 0;
+        int track_count = 0;
+        MidiMapping mapping = {0};
+
+        const uint64_t start = midi_timer_now_ns();
+        TrackData* tracks = mapped
+            ? load_midi_file_mapped(path, &time_div, &track_count, &mapping)
+            : load_midi_file(path, &time_div, &track_count);
+        times[it] = midi_timer_now_ns() - start;
+
+        if (!tracks) {
+            free(times);
+            return;
+        }
+        bytes = 0;
+        for (int i = 0; i < track_count; i++) {
+            bytes += tracks[i].length;
+            free_track_data(&tracks[i]);
+        }
+        free(tracks);
+        unmap_midi_file(&mapping);
+    }
+
+    report(output, mapped ? "load_mapped" : "load", name, "bytes", bytes, times);
+    free(times);
+}
+
+// Variable-length quantities of 1 to 4 bytes, like the deltas and lengths of a real file
+static void bench_vlq(BenchOutput* output) {
+    ByteBuffer buffer = {0};
+    uint32_t rng = 7;
+    for (int i = 0; i < VLQ_COUNT; i++) {
+        const uint32_t bits = 7 * (1 + next_random(&rng) % 4);
+        put_vlq(&buffer, next_random(&rng) & ((1u << bits) - 1));
+    }
+
+    uint64_t* times = calloc(output->iterations, sizeof(uint64_t));
+    volatile uint64_t sink = 0;
+    for (int it = 0; it < output->iterations; it++) {
+        TrackData track;
+        memset(&track, 0, sizeof(TrackData));
+        track.data = buffer.data;
+        track.length = buffer.size;
+
+        uint64_t sum = 0;
+        const uint64_t start = midi_timer_now_ns();
+        while (track.offset < track.length) {
+            sum += decode_variable_length(&track);
+        }
+        times[it] = midi_timer_now_ns() - start;
+        sink += sum;
+    }
+
+    report(output, "decode_vlq", "mixed", "values", VLQ_COUNT, times);
+    free(times);
+    free(buffer.data);
+}
+
+static bool count_meta(void* context, const uint64_t tick, const uint8_t status, const uint8_t type, const uint8_t* payload, const size_t length) {
+    (void)tick;
+    (void)status;
+    (void)type;
+    (void)payload;
+    *(uint64_t*)context += length;
+    return true;
+}
+
+// The load-time counting pass over every track on one thread, once per scanner the CPU runs
+static void bench_scan(BenchOutput* output, const char* name, const char* path) {
+    uint16_t time_div = 0;
+    int track_count = 0;
+    MidiMapping mapping = {0};
+    TrackData* tracks = load_midi_file_mapped(path, &time_div, &track_count, &mapping);
+    if (!tracks) return;
+
+    uint64_t bytes = 0;
+    for (int i = 0; i < track_count; i++) bytes += tracks[i].length;
+
+    uint64_t* times = calloc(output->iterations, sizeof(uint64_t));
+    volatile uint64_t sink = 0;
+    for (int level = 0; level < MIDI_SCAN_LEVELS; level++) {
+        if (!midi_scan_supported(level)) continue;
+
+        for (int it = 0; it < output->iterations; it++) {
+            uint64_t sum = 0;
+            const uint64_t start = midi_timer_now_ns();
+            for (int i = 0; i < track_count; i++) {
+                TrackData track = tracks[i];
+                TrackStats stats;
+                midi_scan_track(&track, level, &stats, count_meta, &sum);
+                sum += stats.event_count;
+            }
+            times[it] = midi_timer_now_ns() - start;
+            sink += sum;
+        }
+
+        char bench[64];
+        snprintf(bench, sizeof(bench), "scan_%s", midi_scan_level_name(level));
+        report(output, bench, name, "bytes", bytes, times);
+    }
+
+    free(times);
+    for (int i = 0; i < track_count; i++) free_track_data(&tracks[i]);
+    free(tracks);
+    unmap_midi_file(&mapping);
+}
+
+// The offline loop is the playback loop without its sleeps; the null sink leaves only the player
+static void bench_play(BenchOutput* output, const char* name, const char* path, const char* variant,
+    const MidiScheduler scheduler, const bool predecode, const bool merge) {
+    uint64_t* times = calloc(output->iterations, sizeof(uint64_t));
+    uint64_t events = 0;
+
+    for (int it = 0; it < output->iterations; it++) {
+        MidiOfflineReport result;
+        memset(&result, 0, sizeof(MidiOfflineReport));
+
+        MidiPlayerOptions options;
+        InitMIDIPlayerOptions(&options);
+        options.offline = true;
+        options.offline_report = &result;
+        options.sink = MIDI_SINK_NULL;
+        options.min_velocity = 0;
+        options.scheduler = scheduler;
+        options.predecode = predecode;
+        options.merge_timeline = merge;
+
+        if (PlayMIDIWithOptions((char*)path, &options, NULL, NULL, NULL)) {
+            free(times);
+            return;
+        }
+        times[it] = result.play_ns;
+        events = result.events;
+    }
+
+    char bench[64];
+    snprintf(bench, sizeof(bench), "play_%s", variant);
+    report(output, bench, name, "events", events, times);
+    free(times);
+}
+
+static uint64_t ring_checksum(const MidiEvent* events, const size_t count) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) sum += events[i].time_us;
+    return sum;
+}
+
+// Same thread: the cost of the push and pop themselves, without any cache line moving between cores
+static void bench_ring_single(BenchOutput* output) {
+    EventRing ring;
+    event_ring_init(&ring);
+    MidiEvent* storage = calloc(RING_CAPACITY, sizeof(MidiEvent));
+    event_ring_publish(&ring, storage, RING_CAPACITY);
+
+    MidiEvent batch[RING_BATCH];
+    for (int i = 0; i < RING_BATCH; i++) batch[i] = (MidiEvent){ (uint32_t)i, 0, 60, 100, MIDI_EVENT_NOTE_ON };
+
+    uint64_t* times = calloc(output->iterations, sizeof(uint64_t));
+    volatile uint64_t sink = 0;
+    for (int it = 0; it < output->iterations; it++) {
+        uint64_t sum = 0;
+        const uint64_t start = midi_timer_now_ns();
+        for (size_t sent = 0; sent < RING_EVENTS; sent += RING_BATCH) {
+            event_ring_push_batch(&ring, batch, RING_BATCH);
+            MidiEvent out[RING_BATCH];
+            const size_t n = event_ring_pop_batch(&ring, out, RING_BATCH);
+            sum += ring_checksum(out, n);
+        }
+        times[it] = midi_timer_now_ns() - start;
+        sink += sum;
+    }
+
+    report(output, "ring", "single_thread", "events", RING_EVENTS, times);
+    free(times);
+    free(storage);
+}
+
+static void* ring_consumer(void* arg) {
+    EventRing* ring = (EventRing*)arg;
+    MidiEvent out[RING_BATCH];
+    uint64_t received = 0;
+    uint64_t sum = 0;
+    while (received < RING_EVENTS) {
+        const size_t n = event_ring_pop_batch(ring, out, RING_BATCH);
+        if (n == 0) sched_yield();  // Leaves the core to the producer when both share one
+        sum += ring_checksum(out, n);
+        received += n;
+    }
+    return (void*)(uintptr_t)sum;
+}
+
+// Producer and consumer on their own threads, as between the MIDI thread and the renderer
+static void bench_ring_threads(BenchOutput* output) {
+    MidiEvent* storage = calloc(RING_CAPACITY, sizeof(MidiEvent));
+    MidiEvent batch[RING_BATCH];
+    for (int i = 0; i < RING_BATCH; i++) batch[i] = (MidiEvent){ (uint32_t)i, 0, 60, 100, MIDI_EVENT_NOTE_ON };
+
+    uint64_t* times = calloc(output->iterations, sizeof(uint64_t));
+    for (int it = 0; it < output->iterations; it++) {
+        EventRing* ring = aligned_alloc(64, sizeof(EventRing));
+        event_ring_init(ring);
+        event_ring_publish(ring, storage, RING_CAPACITY);
+
+        pthread_t consumer;
+        const uint64_t start = midi_timer_now_ns();
+        if (pthread_create(&consumer, NULL, ring_consumer, ring) != 0) {
+            fprintf(stderr, "Could not start consumer thread\n");
+            free(ring);
+            break;
+        }
+        for (size_t sent = 0; sent < RING_EVENTS; ) {
+            const size_t n = event_ring_push_batch(ring, batch, RING_BATCH);
+            if (n == 0) sched_yield();
+            sent += n;
+        }
+        pthread_join(consumer, NULL);
+        times[it] = midi_timer_now_ns() - start;
+        free(ring);
+    }
+
+    report(output, "ring", "two_threads", "events", RING_EVENTS, times);
+    free(times);
+    free(storage);
+}
+
+static void bench_file(BenchOutput* output, const char* name, const char* path) {
+    bench_load(output, name, path, false);
+    bench_load(output, name, path, true);
+    bench_scan(output, name, path);
+    bench_play(output, name, path, "stream_linear", MIDI_SCHEDULER_LINEAR, false, false);
+    bench_play(output, name, path, "stream_heap", MIDI_SCHEDULER_HEAP, false, false);
+    bench_play(output, name, path, "predecoded_heap", MIDI_SCHEDULER_HEAP, true, false);
+    bench_play(output, name, path, "merged", MIDI_SCHEDULER_LINEAR, true, true);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--json] [--iterations <n>] [--verbose] [--file <midi_file>]\n"
+        "       [--tracks <n>] [--notes <n>] [--polyphony <n>] [--tempo-changes <n>] [--no-running-status] [--seed <n>]\n"
+        "       [--generate <out.mid>]\n"
+        "Without --file or any of the shape options every built-in synthetic file is benchmarked.\n", program);
+}
+
+int main(const int argc, char* argv[]) {
+    BenchOutput output = { stdout, false, 5, true };
+    SyntheticSpec custom = { "custom", 16, 20000, 4, 100, true, 1 };
+    bool use_custom = false;
+    bool verbose = false;
+    const char* file = NULL;
+    const char* generate = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            output.json = true;
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            output.iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            file = argv[++i];
+        } else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+            generate = argv[++i];
+        } else if (strcmp(argv[i], "--tracks") == 0 && i + 1 < argc) {
+            custom.tracks = atoi(argv[++i]);
+            use_custom = true;
+        } else if (strcmp(argv[i], "--notes") == 0 && i + 1 < argc) {
+            custom.notes_per_track = atoi(argv[++i]);
+            use_custom = true;
+        } else if (strcmp(argv[i], "--polyphony") == 0 && i + 1 < argc) {
+            custom.polyphony = atoi(argv[++i]);
+            use_custom = true;
+        } else if (strcmp(argv[i], "--tempo-changes") == 0 && i + 1 < argc) {
+            custom.tempo_changes = atoi(argv[++i]);
+            use_custom = true;
+        } else if (strcmp(argv[i], "--no-running-status") == 0) {
+            custom.running_status = false;
+            use_custom = true;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            custom.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+            use_custom = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (output.iterations < 1) output.iterations = 1;
+
+    if (generate) return write_synthetic_midi(generate, &custom) ? 0 : 1;
+
+    // The player reports every phase on stdout; keep the results alone there
+    if (!verbose) {
+        const int results = dup(STDOUT_FILENO);
+        const int null = open("/dev/null", O_WRONLY);
+        if (results >= 0 && null >= 0) {
+            fflush(stdout);
+            output.out = fdopen(results, "w");
+            dup2(null, STDOUT_FILENO);
+        }
+        if (null >= 0) close(null);
+        if (!output.out) output.out = stderr;
+    }
+
+    bench_vlq(&output);
+    bench_ring_single(&output);
+    bench_ring_threads(&output);
+
+    if (file) {
+        bench_file(&output, "file", file);
+        return 0;
+    }
+
+    const SyntheticSpec* specs = use_custom ? &custom : default_specs;
+    const int spec_count = use_custom ? 1 : (int)(sizeof(default_specs) / sizeof(default_specs[0]));
+    for (int i = 0; i < spec_count; i++) {
+        char path[] = "/tmp/bench_midiplayer_XXXXXX";
+        const int fd = mkstemp(path);
+        if (fd < 0) {
+            fprintf(stderr, "Could not create a temporary file\n");
+            return 1;
+        }
+        close(fd);
+
+        if (write_synthetic_midi(path, &specs[i])) bench_file(&output, specs[i].name, path);
+        unlink(path);
+    }
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "raylib.h"
+#include "frameprofiler.h"
+
+static const char* row_names[FRAME_ROWS] = {
+    "clear", "queue", "active", "roll", "background", "grid", "keyboard", "hud", "present", "readback",
+    "frame", "player schedule", "player dispatch",
+};
+
+void frame_profiler_init(FrameProfiler* profiler) {
+    memset(profiler, 0, sizeof(FrameProfiler));
+}
+
+void frame_profiler_begin_frame(FrameProfiler* profiler, const uint64_t start_ns) {
+    memset(&profiler->current, 0, sizeof(FrameRecord));
+    profiler->current.start_ns = start_ns;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    const uint32_t x = *(const uint32_t*)a;
+    const uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void refresh_stats(FrameProfiler* profiler) {
+    const size_t count = profiler->count < FRAME_PROFILE_FRAMES ? (size_t)profiler->count : FRAME_PROFILE_FRAMES;
+    uint32_t values[FRAME_PROFILE_FRAMES];
+
+    for (int row = 0; row < FRAME_ROWS; row++) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            values[i] = profiler->frames[i].row_ns[row];
+            total += values[i];
+        }
+        qsort(values, count, sizeof(uint32_t), compare_u32);
+        profiler->mean_ms[row] = (float)((double)total / count / 1e6);
+        profiler->p99_ms[row] = (float)(values[(count * 99 + 99) / 100 - 1] / 1e6);
+    }
+}
+
+// The player's totals restart with every song, so a total below the last one counts from zero
+void frame_profiler_end_frame(FrameProfiler* profiler, const uint64_t schedule_ns, const uint64_t dispatch_ns) {
+    FrameRecord* frame = &profiler->current;
+    frame->row_ns[FRAME_ROW_FRAME] = (uint32_t)(midi_timer_now_ns() - frame->start_ns);
+    frame->row_ns[FRAME_ROW_SCHEDULE] = (uint32_t)(schedule_ns - (schedule_ns >= profiler->schedule_ns ? profiler->schedule_ns : 0));
+    frame->row_ns[FRAME_ROW_DISPATCH] = (uint32_t)(dispatch_ns - (dispatch_ns >= profiler->dispatch_ns ? profiler->dispatch_ns : 0));
+    profiler->schedule_ns = schedule_ns;
+    profiler->dispatch_ns = dispatch_ns;
+
+    profiler->frames[profiler->count % FRAME_PROFILE_FRAMES] = *frame;
+    profiler->count++;
+    if (profiler->count % FRAME_PROFILE_REFRESH == 0 || profiler->count < FRAME_PROFILE_REFRESH) refresh_stats(profiler);
+}
+
+// The default font isn't monospaced, so every column is drawn at its own x
+void frame_profiler_draw(const FrameProfiler* profiler, const int x, const int y) {
+    const int line = 12;
+    DrawRectangle(x, y, 230, (FRAME_ROWS + 1) * line + 10, (Color){ 0, 0, 0, 160 });
+    DrawText("stage", x + 5, y + 5, 10, GRAY);
+    DrawText("mean ms", x + 110, y + 5, 10, GRAY);
+    DrawText("p99 ms", x + 170, y + 5, 10, GRAY);
+    for (int row = 0; row < FRAME_ROWS; row++) {
+        const int rowY = y + 5 + (row + 1) * line;
+        const Color color = row == FRAME_ROW_FRAME ? WHITE : LIGHTGRAY;
+        DrawText(row_names[row], x + 5, rowY, 10, color);
+        DrawText(TextFormat("%.3f", profiler->mean_ms[row]), x + 110, rowY, 10, color);
+        DrawText(TextFormat("%.3f", profiler->p99_ms[row]), x + 170, rowY, 10, color);
+    }
+}
+
+// Chrome trace JSON, for chrome://tracing or Perfetto: a complete event per frame and stage on the render thread,
+// and a counter for the player's time over each frame
+bool frame_profiler_write_trace(const FrameProfiler* profiler, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Cannot open trace file %s\n", path);
+        return false;
+    }
+
+    const uint64_t count = profiler->count < FRAME_PROFILE_FRAMES ? profiler->count : FRAME_PROFILE_FRAMES;
+    const uint64_t first = profiler->count - count;
+    const uint64_t origin = count ? profiler->frames[first % FRAME_PROFILE_FRAMES].start_ns : 0;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"render\"}}");
+    for (uint64_t i = first; i < profiler->count; i++) {
+        const FrameRecord* frame = &profiler->frames[i % FRAME_PROFILE_FRAMES];
+        const double start = (double)(frame->start_ns - origin) / 1e3;
+
+        fprintf(file, ",\n{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+            start, frame->row_ns[FRAME_ROW_FRAME] / 1e3);
+        for (int stage = 0; stage < FRAME_STAGES; stage++) {
+            if (frame->row_ns[stage] == 0) continue;
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                row_names[stage], start + frame->begin_ns[stage] / 1e3, frame->row_ns[stage] / 1e3);
+        }
+        fprintf(file, ",\n{\"name\":\"player\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"schedule_ms\":%.3f,\"dispatch_ms\":%.3f}}",
+            start, frame->row_ns[FRAME_ROW_SCHEDULE] / 1e6, frame->row_ns[FRAME_ROW_DISPATCH] / 1e6);
+    }
+    fprintf(file, "\n]}\n");
+
+    const bool ok = fclose(file) == 0;
+    if (!ok) fprintf(stderr, "Failed to write trace file %s\n", path);
+    else printf("Wrote %lu frames to %s\n", (unsigned long)count, path);
+    return ok;
+}
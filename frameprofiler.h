@@ -0,0 +1,70 @@
+// frame_profiler.h
+#ifndef FRAME_PROFILER_H
+#define FRAME_PROFILER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "miditimer.h"
+
+#define FRAME_PROFILE_FRAMES 512    // Frames kept in the ring, about 3.5 s at 144 fps
+#define FRAME_PROFILE_REFRESH 32    // Frames between two recomputations of the overlay's statistics
+
+// Stages of the render loop, in the order a frame runs them. raylib batches its draws, so the GPU work
+// they queue shows up in PRESENT, where EndDrawing flushes the batch, swaps and waits for the frame limiter.
+typedef enum {
+    FRAME_STAGE_CLEAR,          // Live view: clearing ahead of the drawing edge
+    FRAME_STAGE_QUEUE,          // Live view: draining the event ring into note rectangles
+    FRAME_STAGE_ACTIVE,         // Live view: extending sounding notes to the edge
+    FRAME_STAGE_ROLL,           // Pre-roll: reading the roll, rasterizing and uploading the strip
+    FRAME_STAGE_BACKGROUND,     // Scroll texture onto the screen
+    FRAME_STAGE_GRID,
+    FRAME_STAGE_KEYBOARD,
+    FRAME_STAGE_HUD,            // Text, this overlay included
+    FRAME_STAGE_PRESENT,
+    FRAME_STAGE_READBACK,       // Export: reading the frame back and queueing it for the encoder
+    FRAME_STAGES,
+} FrameStage;
+
+// Statistics rows: every stage, then the whole frame, then what the player's threads spent over the frame
+#define FRAME_ROW_FRAME FRAME_STAGES
+#define FRAME_ROW_SCHEDULE (FRAME_STAGES + 1)
+#define FRAME_ROW_DISPATCH (FRAME_STAGES + 2)
+#define FRAME_ROWS (FRAME_STAGES + 3)
+
+typedef struct {
+    uint64_t start_ns;                  // CLOCK_MONOTONIC at the top of the frame
+    uint32_t begin_ns[FRAME_STAGES];    // First entry into each stage, after start_ns
+    uint32_t row_ns[FRAME_ROWS];        // 0 for stages the frame skipped
+} FrameRecord;
+
+// Per-frame stage timings, kept for the last FRAME_PROFILE_FRAMES frames. Only the render thread touches it;
+// the player's share comes in as the totals of its metrics, once a frame.
+typedef struct {
+    FrameRecord frames[FRAME_PROFILE_FRAMES];
+    uint64_t count;             // Frames recorded; the newest is frames[(count - 1) % FRAME_PROFILE_FRAMES]
+    FrameRecord current;
+    uint64_t schedule_ns;       // Player totals as of the previous frame
+    uint64_t dispatch_ns;
+    float mean_ms[FRAME_ROWS];  // Over the ring, as of the last refresh
+    float p99_ms[FRAME_ROWS];
+} FrameProfiler;
+
+void frame_profiler_init(FrameProfiler* profiler);
+void frame_profiler_begin_frame(FrameProfiler* profiler, uint64_t start_ns);
+void frame_profiler_end_frame(FrameProfiler* profiler, uint64_t schedule_ns, uint64_t dispatch_ns);
+void frame_profiler_draw(const FrameProfiler* profiler, int x, int y);
+bool frame_profiler_write_trace(const FrameProfiler* profiler, const char* path);
+
+inline __attribute__((always_inline)) static void frame_profiler_end(FrameProfiler* profiler, const FrameStage stage, const uint64_t begin_ns) {
+    FrameRecord* frame = &profiler->current;
+    if (frame->row_ns[stage] == 0) frame->begin_ns[stage] = (uint32_t)(begin_ns - frame->start_ns);
+    frame->row_ns[stage] += (uint32_t)(midi_timer_now_ns() - begin_ns);
+}
+
+// Times the statement or block that follows as one stage; leaving it with break or return skips the timing
+#define FRAME_ZONE(profiler, stage) \
+    for (uint64_t zone_begin_ = midi_timer_now_ns(), zone_once_ = 1; zone_once_; \
+        zone_once_ = 0, frame_profiler_end((profiler), (stage), zone_begin_))
+
+#endif
@@ -2,12 +2,18 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "raylib.h"
 #include "midiplayer.h"
+#include "midiring.h"
+#include "noterender.h"
+#include "rollstrip.h"
+#include "frameprofiler.h"
+#include "videoexport.h"
 
 #define NOTE_HEIGHT 6
 #define MAX_KEYS 128
@@ -15,7 +21,13 @@
 #define FLASH_DURATION 0.15f
 
 #define SCROLL_TEXTURE_WIDTH 6400  // Width of the scrolling texture buffer (in pixels)
-#define RING_BUFFER_SIZE 13414000
+#define EVENT_RING_MIN (1 << 12)  // Fewest events the ring holds, for files without a note peak to speak of
+#define EVENT_RING_MAX (1 << 24)  // Most events the ring is allowed to hold
+#define EVENT_RING_LATENCY_MS 100 // How far the renderer may fall behind the peak note rate before events drop
+#define EVENT_RING_BURSTS 2       // Biggest single-step bursts held on top of that, for one landing while the last is queued
+#define EVENT_BATCH 1024          // Events the renderer drains per pop
+#define ROLL_BATCH 1024           // Notes read from a roll per call
+#define SEEK_STEP_NS 5000000000ULL  // How far the arrow keys seek
 
 #define CLEAR_WIDTH_MULTIPLIER 1.5f
 
@@ -23,94 +35,67 @@
 #define KEY_ANIMATION_DURATION 0.5f  // Duration of key animation in seconds
 #define KEYBOARD_WIDTH 20
 
-typedef struct {
-    uint8_t note;
-    uint8_t velocity;
-    uint8_t channel;
-    bool isNoteOn;
-    double timestamp;
-} MidiEvent;
-
-typedef struct {
-    bool isActive;
-    uint8_t velocity;
-    double startTime;
-    float startX;   
-    bool needsDrawing; 
-    double keyPressTime;
-    double keyReleaseTime;
-    bool keyIsPressed;    
-} ActiveNote;
+#define KEY_WORDS (MAX_KEYS / 64)
 
+// Note and key state, only ever touched by the render thread. The masks say which entries are live, so a
+// frame's work follows the number of sounding and fading notes instead of sweeping every channel and key.
 typedef struct {
-    MidiEvent events[RING_BUFFER_SIZE];
-    int head;
-    int tail;
-    pthread_mutex_t mutex;
-} EventQueue;
-
-static EventQueue eventQueue = {0};
-static double globalTime = 0.0;
-static double timeOffset = 0.0;
+    uint64_t sounding[MAX_CHANNELS][KEY_WORDS];    // Notes extended to the drawing edge every frame
+    uint64_t pressed[MAX_CHANNELS][KEY_WORDS];     // Keys lit at full brightness
+    uint64_t fading[MAX_CHANNELS][KEY_WORDS];      // Released keys in fadeList
+    float startX[MAX_CHANNELS][MAX_KEYS];          // Live view: texture x where a sounding note began
+    uint64_t startNs[MAX_CHANNELS][MAX_KEYS];      // Pre-roll: song time of the note-on that opened a key
+    uint16_t depth[MAX_CHANNELS][MAX_KEYS];        // Pre-roll: note-ons still waiting for their note-off
+    float releaseTime[MAX_CHANNELS][MAX_KEYS];
+    uint16_t fadeList[MAX_CHANNELS * MAX_KEYS];    // channel << 7 | key
+    int fadeCount;
+} NoteState;
+
+static EventRing eventRing;       // MIDI thread to render loop
+static double globalTime = 0.0;   // Seconds since clockBaseNs, as of this frame's clock reading
+static uint64_t clockBaseNs = 0;   // CLOCK_MONOTONIC at startup, so frame times fit in a float
+static MidiClock frameClock;       // Player clock, read once at the top of every frame
 static float scrollSpeed = 500.0f; // pixels per second
 static RenderTexture2D scrollTexture;
-static bool textureNeedsUpdate = false;   // true when new events have arrived
+static NoteRenderer noteRenderer;  // Every note rectangle of a frame goes through here
+static RollStrip rollStrip;        // Pre-roll: the stretch revealed each frame, rasterized per key and column
 static int screenWidth = 1600;
 static int screenHeight = 900;
-static uint64_t notesPerSecond = 0;
+static atomic_uint_least64_t notesPerSecond;  // Written by the player's metrics thread
+static atomic_uint_least64_t ringDropped;     // Note events that found the ring full, written by the MIDI thread
 static float scrollOffset = 0.0f;
 static double deltaTime = 0.0;
 static double previousDeltaTime = 0.0; // For smoothing
 
-// Track active notes per channel and note number
-static ActiveNote activeNotes[MAX_CHANNELS][MAX_KEYS] = {0};
+static NoteState noteState;
 
 // We'll track the time up to which events have been drawn:
 static double drawnTime = 0.0;
 static double lastClearTime = 0.0;  // Track when we last cleared the texture
 
-static void init_event_queue() {
-    eventQueue.head = 0;
-    eventQueue.tail = 0;
-    pthread_mutex_init(&eventQueue.mutex, NULL);
+static MidiPlayerOptions playerOptions;
+static MidiMetrics playerMetrics;  // Polled by the renderer while the MIDI thread plays
+static MidiPlayer* player = NULL;  // A single file plays through a handle the keys can pause and seek; a playlist runs on its own thread
 
-    for (int c = 0; c < MAX_CHANNELS; c++) {
-        for (int n = 0; n < MAX_KEYS; n++) {
-            activeNotes[c][n].isActive = false;
-            activeNotes[c][n].velocity = 0;
-            activeNotes[c][n].startTime = 0.0;
-            activeNotes[c][n].startX = 0.0f;
-            activeNotes[c][n].needsDrawing = false;
-            activeNotes[c][n].keyPressTime = 0.0;
-            activeNotes[c][n].keyReleaseTime = 0.0;
-            activeNotes[c][n].keyIsPressed = false;
-        }
-    }
-}
+// Pre-roll: notes are read from the song itself and drawn before they sound
+static float prerollSeconds = -1.0f;      // How far ahead; below 0 for the width of the screen, 0 to draw notes as they play
+static _Atomic(MidiRoll*) pendingRoll;    // Handed over by the MIDI thread as each song starts
+static MidiRoll* drawRoll = NULL;         // Read ahead of the playhead
+static MidiRoll* keyRoll = NULL;          // Read up to the playhead, for the keyboard
+static uint64_t rollPositionNs = 0;       // Playhead in song time
+static double rollDrawnX = 0.0;           // Song position, in pixels, up to which the roll has been drawn
 
-inline __attribute__((always_inline)) static bool queue_push(const MidiEvent event) {
-    bool success = false;
-    pthread_mutex_lock(&eventQueue.mutex);
-    int next = (eventQueue.head + 1) % RING_BUFFER_SIZE;
-    if (next != eventQueue.tail) {
-        eventQueue.events[eventQueue.head] = event;
-        eventQueue.head = next;
-        success = true;
-    }
-    pthread_mutex_unlock(&eventQueue.mutex);
-    return success;
-}
+static FrameProfiler frameProfiler;       // Stage timings of the last frames, for the overlay and the trace
+static bool showProfiler = false;         // F3 toggles the overlay
+static const char* tracePath = NULL;      // Chrome trace of the last frames, written at exit
 
-inline __attribute__((always_inline)) static bool queue_pop(MidiEvent* event) {
-    bool success = false;
-    pthread_mutex_lock(&eventQueue.mutex);
-    if (eventQueue.tail != eventQueue.head) {
-        *event = eventQueue.events[eventQueue.tail];
-        eventQueue.tail = (eventQueue.tail + 1) % RING_BUFFER_SIZE;
-        success = true;
-    }
-    pthread_mutex_unlock(&eventQueue.mutex);
-    return success;
+static const char* exportPath = NULL;     // Render a video here instead of playing
+static const char* exportEncoder = NULL;  // Encoder command reading raw frames on stdin, NULL for ffmpeg
+static int exportFps = 60;
+
+static void init_event_queue() {
+    event_ring_init(&eventRing);
+    memset(&noteState, 0, sizeof(NoteState));
 }
 
 inline __attribute__((always_inline)) static float get_note_y_piano(const uint8_t note) {
@@ -129,64 +114,100 @@ inline __attribute__((always_inline)) static Color get_note_color(uint8_t channe
     return channelColors[channel % MAX_CHANNELS];
 }
 
-// Get an animation alpha value based on press/release time
-inline __attribute__((always_inline)) static float get_key_animation_alpha(double pressTime, double releaseTime, bool isPressed, double currentTime) {
-    float alpha = 0.0f;
-
-    if (isPressed) {
-        // Key is currently pressed - full brightness
-        alpha = 1.0f;
-    } else if (releaseTime > 0.0) {
-        // Key was recently released - fade out
-        float timeSinceRelease = currentTime - releaseTime;
-        if (timeSinceRelease < KEY_ANIMATION_DURATION) {
-            alpha = 1.0f - (timeSinceRelease / KEY_ANIMATION_DURATION);
-        }
-    }
+inline __attribute__((always_inline)) static bool key_bit(const uint64_t* mask, const uint8_t note) {
+    return (mask[note >> 6] >> (note & 63)) & 1;
+}
 
-    return alpha;
+inline __attribute__((always_inline)) static void set_key_bit(uint64_t* mask, const uint8_t note) {
+    mask[note >> 6] |= 1ULL << (note & 63);
 }
 
-inline __attribute__((always_inline)) static void note_on(uint8_t channel, const uint8_t note, const uint8_t velocity) {
-    MidiEvent event = {
-        .note = note,
-        .velocity = velocity,
-        .channel = channel,
-        .isNoteOn = true,
-        .timestamp = GetTime() - timeOffset
-    };
+inline __attribute__((always_inline)) static void clear_key_bit(uint64_t* mask, const uint8_t note) {
+    mask[note >> 6] &= ~(1ULL << (note & 63));
+}
 
-    activeNotes[channel][note].isActive = true;
-    activeNotes[channel][note].velocity = velocity;
-    activeNotes[channel][note].startTime = event.timestamp;
-    activeNotes[channel][note].needsDrawing = true;  // Mark that this note needs initial drawing
-    activeNotes[channel][note].keyPressTime = event.timestamp;
-    activeNotes[channel][note].keyIsPressed = true;
+inline __attribute__((always_inline)) static void press_key(const uint8_t channel, const uint8_t note) {
+    set_key_bit(noteState.pressed[channel], note);
+}
 
-    queue_push(event);
-    textureNeedsUpdate = true;
+// Released keys go on the fade list once; a key released again while fading just restarts its fade
+inline __attribute__((always_inline)) static void release_key(const uint8_t channel, const uint8_t note, const float time) {
+    clear_key_bit(noteState.pressed[channel], note);
+    noteState.releaseTime[channel][note] = time;
+    if (!key_bit(noteState.fading[channel], note)) {
+        set_key_bit(noteState.fading[channel], note);
+        noteState.fadeList[noteState.fadeCount++] = (uint16_t)(channel << 7 | note);
+    }
 }
 
-inline __attribute__((always_inline)) static void note_off(uint8_t channel, const uint8_t note) {
-    MidiEvent event = {
-        .note = note,
-        .velocity = 0,
-        .channel = channel,
-        .isNoteOn = false,
-        .timestamp = GetTime() - timeOffset
-    };
+// Brightest channel of every key: held keys are at full brightness with the lowest channel winning, released
+// ones fade out over KEY_ANIMATION_DURATION. Fades that are over leave the list.
+static void get_key_highlights(float alpha[MAX_KEYS], int channel[MAX_KEYS], const double currentTime) {
+    for (int n = 0; n < MAX_KEYS; n++) {
+        alpha[n] = 0.0f;
+        channel[n] = -1;
+    }
 
-    activeNotes[channel][note].isActive = false;
-    activeNotes[channel][note].needsDrawing = false;
-    activeNotes[channel][note].keyReleaseTime = event.timestamp;
-    activeNotes[channel][note].keyIsPressed = false;
+    for (int c = 0; c < MAX_CHANNELS; c++) {
+        for (int w = 0; w < KEY_WORDS; w++) {
+            uint64_t bits = noteState.pressed[c][w];
+            while (bits) {
+                const int n = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (channel[n] < 0) {
+                    alpha[n] = 1.0f;
+                    channel[n] = c;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < noteState.fadeCount; i++) {
+        const int c = noteState.fadeList[i] >> 7;
+        const int n = noteState.fadeList[i] & 0x7F;
+        const float timeSinceRelease = (float)(currentTime - noteState.releaseTime[c][n]);
+
+        if (timeSinceRelease >= KEY_ANIMATION_DURATION) {
+            clear_key_bit(noteState.fading[c], (uint8_t)n);
+            noteState.fadeList[i--] = noteState.fadeList[--noteState.fadeCount];
+            continue;
+        }
+
+        const float fade = 1.0f - (timeSinceRelease / KEY_ANIMATION_DURATION);
+        if (fade > alpha[n] || (fade == alpha[n] && c < channel[n])) {
+            alpha[n] = fade;
+            channel[n] = c;
+        }
+    }
+}
+
+// Every note of a dispatch step at once, one ring push per batch, stamped with the time the player scheduled it
+// for rather than when it got here. The note state is the render thread's; it follows the ring.
+static void note_batch(const MidiNoteEvent* notes, const size_t count) {
+    MidiEvent events[NOTE_BATCH_SIZE];
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t channel = notes[i].channel;
+        const uint8_t note = notes[i].note;
+        const uint8_t velocity = notes[i].velocity;
+
+        events[i] = (MidiEvent){
+            .time_us = (uint32_t)(notes[i].time_ns / 1000),
+            .channel = channel,
+            .note = note,
+            .velocity = velocity,
+            .flags = velocity ? MIDI_EVENT_NOTE_ON : 0
+        };
+    }
 
-    queue_push(event);
-    textureNeedsUpdate = true;
+    const size_t pushed = event_ring_push_batch(&eventRing, events, count);
+    if (pushed < count) {
+        atomic_store_explicit(&ringDropped, atomic_load_explicit(&ringDropped, memory_order_relaxed) + (count - pushed), memory_order_relaxed);
+    }
 }
 
 void notes_per_second(uint64_t nps) {
-    notesPerSecond = nps;
+    atomic_store_explicit(&notesPerSecond, nps, memory_order_relaxed);
     printf("Renderer got: %lu\n", nps);
 }
 
@@ -231,22 +252,16 @@ inline __attribute__((always_inline)) static void update_active_notes() {
     // Calculate the current right edge position in the texture
     float currentRightEdge = fmodf(scrollOffset + screenWidth, SCROLL_TEXTURE_WIDTH);
 
-    // For each active note, extend it to the current time
+    // For each sounding note, extend it to the current time
     for (int c = 0; c < MAX_CHANNELS; c++) {
-        for (int n = 0; n < MAX_KEYS; n++) {
-            if (activeNotes[c][n].isActive) {
-                float y = get_note_y(n);
-
-                if (activeNotes[c][n].needsDrawing) {
-                    activeNotes[c][n].startX = currentRightEdge;
-                    activeNotes[c][n].needsDrawing = false;
-                }
-
-                float startX = activeNotes[c][n].startX;
+        for (int w = 0; w < KEY_WORDS; w++) {
+            uint64_t bits = noteState.sounding[c][w];
+            while (bits) {
+                const int n = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
 
-                // Don't draw notes with invalid startX
-                // if (startX <= 0) continue;
-                if (startX < 0) startX = currentRightEdge;  // Default to now if missing
+                float y = get_note_y(n);
+                float startX = noteState.startX[c][n];
 
                 // Calculate the current note length in pixels
                 float endX = currentRightEdge;
@@ -254,69 +269,209 @@ inline __attribute__((always_inline)) static void update_active_notes() {
                 // Handle wrap-around cases
                 if (endX < startX) {
                     // First, draw from startX to end of texture
-                    DrawRectangle(startX, y - NOTE_HEIGHT, SCROLL_TEXTURE_WIDTH - startX, NOTE_HEIGHT,
+                    note_renderer_push(&noteRenderer, (Rectangle){ startX, y - NOTE_HEIGHT, SCROLL_TEXTURE_WIDTH - startX, NOTE_HEIGHT },
                         get_note_color(c));
 
                     // Then draw from beginning of texture to endX
-                    DrawRectangle(0, y - NOTE_HEIGHT, endX, NOTE_HEIGHT,
+                    note_renderer_push(&noteRenderer, (Rectangle){ 0, y - NOTE_HEIGHT, endX, NOTE_HEIGHT },
                         get_note_color(c));
                 } else {
                     // Normal case (no wrap-around)
-                    DrawRectangle(startX, y - NOTE_HEIGHT, endX - startX, NOTE_HEIGHT,
+                    note_renderer_push(&noteRenderer, (Rectangle){ startX, y - NOTE_HEIGHT, endX - startX, NOTE_HEIGHT },
                         get_note_color(c));
                 }
             }
         }
     }
 
+    note_renderer_flush(&noteRenderer);
     EndTextureMode();
 }
 
 inline __attribute__((always_inline)) static void update_texture() {
-    clear_offscreen_texture();
+    FRAME_ZONE(&frameProfiler, FRAME_STAGE_CLEAR) clear_offscreen_texture();
 
     float currentRightEdge = fmodf(scrollOffset + screenWidth, SCROLL_TEXTURE_WIDTH);
 
-    BeginTextureMode(scrollTexture);
+    // The right edge is this frame's clock reading; every note is drawn as far left of it as it is older.
+    // Stamps wrap every 71 minutes, and so does the difference, so it stays right.
+    const uint32_t nowUs = (uint32_t)(frameClock.elapsed_ns / 1000);
+
+    FRAME_ZONE(&frameProfiler, FRAME_STAGE_QUEUE) {
+        BeginTextureMode(scrollTexture);
+
+        MidiEvent events[EVENT_BATCH];
+        size_t count;
+        while ((count = event_ring_pop_batch(&eventRing, events, EVENT_BATCH)) > 0) {
+            for (size_t i = 0; i < count; i++) {
+                const MidiEvent event = events[i];
+                float y = get_note_y(event.note);
+                uint64_t* sounding = noteState.sounding[event.channel];
+
+                // Notes from before a song change, or due after the reading, go at the edge; none go past the screen
+                int32_t ageUs = (int32_t)(nowUs - event.time_us);
+                if (ageUs < 0) ageUs = 0;
+                const float age = fminf((float)ageUs / 1000000.0f, (float)screenWidth / scrollSpeed);
+                float x = currentRightEdge - age * scrollSpeed;
+                if (x < 0) x += SCROLL_TEXTURE_WIDTH;
+
+                if (event.flags & MIDI_EVENT_NOTE_ON) {
+                    noteState.startX[event.channel][event.note] = x;
+                    set_key_bit(sounding, event.note);
+                    press_key(event.channel, event.note);
+                } else {
+                    float startX = noteState.startX[event.channel][event.note];
+                    release_key(event.channel, event.note, (float)(globalTime - age));
+
+                    // Only draw if the note-on came through the ring
+                    if (key_bit(sounding, event.note)) {
+                        clear_key_bit(sounding, event.note);
+                        float endX = x;
+
+                        Color noteColor = get_note_color(event.channel);
+
+                        // Handle wrap-around cases
+                        if (endX < startX) {
+                            // Draw from startX to end of texture
+                            note_renderer_push(&noteRenderer, (Rectangle){ startX, y - NOTE_HEIGHT, SCROLL_TEXTURE_WIDTH - startX, NOTE_HEIGHT }, noteColor);
+
+                            // Draw from beginning of texture to endX
+                            note_renderer_push(&noteRenderer, (Rectangle){ 0, y - NOTE_HEIGHT, endX, NOTE_HEIGHT }, noteColor);
+                        } else {
+                            // Normal case (no wrap-around)
+                            note_renderer_push(&noteRenderer, (Rectangle){ startX, y - NOTE_HEIGHT, endX - startX, NOTE_HEIGHT }, noteColor);
+                        }
+                    }
+                }
+            }
+        }
 
-    MidiEvent event;
-    while (queue_pop(&event)) {
-        float y = get_note_y(event.note);
+        note_renderer_flush(&noteRenderer);
+        EndTextureMode();
+    }
 
-        if (event.isNoteOn) {
-            activeNotes[event.channel][event.note].startX = currentRightEdge;
-            activeNotes[event.channel][event.note].needsDrawing = false;
-        } else {
-            float startX = activeNotes[event.channel][event.note].startX;
+    // Update active notes (extend them to current time)
+    FRAME_ZONE(&frameProfiler, FRAME_STAGE_ACTIVE) update_active_notes();
 
-            // Only draw if we have a valid startX (might not if note_on was missed)
-            if (startX > 0) {
-                float endX = currentRightEdge;
+    drawnTime = globalTime;
+}
 
-                Color noteColor = get_note_color(event.channel);
+// MIDI thread: a song is starting; the renderer picks its roll up on the next frame
+static void hand_over_roll(MidiRoll* roll) {
+    midi_roll_close(atomic_exchange_explicit(&pendingRoll, roll, memory_order_acq_rel));
+}
 
-                // Handle wrap-around cases
-                if (endX < startX) {
-                    // Draw from startX to end of texture
-                    DrawRectangle(startX, y - NOTE_HEIGHT, SCROLL_TEXTURE_WIDTH - startX, NOTE_HEIGHT, noteColor);
+inline __attribute__((always_inline)) static double roll_x(const uint64_t time_ns) {
+    return (double)time_ns / 1e9 * scrollSpeed;
+}
+
+// No note is sounding any more; lit keys fade the usual way
+static void release_all_notes() {
+    memset(noteState.sounding, 0, sizeof(noteState.sounding));
+    memset(noteState.depth, 0, sizeof(noteState.depth));
+    for (int c = 0; c < MAX_CHANNELS; c++) {
+        for (int w = 0; w < KEY_WORDS; w++) {
+            uint64_t bits = noteState.pressed[c][w];
+            while (bits) {
+                release_key(c, w * 64 + __builtin_ctzll(bits), globalTime);
+                bits &= bits - 1;
+            }
+        }
+    }
+}
+
+static void start_roll(MidiRoll* roll) {
+    midi_roll_close(drawRoll);
+    midi_roll_close(keyRoll);
+    drawRoll = roll;
+    keyRoll = midi_roll_copy(roll);
+
+    // Keys still lit by the last song fade the usual way
+    release_all_notes();
+
+    rollPositionNs = midi_roll_origin_ns(roll);
+    rollDrawnX = roll_x(rollPositionNs);
+
+    BeginTextureMode(scrollTexture);
+    ClearBackground(BLACK);
+    EndTextureMode();
+}
+
+// Draw every note up to prerollSeconds past the playhead at its place in the song. Nothing is moved or redrawn
+// later: each frame only fills the stretch between the last horizon and the new one, through the strip, so its
+// cost is bounded by the stretch's pixels rather than the number of notes in it.
+static void update_roll(const uint64_t song_ns) {
+    // A roll is handed over after the clock restarted for its song, so the reading this frame began with may
+    // still be the last song's; the playhead moves on from the next one. It never goes back within a song.
+    MidiRoll* roll = atomic_exchange_explicit(&pendingRoll, NULL, memory_order_acq_rel);
+    if (roll) {
+        start_roll(roll);
+    } else if (drawRoll && song_ns > rollPositionNs) {
+        rollPositionNs = song_ns;
+    }
+    if (!drawRoll) return;
+
+    MidiNoteEvent notes[ROLL_BATCH];
+    size_t count;
 
-                    // Draw from beginning of texture to endX
-                    DrawRectangle(0, y - NOTE_HEIGHT, endX, NOTE_HEIGHT, noteColor);
+    // Keys light up when their notes sound, not when they are drawn
+    if (keyRoll) {
+        while ((count = midi_roll_read(keyRoll, rollPositionNs, notes, ROLL_BATCH)) > 0) {
+            for (size_t i = 0; i < count; i++) {
+                if (notes[i].velocity) {
+                    press_key(notes[i].channel, notes[i].note);
                 } else {
-                    // Normal case (no wrap-around)
-                    DrawRectangle(startX, y - NOTE_HEIGHT, endX - startX, NOTE_HEIGHT, noteColor);
+                    release_key(notes[i].channel, notes[i].note, globalTime);
                 }
             }
         }
     }
 
-    EndTextureMode();
+    const uint64_t horizon = rollPositionNs + (uint64_t)(prerollSeconds * 1e9);
+    const double horizonX = roll_x(horizon);
+    if (horizonX <= rollDrawnX) return;
 
-    // Update active notes (extend them to current time)
-    update_active_notes();
+    // This stretch of the texture last held notes a whole texture width back, long scrolled off
+    roll_strip_begin(&rollStrip, rollDrawnX, horizonX);
 
-    drawnTime = globalTime;
-    textureNeedsUpdate = false;
+    while ((count = midi_roll_read(drawRoll, horizon, notes, ROLL_BATCH)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t channel = notes[i].channel;
+            const uint8_t note = notes[i].note;
+
+            uint16_t* depth = &noteState.depth[channel][note];
+
+            if (notes[i].velocity) {
+                if ((*depth)++ == 0) {
+                    noteState.startNs[channel][note] = notes[i].time_ns;
+                    set_key_bit(noteState.sounding[channel], note);
+                }
+            } else if (*depth > 0 && --(*depth) == 0) {
+                clear_key_bit(noteState.sounding[channel], note);
+
+                // Whatever lies before rollDrawnX was drawn on earlier frames; every note gets at least a pixel
+                const double startX = fmax(roll_x(noteState.startNs[channel][note]), rollDrawnX);
+                const double endX = fmin(fmax(roll_x(notes[i].time_ns), startX + 1.0), horizonX);
+                roll_strip_note(&rollStrip, startX, endX, note, channel);
+            }
+        }
+    }
+
+    // Notes still sounding reach the horizon for now and grow with it on later frames
+    for (int c = 0; c < MAX_CHANNELS; c++) {
+        for (int w = 0; w < KEY_WORDS; w++) {
+            uint64_t bits = noteState.sounding[c][w];
+            while (bits) {
+                const int n = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                const double startX = fmax(roll_x(noteState.startNs[c][n]), rollDrawnX);
+                roll_strip_note(&rollStrip, startX, horizonX, (uint8_t)n, (uint8_t)c);
+            }
+        }
+    }
+
+    roll_strip_upload(&rollStrip, scrollTexture.texture);
+    rollDrawnX = horizonX;
 }
 
 // Draw the piano keyboard with animations for pressed keys
@@ -324,28 +479,17 @@ static void draw_animated_keyboard() {
     const int keyboardWidth = KEYBOARD_WIDTH;
     DrawRectangle(screenWidth - keyboardWidth, 0, keyboardWidth, screenHeight, DARKGRAY);
 
+    float keyAlpha[MAX_KEYS];
+    int keyChannel[MAX_KEYS];
+    get_key_highlights(keyAlpha, keyChannel, globalTime);
+
     for (int note = 0; note < MAX_KEYS; note++) {
         int noteType = note % 12;
         float y = get_note_y_piano(note);
         bool isBlackKey = (noteType == 1 || noteType == 3 || noteType == 6 || noteType == 8 || noteType == 10);
 
-        // Check if any channel has this note active (for animation)
-        float maxAlpha = 0.0f;
-        int activeChannel = -1;
-
-        for (int c = 0; c < MAX_CHANNELS; c++) {
-            float alpha = get_key_animation_alpha(
-                activeNotes[c][note].keyPressTime,
-                activeNotes[c][note].keyReleaseTime,
-                activeNotes[c][note].keyIsPressed,
-                globalTime
-            );
-
-            if (alpha > maxAlpha) {
-                maxAlpha = alpha;
-                activeChannel = c;
-            }
-        }
+        const float maxAlpha = keyAlpha[note];
+        const int activeChannel = keyChannel[note];
 
         // If key is active or recently released, draw an animation overlay
         if (maxAlpha > 0.0f && activeChannel >= 0) {
@@ -388,22 +532,340 @@ static void draw_animated_keyboard() {
     }
 }
 
+// Song time runs right to left, so the texture is shown mirrored: the playhead is at the keyboard
+// and the notes still to come are to its left
+static Rectangle roll_source() {
+    double sourceX = fmod(roll_x(rollPositionNs) - KEYBOARD_WIDTH, SCROLL_TEXTURE_WIDTH);
+    if (sourceX < 0) sourceX += SCROLL_TEXTURE_WIDTH;
+    return (Rectangle){ (float)sourceX, 0, -screenWidth, screenHeight };
+}
+
+// Everything but the HUD, into the window or an export frame
+static void draw_scene(const Rectangle source) {
+    FRAME_ZONE(&frameProfiler, FRAME_STAGE_BACKGROUND) {
+        ClearBackground(BLACK);
+
+        // Draw the scroll texture as background
+        Rectangle dest = { 0, 0, screenWidth, screenHeight };
+        DrawTexturePro(scrollTexture.texture, source, dest, (Vector2){ 0, 0 }, 0.0f, WHITE);
+    }
+
+    // Overlay a grid for the piano roll
+    FRAME_ZONE(&frameProfiler, FRAME_STAGE_GRID) {
+        for (int note = 0; note < MAX_KEYS; note++) {
+            float y = get_note_y(note);
+            Color lineColor = (note % 12 == 0) ? (Color){255, 255, 255, 255} : (Color){50, 50, 50, 255};
+            DrawLine(0, y, screenWidth, y, lineColor);
+        }
+    }
+
+    // Draw the animated piano keyboard
+    FRAME_ZONE(&frameProfiler, FRAME_STAGE_KEYBOARD) draw_animated_keyboard();
+}
+
+// The renderer empties the ring every frame, so it only has to hold what the busiest second of the file
+// produces, note-ons and their note-offs, in EVENT_RING_LATENCY_MS. Notes don't come evenly, though: a chord
+// on one tick arrives in a single dispatch step, so the biggest bursts go on top. A stall longer than that
+// drops events, which the HUD counts with the limiter's.
+// Called on the MIDI thread before every file, so a playlist moves to a bigger ring when a later file needs one.
+static void size_event_queue(const MidiFileStats* stats) {
+    const uint64_t needed = stats->peak_nps * 2 * EVENT_RING_LATENCY_MS / 1000 + stats->peak_burst * EVENT_RING_BURSTS;
+    uint32_t capacity = EVENT_RING_MIN;
+    while (capacity < needed && capacity < EVENT_RING_MAX) capacity <<= 1;
+
+    const bool ready = atomic_load_explicit(&eventRing.ready, memory_order_acquire);
+    if (ready && capacity <= eventRing.mask + 1) return;
+
+    MidiEvent* events = malloc((size_t)capacity * sizeof(MidiEvent));
+    if (!events) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+
+    if (!ready) {
+        event_ring_publish(&eventRing, events, capacity);
+    } else if (!event_ring_grow(&eventRing, events, capacity)) {
+        free(events);
+    }
+}
+
+// Files to play back to back, in command line order
+static char** midiFiles;
+static int midiFileCount;
+
+static bool play_files(const NotePerSecondCallback note_per_second_callback) {
+    if (midiFileCount == 1) return PlayMIDIWithOptions(midiFiles[0], &playerOptions, NULL, NULL, note_per_second_callback);
+    return PlayMIDIPlaylist(midiFiles, midiFileCount, &playerOptions, NULL, NULL, note_per_second_callback);
+}
+
+// Space pauses and resumes, the arrows seek. The pre-roll starts over from every play's roll; the live view
+// has to forget the notes cut off, since their note-offs never come through the callbacks.
+static void handle_player_keys(const bool useRoll) {
+    const bool toggle = IsKeyPressed(KEY_SPACE);
+    const bool back = IsKeyPressed(KEY_LEFT);
+    const bool forward = IsKeyPressed(KEY_RIGHT);
+    if (!toggle && !back && !forward) return;
+
+    if (toggle && MIDIPlayerGetState(player) != MIDI_PLAYER_PLAYING) {
+        MIDIPlayerPlay(player);
+        return;
+    }
+    if (toggle) {
+        MIDIPlayerPause(player);
+    } else {
+        const uint64_t position = MIDIPlayerPosition(player);
+        if (forward) MIDIPlayerSeek(player, position + SEEK_STEP_NS);
+        else MIDIPlayerSeek(player, position > SEEK_STEP_NS ? position - SEEK_STEP_NS : 0);
+    }
+
+    if (!useRoll) {
+        MidiEvent events[EVENT_BATCH];
+        while (event_ring_pop_batch(&eventRing, events, EVENT_BATCH) > 0) {}
+        release_all_notes();
+    }
+}
+
 static void* midi_thread(void* arg) {
-    char* midiPath = (char*)arg;
-    timeOffset = GetTime();
-    PlayMIDI(midiPath, note_on, note_off, notes_per_second);
+    (void)arg;
+    play_files(notes_per_second);
     return NULL;
 }
 
+// Headless export: every file's timeline is walked at exportFps, each frame rendered offscreen and piped to the
+// encoder. Frame n of a song shows song time n / exportFps whatever the frame cost, so none is skipped or doubled.
+// Two frames are in flight: one is read back after the next one's CPU work, which gives the GPU that long to
+// finish drawing it, while the writer thread and the encoder work on the ones before.
+static bool export_video() {
+    VideoExport video;
+    if (!video_export_open(&video, exportPath, exportEncoder, screenWidth, screenHeight, exportFps)) return false;
+
+    RenderTexture2D frames[2] = { LoadRenderTexture(screenWidth, screenHeight), LoadRenderTexture(screenWidth, screenHeight) };
+    const uint64_t fadeFrames = (uint64_t)ceilf(KEY_ANIMATION_DURATION * exportFps);
+    const uint64_t exportStart = midi_timer_now_ns();
+    uint64_t frame = 0;
+    int pending = -1;
+    bool ok = true;
+
+    MidiPlayerOptions options = playerOptions;
+    for (int i = 0; i < midiFileCount && ok; i++) {
+        // Like a playlist, only the first song starts at start_ms
+        if (i > 0) options.start_ms = 0;
+        MidiRoll* roll = OpenMIDIRoll(midiFiles[i], &options);
+        if (!roll) {
+            ok = false;
+            break;
+        }
+        const uint64_t origin = midi_roll_origin_ns(roll);
+        hand_over_roll(roll);
+        printf("Exporting %s\n", midiFiles[i]);
+
+        // The song ends once its last note has played and the key it lit has faded
+        uint64_t songFrame = 0;
+        uint64_t doneFrames = 0;
+        while (ok && doneFrames <= fadeFrames) {
+            frame_profiler_begin_frame(&frameProfiler, midi_timer_now_ns());
+            globalTime = (double)frame / exportFps;
+
+            FRAME_ZONE(&frameProfiler, FRAME_STAGE_ROLL) update_roll(origin + songFrame * 1000000000ULL / exportFps);
+            if (!keyRoll) {
+                ok = false;
+                break;
+            }
+            if (pending >= 0) FRAME_ZONE(&frameProfiler, FRAME_STAGE_READBACK) ok = video_export_frame(&video, frames[pending]);
+
+            pending = (int)(frame % 2);
+            BeginTextureMode(frames[pending]);
+            draw_scene(roll_source());
+            EndTextureMode();
+            frame_profiler_end_frame(&frameProfiler, 0, 0);
+
+            frame++;
+            songFrame++;
+            if (midi_roll_done(keyRoll)) doneFrames++;
+            if (songFrame % ((uint64_t)exportFps * 10) == 0) {
+                printf("Exported %lus, %.1fx real time.\n", (unsigned long)(songFrame / exportFps),
+                    (double)frame / exportFps / ((double)(midi_timer_now_ns() - exportStart) / 1e9));
+            }
+        }
+    }
+    if (ok && pending >= 0) ok = video_export_frame(&video, frames[pending]);
+
+    const bool encoded = video_export_close(&video);
+    const double seconds = (double)(midi_timer_now_ns() - exportStart) / 1e9;
+    printf("Exported %lu frames (%.1fs at %d fps) in %.1fs, %.1fx real time; waited %ldms for the encoder.\n",
+        (unsigned long)video.written, (double)video.written / exportFps, exportFps, seconds,
+        (double)video.written / exportFps / seconds, (long)(video.wait_ns / 1000000));
+
+    UnloadRenderTexture(frames[0]);
+    UnloadRenderTexture(frames[1]);
+    return ok && encoded;
+}
+
+static void close_renderer() {
+    note_renderer_free(&noteRenderer);
+    roll_strip_free(&rollStrip);
+    UnloadRenderTexture(scrollTexture);
+    CloseWindow();
+}
+
 int main(const int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <midi_file>\n", argv[0]);
+    InitMIDIPlayerOptions(&playerOptions);
+    playerOptions.stats_callback = size_event_queue;
+    playerOptions.note_batch_callback = note_batch;
+    playerOptions.metrics = &playerMetrics;
+    midi_metrics_reset(&playerMetrics);
+
+    midiFiles = malloc((size_t)argc * sizeof(char*));
+    if (!midiFiles) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            playerOptions.use_mmap = true;
+        } else if (strcmp(argv[i], "--predecode") == 0) {
+            playerOptions.predecode = true;
+        } else if (strcmp(argv[i], "--merge") == 0) {
+            playerOptions.merge_timeline = true;
+        } else if (strcmp(argv[i], "--heap") == 0) {
+            playerOptions.scheduler = MIDI_SCHEDULER_HEAP;
+        } else if (strcmp(argv[i], "--lookahead") == 0 && i + 1 < argc) {
+            playerOptions.lookahead_ms = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) {
+            playerOptions.start_ms = (uint32_t)(atof(argv[++i]) * 1000.0);
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            playerOptions.use_cache = true;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            playerOptions.use_cache = true;
+            playerOptions.cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--sink") == 0 && i + 1 < argc) {
+            if (!parse_midi_sink(argv[++i], &playerOptions.sink)) {
+                fprintf(stderr, "Unknown sink %s, expected omnimidi, alsa or null\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            playerOptions.sink_device = argv[++i];
+        } else if (strcmp(argv[i], "--spin") == 0 && i + 1 < argc) {
+            playerOptions.spin_us = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            playerOptions.realtime = true;
+        } else if (strcmp(argv[i], "--rt-priority") == 0 && i + 1 < argc) {
+            playerOptions.realtime = true;
+            playerOptions.realtime_priority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            playerOptions.dispatch_cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--producer-cpu") == 0 && i + 1 < argc) {
+            playerOptions.producer_cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--min-velocity") == 0 && i + 1 < argc) {
+            playerOptions.min_velocity = (uint8_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-duplicates") == 0) {
+            playerOptions.drop_duplicate_notes = true;
+        } else if (strcmp(argv[i], "--key-rate") == 0 && i + 1 < argc) {
+            playerOptions.max_notes_per_key_ms = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--nps-ceiling") == 0 && i + 1 < argc) {
+            playerOptions.nps_ceiling = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-polyphony") == 0 && i + 1 < argc) {
+            playerOptions.max_polyphony = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-nps") == 0 && i + 1 < argc) {
+            playerOptions.max_nps = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--offline") == 0) {
+            playerOptions.offline = true;
+        } else if (strcmp(argv[i], "--min-speed") == 0 && i + 1 < argc) {
+            playerOptions.offline = true;
+            playerOptions.offline_min_speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            playerOptions.metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-format") == 0 && i + 1 < argc) {
+            if (!parse_midi_metrics_format(argv[++i], &playerOptions.metrics_format)) {
+                fprintf(stderr, "Unknown metrics format %s, expected csv or json\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            playerOptions.metrics_interval_ms = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--preroll") == 0 && i + 1 < argc) {
+            prerollSeconds = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--preload-mb") == 0 && i + 1 < argc) {
+            playerOptions.preload_bytes = (uint64_t)atoll(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            playerOptions.shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shard-by") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "tracks") == 0) {
+                playerOptions.shard_by = MIDI_SHARD_TRACKS;
+            } else if (strcmp(mode, "channels") == 0) {
+                playerOptions.shard_by = MIDI_SHARD_CHANNELS;
+            } else {
+                fprintf(stderr, "Unknown shard mode %s, expected tracks or channels\n", mode);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shard-devices") == 0 && i + 1 < argc) {
+            playerOptions.shard_devices = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            exportPath = argv[++i];
+        } else if (strcmp(argv[i], "--export-fps") == 0 && i + 1 < argc) {
+            exportFps = atoi(argv[++i]);
+            if (exportFps <= 0) {
+                fprintf(stderr, "Export frame rate must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--encoder") == 0 && i + 1 < argc) {
+            exportEncoder = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            showProfiler = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--shard-tolerance") == 0 && i + 1 < argc) {
+            playerOptions.shard_tolerance_us = (uint32_t)atoi(argv[++i]);
+        } else {
+            midiFiles[midiFileCount++] = argv[i];
+        }
+    }
+
+    if (midiFileCount == 0) {
+        printf("Usage: %s [--mmap] [--predecode] [--merge] [--heap] [--lookahead <ms>] [--start <seconds>] [--cache] [--cache-dir <dir>] [--sink omnimidi|alsa|null] [--device <name>] [--spin <us>] [--realtime] [--rt-priority <n>] [--cpu <n>] [--producer-cpu <n>] [--min-velocity <n>] [--no-duplicates] [--key-rate <n>] [--nps-ceiling <n>] [--max-polyphony <n>] [--max-nps <n>] [--offline] [--min-speed <x>] [--metrics <file>] [--metrics-format csv|json] [--metrics-interval <ms>] [--preload-mb <n>] [--preroll <seconds>] [--shards <n>] [--shard-by tracks|channels] [--shard-devices <a,b,...>] [--shard-tolerance <us>] [--profile] [--trace <file>] [--export <video>] [--export-fps <n>] [--encoder <command>] <midi_file>...\n", argv[0]);
         return 1;
     }
 
+    // Workers share the song, so it has to be decoded up front
+    if (playerOptions.shards > 1 && !playerOptions.offline && !playerOptions.merge_timeline && !playerOptions.use_cache) playerOptions.predecode = true;
+
+    // Headless: nothing is drawn, so the notes don't need to go anywhere; the exit status says if the file passed
+    if (playerOptions.offline) {
+        playerOptions.stats_callback = NULL;
+        playerOptions.note_batch_callback = NULL;
+        return play_files(NULL) ? 1 : 0;
+    }
+
+    // A video is drawn from the song's own timeline, so it always goes through the roll
+    if (exportPath && prerollSeconds == 0.0f) prerollSeconds = -1.0f;
+
+    const bool useRoll = prerollSeconds != 0.0f;
+    if (useRoll) {
+        // Drawing must never reach the part of the texture that is on screen
+        const float maxPreroll = (float)(SCROLL_TEXTURE_WIDTH - screenWidth) / scrollSpeed;
+        if (prerollSeconds < 0.0f) prerollSeconds = (float)(screenWidth - KEYBOARD_WIDTH) / scrollSpeed;
+        if (prerollSeconds > maxPreroll) prerollSeconds = maxPreroll;
+
+        // The renderer reads the song itself, so the MIDI thread only has to hand over a roll per song
+        playerOptions.roll_callback = hand_over_roll;
+        playerOptions.note_batch_callback = NULL;
+        playerOptions.stats_callback = NULL;
+        if (!playerOptions.merge_timeline && !playerOptions.use_cache) playerOptions.predecode = true;
+    }
+
     init_event_queue();
+    if (exportPath) SetConfigFlags(FLAG_WINDOW_HIDDEN);
     InitWindow(screenWidth, screenHeight, "Piano Roll Thingy");
-    SetTargetFPS(144);
+    if (!exportPath) SetTargetFPS(144);
+    if (!note_renderer_init(&noteRenderer)) return 1;
+
+    if (useRoll) {
+        float keyY[MAX_KEYS];
+        Color palette[MAX_CHANNELS];
+        for (int n = 0; n < MAX_KEYS; n++) keyY[n] = get_note_y(n);
+        for (int c = 0; c < MAX_CHANNELS; c++) palette[c] = get_note_color(c);
+        if (!roll_strip_init(&rollStrip, SCROLL_TEXTURE_WIDTH, screenHeight, keyY, NOTE_HEIGHT, palette)) return 1;
+    }
 
     // Create a persistent scroll texture
     scrollTexture = LoadRenderTexture(SCROLL_TEXTURE_WIDTH, screenHeight);
@@ -411,16 +873,36 @@ int main(const int argc, char* argv[]) {
     ClearBackground(BLACK);
     EndTextureMode();
 
-    pthread_t midiThread;
-    pthread_create(&midiThread, NULL, midi_thread, argv[1]);
+    frame_profiler_init(&frameProfiler);
+    if (exportPath) {
+        const bool exported = export_video();
+        if (tracePath) frame_profiler_write_trace(&frameProfiler, tracePath);
+        close_renderer();
+        return exported ? 0 : 1;
+    }
+
+    if (midiFileCount == 1) {
+        player = CreateMIDIPlayer(&playerOptions, NULL, NULL, notes_per_second);
+        if (player && MIDIPlayerLoad(player, midiFiles[0])) MIDIPlayerPlay(player);
+    } else {
+        pthread_t midiThread;
+        pthread_create(&midiThread, NULL, midi_thread, NULL);
+    }
 
-    double currentTime = GetTime() - timeOffset;
+    // Frames run on the player's clock too, so note stamps and frame times need no conversion
+    midi_metrics_clock(&playerMetrics, &frameClock);
+    clockBaseNs = frameClock.wall_ns;
+    double currentTime = 0.0;
     globalTime = currentTime;
     lastClearTime = currentTime;
     previousDeltaTime = 1.0 / 60.0;
 
     while (!WindowShouldClose()) {
-        currentTime = GetTime() - timeOffset;
+        midi_metrics_clock(&playerMetrics, &frameClock);
+        frame_profiler_begin_frame(&frameProfiler, frameClock.wall_ns);
+        if (IsKeyPressed(KEY_F3)) showProfiler = !showProfiler;
+        if (player) handle_player_keys(useRoll);
+        currentTime = (double)(frameClock.wall_ns - clockBaseNs) / 1e9;
         float rawDeltaTime = currentTime - globalTime;
 
         // Apply smoothing to delta time to try to prevent stuttering
@@ -429,41 +911,47 @@ int main(const int argc, char* argv[]) {
 
         globalTime = currentTime;
 
-        // Always update the texture
-        update_texture();
+        MidiMetricsSnapshot metrics;
+        midi_metrics_snapshot(&playerMetrics, &metrics);
 
-        // Advance the scroll offset - use smoothed delta time for consistent scrolling
-        scrollOffset += deltaTime * scrollSpeed;
-        if (scrollOffset >= SCROLL_TEXTURE_WIDTH) {
-            scrollOffset = fmodf(scrollOffset, SCROLL_TEXTURE_WIDTH);
+        Rectangle source;
+        if (useRoll) {
+            FRAME_ZONE(&frameProfiler, FRAME_STAGE_ROLL) update_roll(frameClock.song_ns);
+            source = roll_source();
+        } else {
+            // The live view stands still while paused, like the pre-roll does with its clock
+            if (!player || MIDIPlayerGetState(player) != MIDI_PLAYER_PAUSED) {
+                update_texture();
+
+                // Advance the scroll offset - use smoothed delta time for consistent scrolling
+                scrollOffset += deltaTime * scrollSpeed;
+                if (scrollOffset >= SCROLL_TEXTURE_WIDTH) {
+                    scrollOffset = fmodf(scrollOffset, SCROLL_TEXTURE_WIDTH);
+                }
+            }
+
+            // Display from right to left
+            source = (Rectangle){ scrollOffset, 0, screenWidth, screenHeight };
         }
 
         BeginDrawing();
-        ClearBackground(BLACK);
-
-        // Draw the scroll texture as background
-        // Display from right to left
-        Rectangle source = { scrollOffset, 0, screenWidth, screenHeight };
-        Rectangle dest = { 0, 0, screenWidth, screenHeight };
-        DrawTexturePro(scrollTexture.texture, source, dest, (Vector2){ 0, 0 }, 0.0f, WHITE);
-
-        // Overlay a grid for the piano roll
-        for (int note = 0; note < MAX_KEYS; note++) {
-            float y = get_note_y(note);
-            Color lineColor = (note % 12 == 0) ? (Color){255, 255, 255, 255} : (Color){50, 50, 50, 255};
-            DrawLine(0, y, screenWidth, y, lineColor);
+        draw_scene(source);
+
+        FRAME_ZONE(&frameProfiler, FRAME_STAGE_HUD) {
+            DrawRectangle(5, 5, 300, 80, (Color){ 0, 0, 0, 160 }); // semi-transparent black background
+            DrawFPS(10, 10);
+            DrawText(TextFormat("Notes per second: %lu", (unsigned long)atomic_load_explicit(&notesPerSecond, memory_order_relaxed)), 10, 30, 20, WHITE);
+            DrawText(TextFormat("Lag %.2fms (max %.2fms), %lu dropped", metrics.lag_mean_ns / 1e6, metrics.lag_max_ns / 1e6,
+                (unsigned long)(metrics.dropped + atomic_load_explicit(&ringDropped, memory_order_relaxed))), 10, 55, 10, LIGHTGRAY);
+            if (showProfiler) frame_profiler_draw(&frameProfiler, 5, 90);
         }
 
-        // Draw the animated piano keyboard
-        draw_animated_keyboard();
-
-        DrawRectangle(5, 5, 300, 60, (Color){ 0, 0, 0, 160 }); // semi-transparent black background
-        DrawFPS(10, 10);
-        DrawText(TextFormat("Notes per second: %lu", notesPerSecond), 10, 30, 20, WHITE);
-        EndDrawing();
+        FRAME_ZONE(&frameProfiler, FRAME_STAGE_PRESENT) EndDrawing();
+        frame_profiler_end_frame(&frameProfiler, metrics.schedule_ns, metrics.dispatch_ns);
     }
 
-    UnloadRenderTexture(scrollTexture);
-    CloseWindow();
+    DestroyMIDIPlayer(player);
+    if (tracePath) frame_profiler_write_trace(&frameProfiler, tracePath);
+    close_renderer();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "midicache.h"
+
+#define MIDI_CACHE_MAGIC "MIDICACH"
+#define MIDI_CACHE_MERGED 0x01
+#define MIDI_CACHE_ALIGN 64
+
+// How much of each end of the source goes into the key hash; hashing a whole 1 GB file would cost
+// more than the cache saves, and size + mtime already catch ordinary edits
+#define MIDI_CACHE_HASH_BYTES (64 * 1024)
+
+// Where a section lives in the cache file and how many elements it holds
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+} MidiCacheSection;
+
+// Slices of the shared sections that belong to one track
+typedef struct {
+    uint64_t event_index;
+    uint64_t event_count;
+    uint64_t meta_index;
+    uint64_t meta_count;
+    uint64_t payload_offset;
+    uint64_t payload_size;
+} MidiCacheTrack;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;             // MIDI_CACHE_MERGED
+    uint16_t struct_sizes[8];   // Layout of the structs below, so a different build never maps them
+    MidiCacheKey key;
+    uint64_t file_size;         // Catches truncated files
+    uint32_t track_count;
+    uint16_t time_div;
+    uint16_t reserved;
+    MidiCacheSection tracks;
+    MidiCacheSection events;
+    MidiCacheSection metas;
+    MidiCacheSection payload;
+    MidiCacheSection tempo;
+    MidiCacheSection seek_points;
+    MidiCacheSection seek_positions;
+    MidiCacheSection seek_channels;
+    uint64_t seek_interval_ns;
+    uint64_t event_count;
+    uint64_t note_on_count;
+    uint64_t note_off_count;
+    uint64_t peak_polyphony;
+    uint64_t peak_nps;
+    uint64_t peak_burst;
+    uint64_t largest_payload;
+    uint64_t last_tick;
+    uint64_t duration_ns;
+    uint64_t resolution_ns;
+} MidiCacheHeader;
+
+static void cache_struct_sizes(uint16_t* sizes) {
+    sizes[0] = sizeof(MidiCacheHeader);
+    sizes[1] = sizeof(MidiCacheTrack);
+    sizes[2] = sizeof(PackedEvent);
+    sizes[3] = sizeof(PackedMeta);
+    sizes[4] = sizeof(TempoEntry);
+    sizes[5] = sizeof(SeekPoint);
+    sizes[6] = sizeof(TrackPosition);
+    sizes[7] = sizeof(ChannelState);
+}
+
+static uint64_t cache_monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, const size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+bool midi_cache_key(const char* source, MidiCacheKey* key) {
+    const int fd = open(source, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return false;
+    }
+
+    struct stat st;
+    uint8_t* buffer = malloc(MIDI_CACHE_HASH_BYTES);
+    if (fstat(fd, &st) != 0 || !buffer) {
+        fprintf(stderr, "Failed to read %s\n", source);
+        free(buffer);
+        close(fd);
+        return false;
+    }
+
+    key->size = (uint64_t)st.st_size;
+    key->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+    key->hash = 0xCBF29CE484222325ULL;
+
+    // Head, then tail; small files are simply hashed twice
+    const size_t chunk = key->size < MIDI_CACHE_HASH_BYTES ? (size_t)key->size : MIDI_CACHE_HASH_BYTES;
+    const off_t offsets[2] = { 0, (off_t)(key->size - chunk) };
+    bool ok = true;
+    for (int i = 0; i < 2 && ok; i++) {
+        ok = pread(fd, buffer, chunk, offsets[i]) == (ssize_t)chunk;
+        if (ok) key->hash = fnv1a(key->hash, buffer, chunk);
+    }
+
+    free(buffer);
+    close(fd);
+    if (!ok) fprintf(stderr, "Failed to read %s\n", source);
+    return ok;
+}
+
+// "<source>.mpcache" next to the file, or "<cache_dir>/<name>.<path hash>.mpcache"; caller frees
+char* midi_cache_path(const char* source, const char* cache_dir) {
+    size_t length;
+    char* path;
+
+    if (!cache_dir || !cache_dir[0]) {
+        length = strlen(source) + sizeof(".mpcache");
+        path = malloc(length);
+        if (path) snprintf(path, length, "%s.mpcache", source);
+    } else {
+        // Files with the same name in different directories must not share a cache
+        const char* name = strrchr(source, '/');
+        name = name ? name + 1 : source;
+        const uint64_t hash = fnv1a(0xCBF29CE484222325ULL, (const uint8_t*)source, strlen(source));
+
+        length = strlen(cache_dir) + 1 + strlen(name) + 1 + 16 + sizeof(".mpcache");
+        path = malloc(length);
+        if (path) snprintf(path, length, "%s/%s.%016llx.mpcache", cache_dir, name, (unsigned long long)hash);
+    }
+
+    if (!path) fprintf(stderr, "Memory allocation failed\n");
+    return path;
+}
+
+inline __attribute__((always_inline)) static bool section_fits(const MidiCacheSection* section, const size_t element_size, const size_t file_size) {
+    if (section->offset > file_size) return false;
+    return section->count <= (file_size - section->offset) / element_size;
+}
+
+// Everything playback and seeking index with, so a corrupt cache is rebuilt instead of read out of bounds.
+// Touches every event once, which is still far less than decoding the song again.
+static bool cache_contents_valid(const uint8_t* base, const MidiCacheHeader* header, const PackedTrack* tracks) {
+    for (uint32_t i = 0; i < header->track_count; i++) {
+        const PackedTrack* track = &tracks[i];
+        for (size_t m = 0; m < track->meta_count; m++) {
+            const PackedMeta* meta = &track->metas[m];
+            if (meta->offset > track->payload_size || meta->length > track->payload_size - meta->offset) return false;
+        }
+
+        // Meta and SysEx events carry their metas index above the status byte
+        bool indices_ok = true;
+        for (size_t e = 0; e < track->event_count; e++) {
+            const uint32_t message = track->events[e].message;
+            indices_ok &= (message & 0xF0) != 0xF0 || (message >> 8) < track->meta_count;
+        }
+        if (!indices_ok) return false;
+    }
+
+    const TempoEntry* tempo = (const TempoEntry*)(base + header->tempo.offset);
+    if (tempo[0].tick != 0) return false;
+    for (uint64_t i = 0; i < header->tempo.count; i++) {
+        if (tempo[i].usec_per_quarter == 0) return false;
+        if (i > 0 && (tempo[i].tick <= tempo[i - 1].tick || tempo[i].time_ns < tempo[i - 1].time_ns)) return false;
+    }
+
+    const TrackPosition* positions = (const TrackPosition*)(base + header->seek_positions.offset);
+    for (uint64_t p = 0; p < header->seek_points.count; p++) {
+        for (uint32_t i = 0; i < header->track_count; i++) {
+            if (positions[p * header->track_count + i].offset > tracks[i].event_count) return false;
+        }
+    }
+    return true;
+}
+
+bool open_midi_cache(const char* path, const MidiCacheKey* key, const bool merged, MidiCache* cache) {
+    const uint64_t start_time = cache_monotonic_us();
+    memset(cache, 0, sizeof(MidiCache));
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return false; // No cache yet
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MidiCacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    uint8_t* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    const size_t size = (size_t)st.st_size;
+    const MidiCacheHeader* header = (const MidiCacheHeader*)base;
+    uint16_t sizes[8];
+    cache_struct_sizes(sizes);
+
+    bool ok = memcmp(header->magic, MIDI_CACHE_MAGIC, 8) == 0 &&
+        header->version == MIDI_CACHE_VERSION &&
+        memcmp(header->struct_sizes, sizes, sizeof(sizes)) == 0 &&
+        header->file_size == size &&
+        header->key.size == key->size &&
+        header->key.mtime_ns == key->mtime_ns &&
+        header->key.hash == key->hash &&
+        ((header->flags & MIDI_CACHE_MERGED) != 0) == merged &&
+        header->time_div != 0 && header->time_div < 0x8000 &&
+        header->tracks.count == header->track_count &&
+        section_fits(&header->tracks, sizeof(MidiCacheTrack), size) &&
+        section_fits(&header->events, sizeof(PackedEvent), size) &&
+        section_fits(&header->metas, sizeof(PackedMeta), size) &&
+        section_fits(&header->payload, 1, size) &&
+        section_fits(&header->tempo, sizeof(TempoEntry), size) && header->tempo.count > 0 &&
+        section_fits(&header->seek_points, sizeof(SeekPoint), size) &&
+        section_fits(&header->seek_positions, sizeof(TrackPosition), size) &&
+        section_fits(&header->seek_channels, sizeof(ChannelState), size) &&
+        header->seek_positions.count == header->seek_points.count * header->track_count &&
+        header->seek_channels.count == header->seek_points.count * MIDI_CHANNELS;
+
+    if (ok) {
+        cache->tracks = malloc((header->track_count > 0 ? header->track_count : 1) * sizeof(PackedTrack));
+        if (!cache->tracks) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ok = false;
+        }
+    }
+
+    const MidiCacheTrack* tracks = ok ? (const MidiCacheTrack*)(base + header->tracks.offset) : NULL;
+    for (uint32_t i = 0; ok && i < header->track_count; i++) {
+        const MidiCacheTrack* track = &tracks[i];
+        ok = track->event_index <= header->events.count && track->event_count <= header->events.count - track->event_index &&
+            track->meta_index <= header->metas.count && track->meta_count <= header->metas.count - track->meta_index &&
+            track->payload_offset <= header->payload.count && track->payload_size <= header->payload.count - track->payload_offset;
+        if (!ok) break;
+
+        PackedTrack* packed = &cache->tracks[i];
+        packed->events = (PackedEvent*)(base + header->events.offset) + track->event_index;
+        packed->event_count = track->event_count;
+        packed->metas = (PackedMeta*)(base + header->metas.offset) + track->meta_index;
+        packed->meta_count = track->meta_count;
+        packed->payload = base + header->payload.offset + track->payload_offset;
+        packed->payload_size = track->payload_size;
+    }
+
+    if (ok) ok = cache_contents_valid(base, header, cache->tracks);
+
+    if (!ok) {
+        fprintf(stderr, "Ignoring stale or corrupt cache %s\n", path);
+        free(cache->tracks);
+        cache->tracks = NULL;
+        munmap(base, size);
+        return false;
+    }
+
+    // Playback walks the events front to back. Sections are only aligned to MIDI_CACHE_ALIGN, and madvise wants
+    // a page-aligned start.
+    const uintptr_t page_mask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    const uintptr_t events = (uintptr_t)(base + header->events.offset);
+    const uintptr_t events_page = events & page_mask;
+    madvise((void*)events_page, events + header->events.count * sizeof(PackedEvent) - events_page, MADV_SEQUENTIAL);
+
+    cache->base = base;
+    cache->size = size;
+    cache->track_count = (int)header->track_count;
+    cache->merged = merged;
+    cache->time_div = header->time_div;
+
+    cache->tempo_map.entries = (TempoEntry*)(base + header->tempo.offset);
+    cache->tempo_map.count = header->tempo.count;
+    cache->tempo_map.time_div = header->time_div;
+
+    cache->seek_index.points = (SeekPoint*)(base + header->seek_points.offset);
+    cache->seek_index.positions = (TrackPosition*)(base + header->seek_positions.offset);
+    cache->seek_index.channels = (ChannelState*)(base + header->seek_channels.offset);
+    cache->seek_index.count = header->seek_points.count;
+    cache->seek_index.capacity = header->seek_points.count;
+    cache->seek_index.track_count = (int)header->track_count;
+    cache->seek_index.interval_ns = header->seek_interval_ns;
+
+    cache->stats.event_count = header->event_count;
+    cache->stats.note_on_count = header->note_on_count;
+    cache->stats.note_off_count = header->note_off_count;
+    cache->stats.peak_polyphony = header->peak_polyphony;
+    cache->stats.peak_nps = header->peak_nps;
+    cache->stats.peak_burst = header->peak_burst;
+    cache->stats.largest_payload = header->largest_payload;
+    cache->stats.last_tick = header->last_tick;
+    cache->stats.duration_ns = header->duration_ns;
+    cache->stats.resolution_ns = header->resolution_ns;
+
+    const uint64_t end_time = cache_monotonic_us();
+    printf("Opened cache %s (%.1fMB) in %ldms (%ldμs).\n", path, (double)size / (1024.0 * 1024.0),
+        (long)((end_time - start_time) / 1000), (long)(end_time - start_time));
+
+    return true;
+}
+
+// Lay the next section out at an aligned offset
+static void cache_section(MidiCacheSection* section, uint64_t* offset, const uint64_t count, const size_t element_size) {
+    *offset = (*offset + MIDI_CACHE_ALIGN - 1) & ~(uint64_t)(MIDI_CACHE_ALIGN - 1);
+    section->offset = *offset;
+    section->count = count;
+    *offset += count * element_size;
+}
+
+static bool cache_write_at(FILE* out, const uint64_t offset, const void* data, const size_t length) {
+    static const uint8_t zeros[MIDI_CACHE_ALIGN] = {0};
+    const long position = ftell(out);
+    if (position < 0 || (uint64_t)position > offset) return false;
+
+    // Empty sections can leave more than one alignment gap in a row
+    uint64_t padding = offset - (uint64_t)position;
+    while (padding > 0) {
+        const size_t n = padding < sizeof(zeros) ? (size_t)padding : sizeof(zeros);
+        if (fwrite(zeros, 1, n, out) != n) return false;
+        padding -= n;
+    }
+    return length == 0 || fwrite(data, 1, length, out) == length;
+}
+
+// Written to a temporary file and renamed into place, so readers only ever see complete caches
+bool write_midi_cache(const char* path, const MidiCacheKey* key, const bool merged, const uint16_t time_div,
+    const PackedTrack* tracks, const int track_count, const TempoMap* tempo_map, const SeekIndex* seek_index, const MidiFileStats* stats) {
+    const uint64_t start_time = cache_monotonic_us();
+
+    MidiCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MIDI_CACHE_MAGIC, 8);
+    header.version = MIDI_CACHE_VERSION;
+    header.flags = merged ? MIDI_CACHE_MERGED : 0;
+    cache_struct_sizes(header.struct_sizes);
+    header.key = *key;
+    header.track_count = (uint32_t)track_count;
+    header.time_div = time_div;
+
+    MidiCacheTrack* table = calloc(track_count > 0 ? track_count : 1, sizeof(MidiCacheTrack));
+    if (!table) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+
+    uint64_t event_count = 0, meta_count = 0, payload_size = 0;
+    for (int i = 0; i < track_count; i++) {
+        table[i].event_index = event_count;
+        table[i].event_count = tracks[i].event_count;
+        table[i].meta_index = meta_count;
+        table[i].meta_count = tracks[i].meta_count;
+        table[i].payload_offset = payload_size;
+        table[i].payload_size = tracks[i].payload_size;
+        event_count += tracks[i].event_count;
+        meta_count += tracks[i].meta_count;
+        payload_size += tracks[i].payload_size;
+    }
+
+    const size_t seek_count = seek_index ? seek_index->count : 0;
+    uint64_t offset = sizeof(MidiCacheHeader);
+    cache_section(&header.tracks, &offset, track_count, sizeof(MidiCacheTrack));
+    cache_section(&header.events, &offset, event_count, sizeof(PackedEvent));
+    cache_section(&header.metas, &offset, meta_count, sizeof(PackedMeta));
+    cache_section(&header.payload, &offset, payload_size, 1);
+    cache_section(&header.tempo, &offset, tempo_map->count, sizeof(TempoEntry));
+    cache_section(&header.seek_points, &offset, seek_count, sizeof(SeekPoint));
+    cache_section(&header.seek_positions, &offset, seek_count * track_count, sizeof(TrackPosition));
+    cache_section(&header.seek_channels, &offset, seek_count * MIDI_CHANNELS, sizeof(ChannelState));
+    header.file_size = offset;
+    header.seek_interval_ns = seek_index ? seek_index->interval_ns : 0;
+
+    if (stats) {
+        header.event_count = stats->event_count;
+        header.note_on_count = stats->note_on_count;
+        header.note_off_count = stats->note_off_count;
+        header.peak_polyphony = stats->peak_polyphony;
+        header.peak_nps = stats->peak_nps;
+        header.peak_burst = stats->peak_burst;
+        header.largest_payload = stats->largest_payload;
+        header.last_tick = stats->last_tick;
+        header.duration_ns = stats->duration_ns;
+        header.resolution_ns = stats->resolution_ns;
+    }
+
+    const size_t temp_length = strlen(path) + 32;
+    char* temp_path = malloc(temp_length);
+    if (!temp_path) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(table);
+        return false;
+    }
+    snprintf(temp_path, temp_length, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE* out = fopen(temp_path, "wb");
+    if (!out) {
+        perror("Error creating cache file");
+        free(temp_path);
+        free(table);
+        return false;
+    }
+
+    bool ok = cache_write_at(out, 0, &header, sizeof(header)) &&
+        cache_write_at(out, header.tracks.offset, table, track_count * sizeof(MidiCacheTrack));
+
+    for (int i = 0; ok && i < track_count; i++) {
+        ok = cache_write_at(out, header.events.offset + table[i].event_index * sizeof(PackedEvent),
+            tracks[i].events, tracks[i].event_count * sizeof(PackedEvent));
+    }
+    for (int i = 0; ok && i < track_count; i++) {
+        ok = cache_write_at(out, header.metas.offset + table[i].meta_index * sizeof(PackedMeta),
+            tracks[i].metas, tracks[i].meta_count * sizeof(PackedMeta));
+    }
+    for (int i = 0; ok && i < track_count; i++) {
+        ok = cache_write_at(out, header.payload.offset + table[i].payload_offset, tracks[i].payload, tracks[i].payload_size);
+    }
+
+    ok = ok && cache_write_at(out, header.tempo.offset, tempo_map->entries, tempo_map->count * sizeof(TempoEntry));
+    if (ok && seek_count > 0) {
+        ok = cache_write_at(out, header.seek_points.offset, seek_index->points, seek_count * sizeof(SeekPoint)) &&
+            cache_write_at(out, header.seek_positions.offset, seek_index->positions, seek_count * track_count * sizeof(TrackPosition)) &&
+            cache_write_at(out, header.seek_channels.offset, seek_index->channels, seek_count * MIDI_CHANNELS * sizeof(ChannelState));
+    }
+    ok = ok && cache_write_at(out, header.file_size, NULL, 0);
+
+    if (fclose(out) != 0) ok = false;
+    if (ok && rename(temp_path, path) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Failed to write cache %s\n", path);
+        unlink(temp_path);
+    }
+
+    free(temp_path);
+    free(table);
+
+    const uint64_t end_time = cache_monotonic_us();
+    if (ok) {
+        printf("Wrote cache %s (%.1fMB) in %ldms (%ldμs).\n", path, (double)header.file_size / (1024.0 * 1024.0),
+            (long)((end_time - start_time) / 1000), (long)(end_time - start_time));
+    }
+
+    return ok;
+}
+
+void close_midi_cache(MidiCache* cache) {
+    if (cache->base) munmap(cache->base, cache->size);
+    free(cache->tracks);
+    memset(cache, 0, sizeof(MidiCache));
+}
@@ -0,0 +1,42 @@
+// midi_cache.h
+#ifndef MIDI_CACHE_H
+#define MIDI_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "midiplayer.h"
+
+// Bump whenever the on-disk layout changes; older caches are then rebuilt
+#define MIDI_CACHE_VERSION 2
+
+// Identifies the MIDI file a cache was built from
+typedef struct {
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t hash;              // FNV-1a of the header and the first and last 64 KB
+} MidiCacheKey;
+
+// An opened cache file. Tracks, tempo map and seek index point straight into the read-only mapping,
+// so nothing is parsed or copied; release everything with close_midi_cache.
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    PackedTrack* tracks;
+    int track_count;            // 1 for a merged timeline
+    bool merged;
+    uint16_t time_div;
+    TempoMap tempo_map;
+    SeekIndex seek_index;
+    MidiFileStats stats;        // stats.tracks is NULL, per-track counts aren't cached
+} MidiCache;
+
+bool midi_cache_key(const char* source, MidiCacheKey* key);
+char* midi_cache_path(const char* source, const char* cache_dir);
+bool open_midi_cache(const char* path, const MidiCacheKey* key, bool merged, MidiCache* cache);
+bool write_midi_cache(const char* path, const MidiCacheKey* key, bool merged, uint16_t time_div,
+    const PackedTrack* tracks, int track_count, const TempoMap* tempo_map, const SeekIndex* seek_index, const MidiFileStats* stats);
+void close_midi_cache(MidiCache* cache);
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "midilimiter.h"
+
+void midi_limiter_init(MidiLimiter* limiter, const uint8_t min_velocity, const bool drop_duplicates, const uint32_t max_per_key_ms, const uint32_t nps_ceiling) {
+    memset(limiter, 0, sizeof(MidiLimiter));
+    limiter->min_velocity = min_velocity;
+    limiter->drop_duplicates = drop_duplicates;
+    limiter->max_per_key_ms = max_per_key_ms;
+    limiter->nps_ceiling = nps_ceiling;
+    limiter->active = drop_duplicates || max_per_key_ms || nps_ceiling;
+
+    // Start full, so the first tenth of a second plays untouched
+    limiter->capacity = (uint64_t)nps_ceiling * 100;
+    if (nps_ceiling && limiter->capacity < 1000) limiter->capacity = 1000;
+    limiter->tokens = limiter->capacity;
+
+    // Nothing is sent yet, so no key can be waiting for its first note-on's millisecond
+    memset(limiter->key_ms, 0xFF, sizeof(limiter->key_ms));
+}
+
+// Global ceiling with priority by velocity: while the bucket is at least half full everything passes;
+// below that the velocity needed rises linearly to 127 at empty, so the loudest notes survive a flood
+bool midi_limiter_ceiling(MidiLimiter* limiter, const uint8_t velocity, const uint64_t time_ns) {
+    if (time_ns > limiter->refill_time_ns) {
+        // nps_ceiling notes per second is nps_ceiling / 1e6 milli-notes per ns; a second refills any bucket
+        const uint64_t elapsed = time_ns - limiter->refill_time_ns;
+        const uint64_t refill = elapsed >= 1000000000ULL ? limiter->capacity : elapsed * limiter->nps_ceiling / 1000000ULL;
+        if (refill >= limiter->capacity - limiter->tokens) {
+            limiter->tokens = limiter->capacity;
+            limiter->refill_time_ns = time_ns;
+        } else {
+            // Only advance by the time that was credited, so short gaps still add up
+            limiter->tokens += refill;
+            limiter->refill_time_ns += refill * 1000000ULL / limiter->nps_ceiling;
+        }
+    }
+
+    if (limiter->tokens < 1000) return false;
+
+    const uint64_t half = limiter->capacity / 2;
+    if (limiter->tokens < half && (uint64_t)velocity * half < (half - limiter->tokens) * 127) return false;
+
+    limiter->tokens -= 1000;
+    return true;
+}
+
+// Add another limiter's drop counts to this one, for one report over several threads
+void midi_limiter_merge(MidiLimiter* limiter, const MidiLimiter* other) {
+    limiter->dropped_quiet += other->dropped_quiet;
+    limiter->dropped_duplicate += other->dropped_duplicate;
+    limiter->dropped_key_rate += other->dropped_key_rate;
+    limiter->dropped_ceiling += other->dropped_ceiling;
+    limiter->dropped_note_offs += other->dropped_note_offs;
+}
+
+void midi_limiter_report(const MidiLimiter* limiter) {
+    const uint64_t dropped = limiter->dropped_quiet + limiter->dropped_duplicate + limiter->dropped_key_rate +
+        limiter->dropped_ceiling + limiter->dropped_note_offs;
+    if (dropped == 0) return;
+
+    printf("Dropped %lu quiet, %lu duplicate, %lu key-rate and %lu ceiling note-ons, %lu unpaired note-offs.\n",
+        (unsigned long)limiter->dropped_quiet, (unsigned long)limiter->dropped_duplicate,
+        (unsigned long)limiter->dropped_key_rate, (unsigned long)limiter->dropped_ceiling,
+        (unsigned long)limiter->dropped_note_offs);
+}
@@ -0,0 +1,95 @@
+// midi_limiter.h
+#ifndef MIDI_LIMITER_H
+#define MIDI_LIMITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MIDI_LIMITER_CHANNELS 16
+#define MIDI_LIMITER_KEYS 128
+
+// Thins out note floods between the sequencer and the sink. Note-offs are only passed for note-ons
+// that got through, so nothing is left hanging no matter what was dropped.
+typedef struct {
+    uint8_t min_velocity;       // Quieter note-ons are dropped
+    bool active;                // Any of the checks below is on; otherwise only min_velocity applies
+    bool drop_duplicates;       // Drop note-ons for a channel+key that is already sounding
+    uint32_t max_per_key_ms;    // Note-ons allowed per channel+key per millisecond, 0 for no limit
+    uint32_t nps_ceiling;       // Note-ons allowed per second overall, 0 for no limit
+
+    uint16_t sounding[MIDI_LIMITER_CHANNELS][MIDI_LIMITER_KEYS]; // Passed note-ons still waiting for a note-off
+    uint32_t key_ms[MIDI_LIMITER_CHANNELS][MIDI_LIMITER_KEYS];   // Millisecond of the last note-on per key
+    uint16_t key_count[MIDI_LIMITER_CHANNELS][MIDI_LIMITER_KEYS];
+
+    // Token bucket for the ceiling: refills at nps_ceiling per second, holds a tenth of a second
+    uint64_t tokens;            // In 1/1000 of a note
+    uint64_t capacity;
+    uint64_t refill_time_ns;
+
+    uint64_t dropped_quiet;
+    uint64_t dropped_duplicate;
+    uint64_t dropped_key_rate;
+    uint64_t dropped_ceiling;
+    uint64_t dropped_note_offs;
+} MidiLimiter;
+
+void midi_limiter_init(MidiLimiter* limiter, uint8_t min_velocity, bool drop_duplicates, uint32_t max_per_key_ms, uint32_t nps_ceiling);
+bool midi_limiter_ceiling(MidiLimiter* limiter, uint8_t velocity, uint64_t time_ns);
+void midi_limiter_merge(MidiLimiter* limiter, const MidiLimiter* other);
+void midi_limiter_report(const MidiLimiter* limiter);
+
+// Returns whether a note-on at time_ns (song time) goes to the sink
+inline __attribute__((always_inline)) static bool midi_limiter_note_on(MidiLimiter* limiter, const uint32_t message, const uint64_t time_ns) {
+    const uint8_t channel = message & 0x0F;
+    const uint8_t key = (message >> 8) & 0x7F;
+    const uint8_t velocity = (message >> 16) & 0x7F;
+
+    if (velocity < limiter->min_velocity) {
+        limiter->dropped_quiet++;
+        return false;
+    }
+    if (!limiter->active) return true;
+
+    uint16_t* sounding = &limiter->sounding[channel][key];
+    if (limiter->drop_duplicates && *sounding > 0) {
+        limiter->dropped_duplicate++;
+        return false;
+    }
+
+    if (limiter->max_per_key_ms) {
+        const uint32_t ms = (uint32_t)(time_ns / 1000000ULL);
+        if (limiter->key_ms[channel][key] != ms) {
+            limiter->key_ms[channel][key] = ms;
+            limiter->key_count[channel][key] = 0;
+        }
+        if (limiter->key_count[channel][key] >= limiter->max_per_key_ms) {
+            limiter->dropped_key_rate++;
+            return false;
+        }
+        limiter->key_count[channel][key]++;
+    }
+
+    if (limiter->nps_ceiling && !midi_limiter_ceiling(limiter, velocity, time_ns)) {
+        limiter->dropped_ceiling++;
+        return false;
+    }
+
+    if (*sounding < UINT16_MAX) (*sounding)++;
+    return true;
+}
+
+// Returns whether a note-off goes to the sink: only if it ends a note-on that was passed
+inline __attribute__((always_inline)) static bool midi_limiter_note_off(MidiLimiter* limiter, const uint32_t message) {
+    if (!limiter->active) return true;
+
+    uint16_t* sounding = &limiter->sounding[message & 0x0F][(message >> 8) & 0x7F];
+    if (*sounding == 0) {
+        limiter->dropped_note_offs++;
+        return false;
+    }
+    (*sounding)--;
+    return true;
+}
+
+#endif
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "midimetrics.h"
+#include "miditimer.h"
+
+#define load_counter(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+static void reset_thread_metrics(MidiThreadMetrics* thread) {
+    atomic_store(&thread->events, 0);
+    atomic_store(&thread->note_ons, 0);
+    atomic_store(&thread->dropped, 0);
+    atomic_store(&thread->batches, 0);
+    atomic_store(&thread->lag_total_ns, 0);
+    atomic_store(&thread->lag_max_ns, 0);
+    for (int i = 0; i < MIDI_LATENESS_BUCKETS; i++) {
+        atomic_store(&thread->lateness[i], 0);
+    }
+    atomic_store(&thread->schedule_ns, 0);
+    atomic_store(&thread->dispatch_ns, 0);
+}
+
+// The clock fields form a sequence lock with the playback thread as its only writer: it makes the count odd,
+// rewrites them and makes it even again, and readers retry until they saw the same even count on both sides.
+static unsigned clock_write_begin(MidiMetrics* metrics) {
+    const unsigned sequence = atomic_load_explicit(&metrics->clock_sequence, memory_order_relaxed) | 1;
+    atomic_store_explicit(&metrics->clock_sequence, sequence, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return sequence;
+}
+
+static void clock_write_end(MidiMetrics* metrics, const unsigned sequence) {
+    atomic_store_explicit(&metrics->clock_sequence, sequence + 1, memory_order_release);
+}
+
+void midi_metrics_reset(MidiMetrics* metrics) {
+    for (int t = 0; t < MIDI_METRICS_THREADS; t++) {
+        reset_thread_metrics(&metrics->threads[t]);
+    }
+    for (int s = 0; s < MIDI_METRICS_SHARDS; s++) {
+        reset_thread_metrics(&metrics->shards[s]);
+    }
+    atomic_store(&metrics->buffer_fill, 0);
+    atomic_store(&metrics->buffer_peak, 0);
+    atomic_store(&metrics->buffer_capacity, 0);
+    atomic_store(&metrics->underruns, 0);
+    atomic_store(&metrics->shard_count, 0);
+
+    const unsigned sequence = clock_write_begin(metrics);
+    atomic_store_explicit(&metrics->start_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&metrics->end_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&metrics->origin_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&metrics->playing, false, memory_order_relaxed);
+    clock_write_end(metrics, sequence);
+}
+
+// start_ns is when song time origin_ns is due on CLOCK_MONOTONIC
+void midi_metrics_start(MidiMetrics* metrics, const uint64_t start_ns, const uint64_t origin_ns) {
+    const unsigned sequence = clock_write_begin(metrics);
+    atomic_store_explicit(&metrics->start_ns, start_ns, memory_order_relaxed);
+    atomic_store_explicit(&metrics->origin_ns, origin_ns, memory_order_relaxed);
+    atomic_store_explicit(&metrics->playing, true, memory_order_relaxed);
+    clock_write_end(metrics, sequence);
+}
+
+void midi_metrics_stop(MidiMetrics* metrics) {
+    const unsigned sequence = clock_write_begin(metrics);
+    atomic_store_explicit(&metrics->end_ns, midi_timer_now_ns(), memory_order_relaxed);
+    atomic_store_explicit(&metrics->playing, false, memory_order_relaxed);
+    clock_write_end(metrics, sequence);
+}
+
+// Any thread, any time: a few loads and one clock read, retried only while a song starts or stops
+void midi_metrics_clock(const MidiMetrics* metrics, MidiClock* clock) {
+    unsigned sequence;
+    uint64_t start, end, origin;
+    bool playing;
+    do {
+        sequence = atomic_load_explicit(&metrics->clock_sequence, memory_order_acquire);
+        start = load_counter(metrics->start_ns);
+        end = load_counter(metrics->end_ns);
+        origin = load_counter(metrics->origin_ns);
+        playing = atomic_load_explicit(&metrics->playing, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((sequence & 1) || sequence != atomic_load_explicit(&metrics->clock_sequence, memory_order_relaxed));
+
+    clock->wall_ns = midi_timer_now_ns();
+    clock->start_ns = start;
+    clock->playing = playing;
+    clock->elapsed_ns = 0;
+    if (start) {
+        const uint64_t until = end ? end : clock->wall_ns;
+        clock->elapsed_ns = until > start ? until - start : 0;
+    }
+    clock->song_ns = origin + clock->elapsed_ns;
+}
+
+void midi_metrics_snapshot(const MidiMetrics* metrics, MidiMetricsSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(MidiMetricsSnapshot));
+
+    // Dispatcher and shard workers are summed as one; each of them only ever adds to its own counters
+    int shard_count = atomic_load_explicit(&metrics->shard_count, memory_order_relaxed);
+    if (shard_count > MIDI_METRICS_SHARDS) shard_count = MIDI_METRICS_SHARDS;
+    uint64_t lag_total_ns = 0;
+    for (int s = -1; s < shard_count; s++) {
+        const MidiThreadMetrics* dispatch = s < 0 ? &metrics->threads[MIDI_METRICS_DISPATCH] : &metrics->shards[s];
+        snapshot->events += load_counter(dispatch->events);
+        snapshot->note_ons += load_counter(dispatch->note_ons);
+        snapshot->dropped += load_counter(dispatch->dropped);
+        snapshot->batches += load_counter(dispatch->batches);
+        lag_total_ns += load_counter(dispatch->lag_total_ns);
+        const uint64_t lag_max_ns = load_counter(dispatch->lag_max_ns);
+        if (lag_max_ns > snapshot->lag_max_ns) snapshot->lag_max_ns = lag_max_ns;
+        for (int i = 0; i < MIDI_LATENESS_BUCKETS; i++) {
+            snapshot->lateness[i] += load_counter(dispatch->lateness[i]);
+        }
+        snapshot->schedule_ns += load_counter(dispatch->schedule_ns);
+        snapshot->dispatch_ns += load_counter(dispatch->dispatch_ns);
+    }
+    if (snapshot->batches) snapshot->lag_mean_ns = lag_total_ns / snapshot->batches;
+
+    const MidiThreadMetrics* producer = &metrics->threads[MIDI_METRICS_PRODUCER];
+    snapshot->produced = load_counter(producer->events);
+    snapshot->schedule_ns += load_counter(producer->schedule_ns);
+
+    snapshot->buffer_fill = load_counter(metrics->buffer_fill);
+    snapshot->buffer_peak = load_counter(metrics->buffer_peak);
+    snapshot->buffer_capacity = load_counter(metrics->buffer_capacity);
+    snapshot->underruns = load_counter(metrics->underruns);
+
+    MidiClock clock;
+    midi_metrics_clock(metrics, &clock);
+    snapshot->playing = clock.playing;
+    snapshot->elapsed_ns = clock.elapsed_ns;
+}
+
+// Lower bound of a lateness bucket in microseconds
+uint64_t midi_lateness_bucket_us(const int bucket) {
+    return bucket == 0 ? 0 : 1ULL << (bucket - 1);
+}
+
+// One row per call; nps is the note-on rate the caller measured since its previous row
+void midi_metrics_write(FILE* file, const MidiMetricsFormat format, const MidiMetricsSnapshot* snapshot, const uint64_t nps, const bool header) {
+    if (format == MIDI_METRICS_CSV) {
+        if (header) {
+            fprintf(file, "elapsed_ms,events,produced,note_ons,nps,dropped,batches,lag_mean_us,lag_max_us,"
+                "buffer_fill,buffer_peak,buffer_capacity,underruns,schedule_ms,dispatch_ms");
+            for (int i = 0; i < MIDI_LATENESS_BUCKETS; i++) {
+                fprintf(file, ",late_%luus", (unsigned long)midi_lateness_bucket_us(i));
+            }
+            fprintf(file, "\n");
+        }
+
+        fprintf(file, "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.1f,%.1f,%lu,%lu,%lu,%lu,%.1f,%.1f",
+            (unsigned long)(snapshot->elapsed_ns / 1000000), (unsigned long)snapshot->events,
+            (unsigned long)snapshot->produced, (unsigned long)snapshot->note_ons, (unsigned long)nps,
+            (unsigned long)snapshot->dropped, (unsigned long)snapshot->batches,
+            (double)snapshot->lag_mean_ns / 1000.0, (double)snapshot->lag_max_ns / 1000.0,
+            (unsigned long)snapshot->buffer_fill, (unsigned long)snapshot->buffer_peak,
+            (unsigned long)snapshot->buffer_capacity, (unsigned long)snapshot->underruns,
+            (double)snapshot->schedule_ns / 1e6, (double)snapshot->dispatch_ns / 1e6);
+        for (int i = 0; i < MIDI_LATENESS_BUCKETS; i++) {
+            fprintf(file, ",%lu", (unsigned long)snapshot->lateness[i]);
+        }
+        fprintf(file, "\n");
+    } else {
+        fprintf(file, "{\"elapsed_ms\":%lu,\"playing\":%s,\"events\":%lu,\"produced\":%lu,\"note_ons\":%lu,"
+            "\"nps\":%lu,\"dropped\":%lu,\"batches\":%lu,\"lag_mean_us\":%.1f,\"lag_max_us\":%.1f,"
+            "\"buffer_fill\":%lu,\"buffer_peak\":%lu,\"buffer_capacity\":%lu,\"underruns\":%lu,"
+            "\"schedule_ms\":%.1f,\"dispatch_ms\":%.1f,\"lateness\":{",
+            (unsigned long)(snapshot->elapsed_ns / 1000000), snapshot->playing ? "true" : "false",
+            (unsigned long)snapshot->events, (unsigned long)snapshot->produced,
+            (unsigned long)snapshot->note_ons, (unsigned long)nps,
+            (unsigned long)snapshot->dropped, (unsigned long)snapshot->batches,
+            (double)snapshot->lag_mean_ns / 1000.0, (double)snapshot->lag_max_ns / 1000.0,
+            (unsigned long)snapshot->buffer_fill, (unsigned long)snapshot->buffer_peak,
+            (unsigned long)snapshot->buffer_capacity, (unsigned long)snapshot->underruns,
+            (double)snapshot->schedule_ns / 1e6, (double)snapshot->dispatch_ns / 1e6);
+        for (int i = 0; i < MIDI_LATENESS_BUCKETS; i++) {
+            fprintf(file, "%s\"%lu\":%lu", i ? "," : "", (unsigned long)midi_lateness_bucket_us(i),
+                (unsigned long)snapshot->lateness[i]);
+        }
+        fprintf(file, "}}\n");
+    }
+    fflush(file);
+}
+
+bool parse_midi_metrics_format(const char* name, MidiMetricsFormat* format) {
+    if (strcmp(name, "csv") == 0) {
+        *format = MIDI_METRICS_CSV;
+    } else if (strcmp(name, "json") == 0) {
+        *format = MIDI_METRICS_JSON;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+// midi_metrics.h
+#ifndef MIDI_METRICS_H
+#define MIDI_METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+// Timer lateness histogram: bucket 0 is under 1μs, bucket i is [2^(i-1), 2^i)μs, the last one open-ended
+#define MIDI_LATENESS_BUCKETS 16
+
+// Most player workers of a sharded playback, each with counters of its own
+#define MIDI_METRICS_SHARDS 16
+
+// Threads that report into MidiMetrics
+typedef enum {
+    MIDI_METRICS_DISPATCH,      // Sends to the sink
+    MIDI_METRICS_PRODUCER,      // Lookahead producer, idle without lookahead
+    MIDI_METRICS_THREADS,
+} MidiMetricsThread;
+
+typedef enum {
+    MIDI_METRICS_CSV,
+    MIDI_METRICS_JSON,          // One object per line
+} MidiMetricsFormat;
+
+// Counters of one thread. Only that thread writes them, so updates are plain relaxed
+// load/store pairs without a locked instruction; any thread may read them.
+typedef struct {
+    _Alignas(64) atomic_uint_least64_t events;  // Dispatcher: messages sent to the sink. Producer: messages buffered
+    atomic_uint_least64_t note_ons;             // Note-ons seen, before the limiter
+    atomic_uint_least64_t dropped;              // Messages the limiter kept from the sink
+    atomic_uint_least64_t batches;
+    atomic_uint_least64_t lag_total_ns;         // How late batches reached the sink, from their due time to after submit
+    atomic_uint_least64_t lag_max_ns;
+    atomic_uint_least64_t lateness[MIDI_LATENESS_BUCKETS]; // How late the timer woke up for each deadline
+    atomic_uint_least64_t schedule_ns;          // Time spent in the sequencer
+    atomic_uint_least64_t dispatch_ns;          // Time spent in the callbacks, limiter and sink
+} MidiThreadMetrics;
+
+// Live playback metrics. Pass one in MidiPlayerOptions.metrics to poll it while the song plays.
+typedef struct {
+    MidiThreadMetrics threads[MIDI_METRICS_THREADS];
+    MidiThreadMetrics shards[MIDI_METRICS_SHARDS];  // Sharded playback: one per worker, summed with the dispatcher
+    _Alignas(64) atomic_uint_least64_t buffer_fill;  // Lookahead events waiting, as of the last dispatch
+    atomic_uint_least64_t buffer_peak;
+    atomic_uint_least64_t buffer_capacity;          // 0 without lookahead
+    atomic_uint_least64_t underruns;                // Times the lookahead buffer ran dry past a deadline
+    atomic_uint clock_sequence;                     // Odd while the playback thread rewrites the clock fields below
+    atomic_uint_least64_t start_ns;                 // CLOCK_MONOTONIC when playback started, 0 before
+    atomic_uint_least64_t end_ns;                   // CLOCK_MONOTONIC when playback ended, 0 before
+    atomic_uint_least64_t origin_ns;                // Song time playback started from, 0 unless seeked
+    atomic_bool playing;
+    atomic_int shard_count;                         // Entries of shards in use, 0 unless playing sharded
+} MidiMetrics;
+
+// One reading of the playback clock. Every field is from the same instant, so wall and song time can be
+// converted into each other; MidiNoteEvent.time_ns is on the elapsed_ns timeline.
+typedef struct {
+    uint64_t wall_ns;           // CLOCK_MONOTONIC at the reading
+    uint64_t start_ns;          // CLOCK_MONOTONIC at elapsed 0, 0 before playback
+    uint64_t elapsed_ns;        // Playback time, stopped at the end; 0 before playback
+    uint64_t song_ns;           // Position in the song: elapsed_ns past the seek point
+    bool playing;
+} MidiClock;
+
+// Plain copy of MidiMetrics with derived values. Every counter is exact, but they are read one
+// after another, so the set is not from a single instant.
+typedef struct {
+    uint64_t elapsed_ns;
+    bool playing;
+    uint64_t events;            // Sent to the sink
+    uint64_t produced;          // Put into the lookahead buffer
+    uint64_t note_ons;
+    uint64_t dropped;
+    uint64_t batches;
+    uint64_t lag_mean_ns;
+    uint64_t lag_max_ns;
+    uint64_t lateness[MIDI_LATENESS_BUCKETS];
+    uint64_t schedule_ns;       // Every playback thread together
+    uint64_t dispatch_ns;
+    uint64_t buffer_fill;
+    uint64_t buffer_peak;
+    uint64_t buffer_capacity;
+    uint64_t underruns;
+} MidiMetricsSnapshot;
+
+void midi_metrics_reset(MidiMetrics* metrics);
+void midi_metrics_start(MidiMetrics* metrics, uint64_t start_ns, uint64_t origin_ns);
+void midi_metrics_stop(MidiMetrics* metrics);
+void midi_metrics_clock(const MidiMetrics* metrics, MidiClock* clock);
+void midi_metrics_snapshot(const MidiMetrics* metrics, MidiMetricsSnapshot* snapshot);
+uint64_t midi_lateness_bucket_us(int bucket);
+void midi_metrics_write(FILE* file, MidiMetricsFormat format, const MidiMetricsSnapshot* snapshot, uint64_t nps, bool header);
+bool parse_midi_metrics_format(const char* name, MidiMetricsFormat* format);
+
+inline __attribute__((always_inline)) static void midi_metrics_add(atomic_uint_least64_t* counter, const uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+inline __attribute__((always_inline)) static void midi_metrics_max(atomic_uint_least64_t* counter, const uint64_t value) {
+    if (value > atomic_load_explicit(counter, memory_order_relaxed)) {
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+    }
+}
+
+inline __attribute__((always_inline)) static void midi_metrics_lateness(MidiThreadMetrics* thread, const uint64_t lateness_ns) {
+    const uint64_t us = lateness_ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= MIDI_LATENESS_BUCKETS) bucket = MIDI_LATENESS_BUCKETS - 1;
+    midi_metrics_add(&thread->lateness[bucket], 1);
+}
+
+inline __attribute__((always_inline)) static void midi_metrics_lag(MidiThreadMetrics* thread, const uint64_t lag_ns) {
+    midi_metrics_add(&thread->batches, 1);
+    midi_metrics_add(&thread->lag_total_ns, lag_ns);
+    midi_metrics_max(&thread->lag_max_ns, lag_ns);
+}
+
+#endif
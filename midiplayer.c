@@ -5,7 +5,22 @@
 #include <stdbool.h>
 #include <time.h>
 #include <pthread.h>
-#include <dlfcn.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "midiplayer.h"
+#include "midicache.h"
+#include "miditimer.h"
+#include "midirealtime.h"
+#include "midilimiter.h"
+#include "midimetrics.h"
+#include "midiscan.h"
+
+// How much of each track's head to prefetch when loading a mapped file
+#define MAPPED_TRACK_PREFETCH (64 * 1024)
 
 inline __attribute__((always_inline)) uint32_t fntohl(uint32_t nlong) {
     return ((nlong & 0xFF000000) >> 24) |
@@ -19,44 +34,14 @@ inline __attribute__((always_inline)) uint16_t fntohs(uint16_t nshort) {
     ((nshort & 0x00FF) << 8);
 }
 
-// Track data structure
-typedef struct {
-    uint8_t* data;
-    uint8_t* long_msg;
-    int tick;
-    size_t offset, length;
-    uint32_t message, temp;
-    size_t long_msg_len;
-    size_t long_msg_capacity;
-    size_t data_capacity;
-} TrackData;
-
-// Function pointer type for SendDirectData
-typedef void (*SendDirectDataFunc)(uint32_t);
-
 // Function declarations
 int decode_variable_length(TrackData* track);
 void update_tick(TrackData* track);
 void update_command(TrackData* track);
 void update_message(TrackData* track);
-void process_meta_event(TrackData* track, double* multiplier, uint64_t* bpm, uint16_t time_div);
+void process_meta_event(TrackData* track);
 void* log_notes_per_second(void* arg);
 
-uint64_t get100NanosecondsSinceEpoch() {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-
-    return ((uint64_t)ts.tv_sec * 10000000ULL) +
-    ((uint64_t)ts.tv_nsec / 100ULL);
-}
-
-void delayExecution100Ns(int64_t delayIn100Ns) {
-    struct timespec req = {0};
-    req.tv_sec = delayIn100Ns / 10000000;
-    req.tv_nsec = (delayIn100Ns % 10000000) * 100;
-    nanosleep(&req, NULL);
-}
-
 // Implementation of track functions
 inline __attribute__((always_inline)) int decode_variable_length(TrackData* track) {
     int result = 0;
@@ -102,61 +87,99 @@ inline __attribute__((always_inline)) void update_message(TrackData* track) {
         track->offset += 1;
         track->long_msg_len = decode_variable_length(track);
 
-        // Ensure we have enough capacity
-        if (track->long_msg_capacity < track->long_msg_len) {
-            printf("Alloc");
-            uint8_t* new_buf = realloc(track->long_msg, track->long_msg_len);
-            if (new_buf == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
+        // Mapped tracks point straight into the file instead of copying
+        if (!track->owns_data) {
+            if (track->long_msg_len > track->length - track->offset) {
+                track->long_msg_len = track->length - track->offset;
+            }
+            track->long_msg = &track->data[track->offset];
+        } else {
+            // Ensure we have enough capacity
+            if (track->long_msg_capacity < track->long_msg_len) {
+                uint8_t* new_buf = realloc(track->long_msg, track->long_msg_len);
+                if (new_buf == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+                track->long_msg = new_buf;
+                track->long_msg_capacity = track->long_msg_len;
             }
-            track->long_msg = new_buf;
-            track->long_msg_capacity = track->long_msg_len;
-        }
 
-        memcpy(track->long_msg, &track->data[track->offset], track->long_msg_len);
+            memcpy(track->long_msg, &track->data[track->offset], track->long_msg_len);
+        }
         track->offset += track->long_msg_len;
     }
 
-    track->message |= track->temp;
+    // Keep only the status byte so running status doesn't OR in the previous event's data
+    track->message = (track->message & 0xFF) | track->temp;
 }
 
-inline __attribute__((always_inline)) void process_meta_event(TrackData* track, double* multiplier, uint64_t* bpm, uint16_t time_div) {
-    const uint8_t meta_type = (track->message >> 8) & 0xFF;
-    if (meta_type == 0x51) { // Tempo change
-        *bpm = (track->long_msg[0] << 16) | (track->long_msg[1] << 8) | track->long_msg[2];
-        *multiplier = (double)(*bpm * 10) / (double)time_div;
-        *multiplier = (*multiplier < 1.0) ? 1.0 : *multiplier; // Ensure minimum multiplier of 1
-    }
-    else if (meta_type == 0x2F) { // End of track
+// Track is finished, either by its end-of-track event or by running out of data
+inline __attribute__((always_inline)) static void end_track(TrackData* track) {
+    if (track->owns_data) {
         free(track->data);
-        track->data = NULL;
-        track->length = 0;
+    } else {
+        track->long_msg = NULL;
     }
+    track->data = NULL;
+    track->length = 0;
 }
 
-typedef void (*NotePerSecondCallback)(uint64_t note_per_second);
+// Tempo changes are resolved through the TempoMap, so only end-of-track matters while playing
+inline __attribute__((always_inline)) void process_meta_event(TrackData* track) {
+    const uint8_t meta_type = (track->message >> 8) & 0xFF;
+    if (meta_type == 0x2F) { // End of track
+        end_track(track);
+    }
+}
 
 typedef struct {
-    bool* is_playing;
-    uint64_t* note_on_count;
+    MidiMetrics* metrics;
     NotePerSecondCallback npsCallback;
+    FILE* dump;                 // Periodic metrics rows, or NULL
+    MidiMetricsFormat format;
+    uint64_t interval_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // On CLOCK_MONOTONIC; signalled when running is cleared
+    bool running;
 } LoggerArgs;
 
+// Reads the metrics every interval; it never writes them, so the playback threads' counts are never lost.
+// One more round runs as soon as running is cleared, so the dump ends with the final totals and stopping
+// never waits out an interval.
 void* log_notes_per_second(void* arg) {
     LoggerArgs* args = (LoggerArgs*)arg;
-    bool* is_playing = args->is_playing;
-    uint64_t* note_on_count = args->note_on_count;
+    MidiMetricsSnapshot snapshot;
+    uint64_t last_note_ons = 0;
+    uint64_t last_elapsed = 0;
+    bool header = true;
+    uint64_t deadline = midi_timer_now_ns();
+
+    while (true) {
+        deadline += args->interval_ns;
+        const struct timespec wake = { (time_t)(deadline / 1000000000ULL), (long)(deadline % 1000000000ULL) };
+        pthread_mutex_lock(&args->lock);
+        while (args->running && pthread_cond_timedwait(&args->wake, &args->lock, &wake) == 0) {}
+        const bool running = args->running;
+        pthread_mutex_unlock(&args->lock);
+
+        midi_metrics_snapshot(args->metrics, &snapshot);
+        if (snapshot.elapsed_ns > last_elapsed) {
+            const uint64_t nps = (snapshot.note_ons - last_note_ons) * 1000000000ULL / (snapshot.elapsed_ns - last_elapsed);
+            last_note_ons = snapshot.note_ons;
+            last_elapsed = snapshot.elapsed_ns;
+
+            printf("Notes per second: %lu\n", nps);
+            if (args->npsCallback) args->npsCallback(nps);
+            if (args->dump) {
+                midi_metrics_write(args->dump, args->format, &snapshot, nps, header);
+                header = false;
+            }
+        }
 
-    while (*is_playing) {
-        struct timespec sleep_time = {1, 0}; // 1 second
-        nanosleep(&sleep_time, NULL);
-        printf("Notes per second: %lu\n", *note_on_count);
-        args->npsCallback(*note_on_count);
-        *note_on_count = 0;
+        if (!running) break;
     }
 
-    free(args);
     return NULL;
 }
 
@@ -171,341 +194,3451 @@ void init_track_data(TrackData* track) {
     track->long_msg_len = 0;
     track->long_msg_capacity = 0;
     track->data_capacity = 0;
+    track->owns_data = true;
 }
 
 void free_track_data(TrackData* track) {
-    if (track->data) free(track->data);
-    if (track->long_msg) free(track->long_msg);
+    if (track->owns_data) {
+        if (track->data) free(track->data);
+        if (track->long_msg) free(track->long_msg);
+    }
     track->data = NULL;
     track->long_msg = NULL;
 }
 
-typedef void (*NoteOnCallback)(uint8_t channel, uint8_t note, uint8_t velocity);
-typedef void (*NoteOffCallback)(uint8_t channel, uint8_t note);
+static bool start_logger(pthread_t* logger_thread, LoggerArgs* args) {
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&args->lock, NULL);
+    pthread_cond_init(&args->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    args->running = true;
+
+    if (pthread_create(logger_thread, NULL, log_notes_per_second, args) != 0) {
+        fprintf(stderr, "Could not start metrics thread\n");
+        pthread_cond_destroy(&args->wake);
+        pthread_mutex_destroy(&args->lock);
+        return false;
+    }
+    return true;
+}
+
+// Wakes the logger out of its wait, so this only takes as long as its last round
+static void stop_logger(const pthread_t logger_thread, LoggerArgs* args) {
+    pthread_mutex_lock(&args->lock);
+    args->running = false;
+    pthread_cond_signal(&args->wake);
+    pthread_mutex_unlock(&args->lock);
+    pthread_join(logger_thread, NULL);
+    pthread_cond_destroy(&args->wake);
+    pthread_mutex_destroy(&args->lock);
+}
+
+// How notes reach the caller. Each playback loop is compiled once per mode, so the loop for one mode
+// carries no checks for the others.
+typedef enum {
+    NOTE_CALLBACKS_NONE,
+    NOTE_CALLBACKS_PER_NOTE,
+    NOTE_CALLBACKS_BATCH,
+} NoteCallbackMode;
+
+typedef struct {
+    NoteCallbackMode mode;
+    NoteOnCallback note_on;     // Never NULL in NOTE_CALLBACKS_PER_NOTE
+    NoteOffCallback note_off;
+    NoteBatchCallback batch;
+    pthread_mutex_t* lock;      // Held around the callbacks while several shard workers share them, or NULL
+} NoteCallbacks;
+
+static void ignore_note_on(uint8_t channel, uint8_t note, uint8_t velocity) {
+    (void)channel; (void)note; (void)velocity;
+}
+
+static void ignore_note_off(uint8_t channel, uint8_t note) {
+    (void)channel; (void)note;
+}
+
+static NoteCallbacks make_note_callbacks(const NoteBatchCallback batch, const NoteOnCallback note_on, const NoteOffCallback note_off) {
+    NoteCallbacks callbacks = { NOTE_CALLBACKS_NONE, ignore_note_on, ignore_note_off, batch, NULL };
+    if (batch) {
+        callbacks.mode = NOTE_CALLBACKS_BATCH;
+    } else if (note_on || note_off) {
+        callbacks.mode = NOTE_CALLBACKS_PER_NOTE;
+        if (note_on) callbacks.note_on = note_on;
+        if (note_off) callbacks.note_off = note_off;
+    }
+    return callbacks;
+}
 
-void play_midi(
-    TrackData* tracks,
-    const int track_count,
-    const uint16_t time_div,
-    const SendDirectDataFunc SendDirectData,
-    const NoteOnCallback note_on_callback,
-    const NoteOffCallback note_off_callback,
-    const NotePerSecondCallback note_per_second_callback
+// Run the note callbacks over a batch and keep only what the limiter lets through to the synth.
+// Callbacks still see every note. out may be messages itself. Counts go to the calling thread's metrics.
+// mode must be a constant at every call site, so each caller gets its own specialized copy.
+inline __attribute__((always_inline)) static size_t filter_channel_messages(
+    const uint32_t* messages,
+    const size_t count,
+    uint32_t* out,
+    MidiLimiter* limiter,
+    const uint64_t time_ns,
+    const NoteCallbacks* callbacks,
+    const NoteCallbackMode mode,
+    MidiThreadMetrics* metrics
 ) {
-    uint64_t tick = 0;
-    double multiplier = 0;
-    uint64_t bpm = 500000;
-    uint64_t delta_tick = 0;
-    uint64_t last_time = get100NanosecondsSinceEpoch();
-    const uint64_t max_drift = 100000;
-    int64_t delta = 0;
-    uint64_t old = 0;
-    uint64_t temp = 0;
-
-    uint64_t note_on_count = 0;
-    bool is_playing = true;
-
-    pthread_t logger_thread;
-    LoggerArgs* logger_args = malloc(sizeof(LoggerArgs));
-    logger_args->is_playing = &is_playing;
-    logger_args->note_on_count = &note_on_count;
-    logger_args->npsCallback = note_per_second_callback;
-    pthread_create(&logger_thread, NULL, log_notes_per_second, logger_args);
-
-    bool has_active_tracks = true;
-
-    while (has_active_tracks) {
-        has_active_tracks = false;
-        int active_track_count = 0;
-        int* active_tracks = malloc(track_count * sizeof(int));
+    MidiNoteEvent notes[NOTE_BATCH_SIZE];
+    size_t note_count = 0;
+    size_t n = 0;
+    uint64_t note_ons = 0;
+    const bool locked = mode != NOTE_CALLBACKS_NONE && callbacks->lock;
+    if (locked) pthread_mutex_lock(callbacks->lock);
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t message = messages[i];
+        const uint8_t msg_type = message & 0xF0;
+        const uint8_t channel = message & 0x0F;
+        const uint8_t note = (message >> 8) & 0xFF;
+        const uint8_t velocity = (message >> 16) & 0xFF;
+
+        if (msg_type == 0x90 && velocity != 0) {  // Note On
+            note_ons++;
+            if (mode == NOTE_CALLBACKS_PER_NOTE) callbacks->note_on(channel, note, velocity);
+            if (mode == NOTE_CALLBACKS_BATCH) {
+                notes[note_count++] = (MidiNoteEvent){ time_ns, channel, note, velocity };
+                if (note_count == NOTE_BATCH_SIZE) {
+                    callbacks->batch(notes, note_count);
+                    note_count = 0;
+                }
+            }
+            if (!midi_limiter_note_on(limiter, message, time_ns)) continue;
+        } else if (msg_type == 0x80 || msg_type == 0x90) {  // Note Off
+            if (mode == NOTE_CALLBACKS_PER_NOTE) callbacks->note_off(channel, note);
+            if (mode == NOTE_CALLBACKS_BATCH) {
+                notes[note_count++] = (MidiNoteEvent){ time_ns, channel, note, 0 };
+                if (note_count == NOTE_BATCH_SIZE) {
+                    callbacks->batch(notes, note_count);
+                    note_count = 0;
+                }
+            }
+            if (!midi_limiter_note_off(limiter, message)) continue;
+        }
+        out[n++] = message;
+    }
+    if (mode == NOTE_CALLBACKS_BATCH && note_count > 0) callbacks->batch(notes, note_count);
+    if (locked) pthread_mutex_unlock(callbacks->lock);
 
-        for (int i = 0; i < track_count; i++) {
-            if (tracks[i].data != NULL) {
-                if (tracks[i].tick <= tick) {
-                    while (tracks[i].data != NULL && tracks[i].tick <= tick) {
-                        update_command(&tracks[i]);
-                        update_message(&tracks[i]);
-
-                        const uint32_t message = tracks[i].message;
-                        const uint8_t msg_type = message & 0xF0;
-                        const uint8_t channel = message & 0x0F;
-
-                        if (msg_type < 0xF0) {
-                            const uint8_t note = (message >> 8) & 0xFF;
-                            const uint8_t velocity = (message >> 16) & 0xFF;
-
-                            if (msg_type == 0x90) {  // Note On
-                                note_on_count++;
-                                if (note_on_callback) note_on_callback(channel, note, velocity);
-                                if (velocity >= 5) {
-                                    SendDirectData(message);
-                                }
-                            } else if (msg_type == 0x80 || (msg_type == 0x90 && velocity == 0)) {  // Note Off
-                                if (note_off_callback) note_off_callback(channel, note);
-                                SendDirectData(message);
-                            } else {
-                                SendDirectData(message);
-                            }
-                        } else if ((message & 0xFF) == 0xFF) {
-                            process_meta_event(&tracks[i], &multiplier, &bpm, time_div);
-                        } else if ((message & 0xFF) == 0xF0) {
-                            printf("TODO: Handle SysEx\n");
-                        }
-
-                        if (tracks[i].data != NULL) {
-                            update_tick(&tracks[i]);
-                        }
-                    }
+    midi_metrics_add(&metrics->note_ons, note_ons);
+    midi_metrics_add(&metrics->events, n);
+    midi_metrics_add(&metrics->dropped, count - n);
+    return n;
+}
+
+// Pre-decode pass: run the track through the regular decoder once and keep the result as plain arrays.
+// The raw track is consumed; its data can be released afterwards.
+// With sizes from the statistics pass every array is allocated once at its final size.
+bool pack_track(TrackData* track, const TrackStats* sizes, PackedTrack* packed) {
+    memset(packed, 0, sizeof(PackedTrack));
+
+    size_t event_capacity = sizes ? sizes->event_count + 1 : track->length / 4 + 16;
+    size_t meta_capacity = sizes ? sizes->meta_count + 1 : 16;
+    size_t payload_capacity = sizes ? sizes->payload_size + 1 : 256;
+    packed->events = malloc(event_capacity * sizeof(PackedEvent));
+    packed->metas = malloc(meta_capacity * sizeof(PackedMeta));
+    packed->payload = malloc(payload_capacity);
+    if (!packed->events || !packed->metas || !packed->payload) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free_packed_track(packed);
+        return false;
+    }
+
+    while (track->data != NULL && track->offset < track->length) {
+        update_command(track);
+        update_message(track);
+
+        uint32_t message = track->message;
+        const uint8_t status = message & 0xFF;
+
+        if (status == 0xFF || status == 0xF0) {
+            const uint8_t type = (status == 0xFF) ? (message >> 8) & 0xFF : 0;
+            if (status == 0xFF && type == 0x2F) break; // End of track
+
+            if (packed->meta_count > PACKED_META_INDEX_MAX) {
+                fprintf(stderr, "Too many meta events in track\n");
+                free_packed_track(packed);
+                return false;
+            }
+
+            if (packed->meta_count == meta_capacity) {
+                meta_capacity *= 2;
+                PackedMeta* new_metas = realloc(packed->metas, meta_capacity * sizeof(PackedMeta));
+                if (!new_metas) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    free_packed_track(packed);
+                    return false;
                 }
+                packed->metas = new_metas;
+            }
 
-                if (tracks[i].data != NULL) {
-                    active_tracks[active_track_count++] = i;
-                    has_active_tracks = true;
+            if (packed->payload_size + track->long_msg_len > payload_capacity) {
+                while (packed->payload_size + track->long_msg_len > payload_capacity) payload_capacity *= 2;
+                uint8_t* new_payload = realloc(packed->payload, payload_capacity);
+                if (!new_payload) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    free_packed_track(packed);
+                    return false;
                 }
+                packed->payload = new_payload;
             }
-        }
 
-        if (!has_active_tracks) {
-            free(active_tracks);
-            break;
+            PackedMeta* meta = &packed->metas[packed->meta_count];
+            meta->offset = (uint32_t)packed->payload_size;
+            meta->length = (uint32_t)track->long_msg_len;
+            meta->tick = (uint32_t)track->tick;
+            meta->status = status;
+            meta->type = type;
+            memcpy(&packed->payload[packed->payload_size], track->long_msg, track->long_msg_len);
+            packed->payload_size += track->long_msg_len;
+
+            message = status | (uint32_t)packed->meta_count << 8;
+            packed->meta_count++;
+        } else if (status >= 0xF0) {
+            // Other system messages have no effect on playback
+            update_tick(track);
+            continue;
         }
 
-        delta_tick = UINT64_MAX;
-        for (int i = 0; i < active_track_count; i++) {
-            int idx = active_tracks[i];
-            if (tracks[idx].data != NULL) {
-                uint64_t track_delta = tracks[idx].tick - tick;
-                if (track_delta < delta_tick) {
-                    delta_tick = track_delta;
-                }
+        if (packed->event_count == event_capacity) {
+            event_capacity *= 2;
+            PackedEvent* new_events = realloc(packed->events, event_capacity * sizeof(PackedEvent));
+            if (!new_events) {
+                fprintf(stderr, "Memory allocation failed\n");
+                free_packed_track(packed);
+                return false;
             }
+            packed->events = new_events;
         }
 
-        free(active_tracks);
+        packed->events[packed->event_count].tick = (uint32_t)track->tick;
+        packed->events[packed->event_count].message = message;
+        packed->event_count++;
+
+        update_tick(track);
+    }
+
+    return true;
+}
+
+void free_packed_track(PackedTrack* packed) {
+    free(packed->events);
+    free(packed->metas);
+    free(packed->payload);
+    memset(packed, 0, sizeof(PackedTrack));
+}
+
+void free_packed_tracks(PackedTrack* packed, const int track_count) {
+    for (int i = 0; i < track_count; i++) {
+        free_packed_track(&packed[i]);
+    }
+    free(packed);
+}
+
+// Wall clock in microseconds, for timing phases that run on several threads
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
 
-        tick += delta_tick;
+int default_thread_count() {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
 
-        const uint64_t now = get100NanosecondsSinceEpoch();
-        temp = now - last_time;
-        last_time = now;
-        temp -= old;
-        old = delta_tick * multiplier;
-        delta += temp;
+typedef struct {
+    int index;
+    size_t length;
+} TrackOrder;
+
+static int compare_track_order(const void* a, const void* b) {
+    const size_t la = ((const TrackOrder*)a)->length;
+    const size_t lb = ((const TrackOrder*)b)->length;
+    return (la < lb) - (la > lb);
+}
 
-        temp = (delta > 0) ? (old - delta) : old;
+typedef bool (*TrackJobFunc)(void* context, int index);
 
-        if (temp <= 0) {
-            delta = (delta < (int64_t)max_drift) ? delta : (int64_t)max_drift;
-        } else {
-            delayExecution100Ns(temp);
+// Shared work queue for the per-track workers; tracks are handed out biggest first
+typedef struct {
+    TrackJobFunc func;
+    void* context;
+    const TrackOrder* order;
+    int track_count;
+    atomic_int next;
+    atomic_bool failed;
+} TrackJobQueue;
+
+static void* track_job_worker(void* arg) {
+    TrackJobQueue* queue = (TrackJobQueue*)arg;
+
+    while (!atomic_load_explicit(&queue->failed, memory_order_relaxed)) {
+        const int i = atomic_fetch_add_explicit(&queue->next, 1, memory_order_relaxed);
+        if (i >= queue->track_count) break;
+
+        if (!queue->func(queue->context, queue->order[i].index)) {
+            atomic_store(&queue->failed, true);
         }
     }
 
-    is_playing = false;
-    pthread_join(logger_thread, NULL);
+    return NULL;
 }
 
-TrackData* load_midi_file(const char* filename, uint16_t* time_div, int* track_count) {
-    TrackData* tracks = NULL;
-    FILE* file = fopen(filename, "rb");
+// Run func once for every track on up to thread_count threads (0 for one per CPU).
+// Returns the number of threads that took part, or 0 if any job failed.
+static int run_track_jobs(const TrackData* tracks, const int track_count, int thread_count, const TrackJobFunc func, void* context) {
+    if (thread_count <= 0) thread_count = default_thread_count();
+    if (thread_count > track_count) thread_count = track_count > 0 ? track_count : 1;
 
-    if (!file) {
-        fprintf(stderr, "Could not open file\n");
-        return NULL;
+    TrackOrder* order = malloc((track_count > 0 ? track_count : 1) * sizeof(TrackOrder));
+    pthread_t* workers = malloc(thread_count * sizeof(pthread_t));
+    if (!order || !workers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(order);
+        free(workers);
+        return 0;
     }
 
-    clock_t start_time = clock();
+    for (int i = 0; i < track_count; i++) {
+        order[i].index = i;
+        order[i].length = tracks[i].length;
+    }
+    qsort(order, track_count, sizeof(TrackOrder), compare_track_order);
+
+    TrackJobQueue queue = {
+        .func = func,
+        .context = context,
+        .order = order,
+        .track_count = track_count,
+    };
+    atomic_init(&queue.next, 0);
+    atomic_init(&queue.failed, false);
+
+    // The calling thread works too, so only thread_count - 1 extra threads are started
+    int started = 0;
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&workers[started], NULL, track_job_worker, &queue) == 0) started++;
+    }
+    track_job_worker(&queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
 
-    char header[4];
-    fread(header, 1, 4, file);
-    if (strncmp(header, "MThd", 4) != 0) {
-        fprintf(stderr, "Not a MIDI file\n");
-        fclose(file);
+    free(workers);
+    free(order);
+
+    return atomic_load(&queue.failed) ? 0 : started + 1;
+}
+
+typedef struct {
+    TrackData* tracks;
+    PackedTrack* packed;
+    const TrackStats* sizes;
+} PackContext;
+
+static bool pack_track_job(void* context, const int index) {
+    PackContext* pack = (PackContext*)context;
+    return pack_track(&pack->tracks[index], pack->sizes ? &pack->sizes[index] : NULL, &pack->packed[index]);
+}
+
+// Chunk boundaries are already known from loading, so every track decodes independently
+PackedTrack* pack_tracks(TrackData* tracks, const int track_count, const int thread_count, const TrackStats* sizes) {
+    const uint64_t start_time = monotonic_us();
+
+    PackedTrack* packed = calloc(track_count > 0 ? track_count : 1, sizeof(PackedTrack));
+    if (!packed) {
+        fprintf(stderr, "Memory allocation failed\n");
         return NULL;
     }
 
-    uint32_t header_length;
-    fread(&header_length, 4, 1, file);
-    header_length = fntohl(header_length);
-    if (header_length != 6) {
-        fprintf(stderr, "Invalid header length\n");
-        fclose(file);
+    PackContext context = { tracks, packed, sizes };
+    const int threads = run_track_jobs(tracks, track_count, thread_count, pack_track_job, &context);
+    if (threads == 0) {
+        free_packed_tracks(packed, track_count);
         return NULL;
     }
 
-    uint16_t format;
-    fread(&format, 2, 1, file);
-    format = fntohs(format);
+    size_t event_count = 0;
+    for (int i = 0; i < track_count; i++) {
+        event_count += packed[i].event_count;
+    }
 
-    uint16_t num_tracks;
-    fread(&num_tracks, 2, 1, file);
-    num_tracks = fntohs(num_tracks);
+    const uint64_t end_time = monotonic_us();
 
-    fread(time_div, 2, 1, file);
-    *time_div = fntohs(*time_div);
+    printf("Decoded %zu events on %d threads in %ldms (%ldμs).\n", event_count, threads,
+        (long)((end_time - start_time) / 1000), (long)(end_time - start_time));
 
-    if (*time_div >= 0x8000) {
-        fprintf(stderr, "SMPTE timing not supported\n");
-        fclose(file);
-        return NULL;
-    }
+    return packed;
+}
 
-    printf("%d tracks\n", num_tracks);
+// Tempo change found while scanning, ordered the way playback would apply it
+typedef struct {
+    uint64_t tick;
+    uint32_t usec_per_quarter;
+    int track;
+    size_t index;
+} TempoEvent;
+
+static int compare_tempo_events(const void* a, const void* b) {
+    const TempoEvent* ea = (const TempoEvent*)a;
+    const TempoEvent* eb = (const TempoEvent*)b;
+    if (ea->tick != eb->tick) return (ea->tick > eb->tick) - (ea->tick < eb->tick);
+    if (ea->track != eb->track) return (ea->track > eb->track) - (ea->track < eb->track);
+    return (ea->index > eb->index) - (ea->index < eb->index);
+}
 
-    tracks = malloc(num_tracks * sizeof(TrackData));
-    if (!tracks) {
+inline __attribute__((always_inline)) static uint32_t read_tempo(const uint8_t* payload) {
+    return (payload[0] << 16) | (payload[1] << 8) | payload[2];
+}
+
+// Sorts events and turns them into segments; of several changes on one tick the last one wins
+static bool tempo_map_from_events(TempoEvent* events, const size_t count, const uint16_t time_div, TempoMap* map) {
+    qsort(events, count, sizeof(TempoEvent), compare_tempo_events);
+
+    map->time_div = time_div;
+    map->count = 1;
+    map->entries = malloc((count + 1) * sizeof(TempoEntry));
+    if (!map->entries) {
         fprintf(stderr, "Memory allocation failed\n");
-        fclose(file);
-        return NULL;
+        map->count = 0;
+        return false;
     }
 
-    // Initialize tracks
-    for (int i = 0; i < num_tracks; i++) {
-        init_track_data(&tracks[i]);
-    }
+    map->entries[0].tick = 0;
+    map->entries[0].time_ns = 0;
+    map->entries[0].usec_per_quarter = MIDI_DEFAULT_TEMPO;
 
-    int valid_tracks = 0;
-    for (int i = 0; i < num_tracks; ++i) {
-        fread(header, 1, 4, file);
-        if (strncmp(header, "MTrk", 4) != 0) {
+    for (size_t i = 0; i < count; i++) {
+        // A tempo of 0 would put every later tick at the same time and divide by zero looking them up
+        if (events[i].usec_per_quarter == 0) continue;
+
+        TempoEntry* last = &map->entries[map->count - 1];
+        if (events[i].tick == last->tick) {
+            last->usec_per_quarter = events[i].usec_per_quarter;
             continue;
         }
 
-        uint32_t length;
-        fread(&length, 4, 1, file);
-        length = fntohl(length);
+        TempoEntry* entry = &map->entries[map->count++];
+        entry->tick = events[i].tick;
+        entry->time_ns = tempo_entry_time_ns(last, time_div, events[i].tick);
+        entry->usec_per_quarter = events[i].usec_per_quarter;
+    }
 
-        // Allocate memory for track data
-        tracks[valid_tracks].data = malloc(length);
-        if (!tracks[valid_tracks].data) {
-            fprintf(stderr, "Memory allocation failed\n");
-            for (int j = 0; j < valid_tracks; j++) {
-                free_track_data(&tracks[j]);
-            }
-            free(tracks);
-            fclose(file);
-            return NULL;
-        }
+    return true;
+}
 
-        // Allocate initial long message buffer
-        tracks[valid_tracks].long_msg = malloc(256);
-        if (!tracks[valid_tracks].long_msg) {
-            fprintf(stderr, "Memory allocation failed\n");
-            free(tracks[valid_tracks].data);
-            for (int j = 0; j < valid_tracks; j++) {
-                free_track_data(&tracks[j]);
-            }
-            free(tracks);
-            fclose(file);
-            return NULL;
+bool build_tempo_map_packed(const PackedTrack* tracks, const int track_count, const uint16_t time_div, TempoMap* map) {
+    size_t count = 0;
+    for (int i = 0; i < track_count; i++) {
+        for (size_t m = 0; m < tracks[i].meta_count; m++) {
+            if (tracks[i].metas[m].type == 0x51 && tracks[i].metas[m].length >= 3) count++;
         }
+    }
 
-        tracks[valid_tracks].long_msg_capacity = 256;
-        tracks[valid_tracks].length = length;
-        tracks[valid_tracks].data_capacity = length;
-        tracks[valid_tracks].tick = 0;
-        tracks[valid_tracks].offset = 0;
-        tracks[valid_tracks].message = 0;
-        tracks[valid_tracks].temp = 0;
-
-        fread(tracks[valid_tracks].data, 1, length, file);
-        update_tick(&tracks[valid_tracks]);
-        valid_tracks++;
+    TempoEvent* events = malloc((count > 0 ? count : 1) * sizeof(TempoEvent));
+    if (!events) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
     }
 
-    *track_count = valid_tracks;
+    size_t n = 0;
+    for (int i = 0; i < track_count; i++) {
+        for (size_t m = 0; m < tracks[i].meta_count; m++) {
+            const PackedMeta* meta = &tracks[i].metas[m];
+            if (meta->type != 0x51 || meta->length < 3) continue;
+            events[n].tick = meta->tick;
+            events[n].usec_per_quarter = read_tempo(&tracks[i].payload[meta->offset]);
+            events[n].track = i;
+            events[n].index = m;
+            n++;
+        }
+    }
 
-    const clock_t end_time = clock();
-    const double duration_seconds = (double)(end_time - start_time) / CLOCKS_PER_SEC;
-    const long duration_microseconds = (long)(duration_seconds * 1000000);
-    const long duration_milliseconds = (long)(duration_seconds * 1000);
+    const bool ok = tempo_map_from_events(events, n, time_div, map);
+    free(events);
+    return ok;
+}
 
-    printf("Parsed in %ldms (%ldμs).\n", duration_milliseconds, duration_microseconds);
+typedef struct {
+    const TrackData* tracks;
+    TempoEvent** events;
+    size_t* counts;
+    TrackStats* stats;          // Per-track counts, or NULL when only the tempo map is wanted
+} TrackScanContext;
 
-    fclose(file);
-    return tracks;
+typedef struct {
+    TempoEvent* events;
+    size_t count;
+    size_t capacity;
+    int track;
+} TempoCollector;
+
+static bool collect_tempo(void* context, const uint64_t tick, const uint8_t status, const uint8_t type, const uint8_t* payload, const size_t length) {
+    TempoCollector* tempo = (TempoCollector*)context;
+    if (status != 0xFF || type != 0x51 || length < 3) return true;
+
+    if (tempo->count == tempo->capacity) {
+        tempo->capacity = tempo->capacity ? tempo->capacity * 2 : 16;
+        TempoEvent* new_events = realloc(tempo->events, tempo->capacity * sizeof(TempoEvent));
+        if (!new_events) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return false;
+        }
+        tempo->events = new_events;
+    }
+    tempo->events[tempo->count] = (TempoEvent){ tick, read_tempo(payload), tempo->track, tempo->count };
+    tempo->count++;
+    return true;
 }
 
-void* initialize_midi(SendDirectDataFunc* SendDirectData) {
-    void* midi_lib = dlopen("./libOmniMIDI.so", RTLD_LAZY);
+// Walks a copy of the track cursor with the widest scanner the CPU has; payloads are only pointed at, never copied.
+// Counts mirror pack_track, so they can size its arrays exactly.
+static bool scan_track(void* context, const int index) {
+    TrackScanContext* scan = (TrackScanContext*)context;
+    TrackData track = scan->tracks[index];
+    TempoCollector tempo = { .track = index };
+    TrackStats stats;
+
+    if (!midi_scan_track(&track, midi_scan_level(), &stats, collect_tempo, &tempo)) {
+        free(tempo.events);
+        return false;
+    }
 
-    if (!midi_lib) {
-        fprintf(stderr, "Failed to load OmniMIDI.so: %s\n!!!", dlerror());
-        return NULL;
+    if (scan->stats) scan->stats[index] = stats;
+    scan->events[index] = tempo.events;
+    scan->counts[index] = tempo.count;
+    return true;
+}
+
+// Scans every streaming track once, collecting its 0x51 events and optionally its TrackStats
+static bool scan_tracks(const TrackData* tracks, const int track_count, const uint16_t time_div, const int thread_count, TempoMap* map, TrackStats* stats, size_t* tempo_count) {
+    TrackScanContext scan = {
+        .tracks = tracks,
+        .events = calloc(track_count > 0 ? track_count : 1, sizeof(TempoEvent*)),
+        .counts = calloc(track_count > 0 ? track_count : 1, sizeof(size_t)),
+        .stats = stats,
+    };
+    if (!scan.events || !scan.counts) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(scan.events);
+        free(scan.counts);
+        return false;
     }
 
-    // Clear any existing error
-    dlerror();
+    bool ok = run_track_jobs(tracks, track_count, thread_count, scan_track, &scan) > 0;
 
-    bool (*IsKDMAPIAvailable)() = dlsym(midi_lib, "IsKDMAPIAvailable");
-    const char* dlsym_error = dlerror();
-    if (dlsym_error) {
-        fprintf(stderr, "Cannot load IsKDMAPIAvailable: %s\n", dlsym_error);
-        dlclose(midi_lib);
-        return NULL;
+    size_t count = 0;
+    for (int i = 0; i < track_count; i++) {
+        count += scan.counts[i];
     }
 
-    bool (*InitializeKDMAPIStream)() = dlsym(midi_lib, "InitializeKDMAPIStream");
-    dlsym_error = dlerror();
-    if (dlsym_error) {
-        fprintf(stderr, "Cannot load InitializeKDMAPIStream: %s\n", dlsym_error);
-        dlclose(midi_lib);
-        return NULL;
+    TempoEvent* events = ok ? malloc((count > 0 ? count : 1) * sizeof(TempoEvent)) : NULL;
+    if (ok && !events) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ok = false;
     }
 
-    if (!IsKDMAPIAvailable || !InitializeKDMAPIStream ||
-        !IsKDMAPIAvailable() || !InitializeKDMAPIStream()) {
-        fprintf(stderr, "MIDI initialization failed\n");
-    dlclose(midi_lib);
-    return NULL;
+    size_t n = 0;
+    for (int i = 0; i < track_count; i++) {
+        if (events) {
+            memcpy(&events[n], scan.events[i], scan.counts[i] * sizeof(TempoEvent));
+            n += scan.counts[i];
         }
+        free(scan.events[i]);
+    }
+    free(scan.events);
+    free(scan.counts);
 
-        *SendDirectData = dlsym(midi_lib, "SendDirectData");
-        dlsym_error = dlerror();
-        if (dlsym_error) {
-            fprintf(stderr, "Cannot load SendDirectData: %s\n", dlsym_error);
-            dlclose(midi_lib);
-            return NULL;
-        }
+    if (ok) ok = tempo_map_from_events(events, n, time_div, map);
+    free(events);
 
-        return midi_lib;
+    *tempo_count = n;
+    return ok;
 }
 
-bool PlayMIDI(char* file, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback)
-{
-    // Initialize MIDI
-    SendDirectDataFunc SendDirectData;
-    const clock_t start_time = clock();
+// Streaming tracks have no meta table, so every track is scanned once for 0x51 events
+bool build_tempo_map_tracks(const TrackData* tracks, const int track_count, const uint16_t time_div, const int thread_count, TempoMap* map) {
+    const uint64_t start_time = monotonic_us();
 
-    void* midi_lib = initialize_midi(&SendDirectData);
-    if (!midi_lib) {
-        return 1;
+    size_t n = 0;
+    const bool ok = scan_tracks(tracks, track_count, time_div, thread_count, map, NULL, &n);
+
+    const uint64_t end_time = monotonic_us();
+    if (ok) {
+        printf("Scanned %zu tempo changes in %ldms (%ldμs).\n", n, (long)((end_time - start_time) / 1000), (long)(end_time - start_time));
     }
 
-    // Load MIDI file
-    uint16_t time_div = 0;
-    int track_count = 0;
-    TrackData* tracks = load_midi_file(file, &time_div, &track_count);
-    if (!tracks) {
-        dlclose(midi_lib);
-        return 1;
+    return ok;
+}
+
+// Index of the segment containing tick
+size_t tempo_map_find(const TempoMap* map, const uint64_t tick) {
+    size_t lo = 0, hi = map->count;
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (map->entries[mid].tick <= tick) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
     }
+    return lo;
+}
 
-    const clock_t end_time = clock();
-    const double duration_seconds = (double)(end_time - start_time) / CLOCKS_PER_SEC;
-    const long duration_milliseconds = (long)(duration_seconds * 1000);
+uint64_t tempo_map_time_ns(const TempoMap* map, const uint64_t tick) {
+    return tempo_entry_time_ns(&map->entries[tempo_map_find(map, tick)], map->time_div, tick);
+}
 
-    printf("MIDI initialization took %ldms.\n", duration_milliseconds);
-    printf("\n\n\nPlaying midi file: %s\n", file);
+// Inverse lookup: the last tick that starts at or before time_ns
+uint64_t tempo_map_tick_at(const TempoMap* map, const uint64_t time_ns) {
+    size_t lo = 0, hi = map->count;
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (map->entries[mid].time_ns <= time_ns) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
 
-    play_midi(tracks, track_count, time_div, SendDirectData, note_on_callback, note_off_callback, note_per_second_callback);
+    const TempoEntry* entry = &map->entries[lo];
+    const uint64_t elapsed = time_ns - entry->time_ns;
+    return entry->tick + (uint64_t)((unsigned __int128)elapsed * map->time_div / ((uint64_t)entry->usec_per_quarter * 1000));
+}
 
-    // Clean up
-    for (int i = 0; i < track_count; i++) {
-        free_track_data(&tracks[i]);
+void free_tempo_map(TempoMap* map) {
+    free(map->entries);
+    map->entries = NULL;
+    map->count = 0;
+}
+
+// Finest resolution of the peak polyphony / notes per second buckets
+#define STATS_RESOLUTION_NS 1000000ULL
+// Most buckets used; longer songs get coarser buckets instead of more memory
+#define STATS_MAX_BUCKETS (1 << 22)
+
+typedef struct {
+    const TrackData* tracks;
+    const TempoMap* tempo_map;
+    uint64_t resolution_ns;
+    size_t bucket_count;
+    _Atomic uint32_t* note_ons;     // Note-ons starting in each bucket
+    _Atomic int32_t* polyphony;     // Change in sounding notes over each bucket
+} DensityScanContext;
+
+// Second pass over a track once the tempo map is known: drops every note into its time bucket
+static bool scan_track_density(void* context, const int index) {
+    DensityScanContext* scan = (DensityScanContext*)context;
+    const TempoMap* map = scan->tempo_map;
+    TrackData track = scan->tracks[index];
+    track.owns_data = false;
+
+    // Sounding count of every channel/key, so unmatched note-offs don't lower the polyphony
+    uint16_t sounding[MIDI_CHANNELS][128] = {{0}};
+    size_t segment = 0;
+
+    while (track.data != NULL && track.offset < track.length) {
+        update_command(&track);
+        update_message(&track);
+
+        const uint32_t message = track.message;
+        const uint8_t status = message & 0xFF;
+        if (status == 0xFF && ((message >> 8) & 0xFF) == 0x2F) break;
+
+        const uint8_t msg_type = status & 0xF0;
+        if (msg_type == 0x80 || msg_type == 0x90) {
+            const uint64_t tick = (uint64_t)track.tick;
+            while (segment + 1 < map->count && map->entries[segment + 1].tick <= tick) segment++;
+
+            size_t bucket = tempo_entry_time_ns(&map->entries[segment], map->time_div, tick) / scan->resolution_ns;
+            if (bucket >= scan->bucket_count) bucket = scan->bucket_count - 1;
+
+            uint16_t* count = &sounding[status & 0x0F][(message >> 8) & 0x7F];
+            if (msg_type == 0x90 && ((message >> 16) & 0xFF) != 0) {
+                atomic_fetch_add_explicit(&scan->note_ons[bucket], 1, memory_order_relaxed);
+                if (*count < UINT16_MAX) {
+                    (*count)++;
+                    atomic_fetch_add_explicit(&scan->polyphony[bucket], 1, memory_order_relaxed);
+                }
+            } else if (*count > 0) {
+                (*count)--;
+                atomic_fetch_sub_explicit(&scan->polyphony[bucket], 1, memory_order_relaxed);
+            }
+        }
+
+        update_tick(&track);
     }
-    free(tracks);
-    dlclose(midi_lib);
 
-    return 0;
-}
\ No newline at end of file
+    return true;
+}
+
+// Everything the player needs to know before it starts: one counting pass per track (which also yields
+// the tempo map), then a bucketed pass for the peaks. The tracks themselves are left untouched.
+bool scan_midi_stats(const TrackData* tracks, const int track_count, const uint16_t time_div, const int thread_count, TempoMap* tempo_map, MidiFileStats* stats) {
+    const uint64_t start_time = monotonic_us();
+
+    memset(stats, 0, sizeof(MidiFileStats));
+    stats->tracks = calloc(track_count > 0 ? track_count : 1, sizeof(TrackStats));
+    if (!stats->tracks) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    stats->track_count = track_count;
+
+    size_t tempo_count = 0;
+    if (!scan_tracks(tracks, track_count, time_div, thread_count, tempo_map, stats->tracks, &tempo_count)) {
+        free_midi_stats(stats);
+        return false;
+    }
+
+    for (int i = 0; i < track_count; i++) {
+        const TrackStats* track = &stats->tracks[i];
+        stats->event_count += track->event_count;
+        stats->note_on_count += track->note_on_count;
+        stats->note_off_count += track->note_off_count;
+        if (track->largest_payload > stats->largest_payload) stats->largest_payload = track->largest_payload;
+        if (track->last_tick > stats->last_tick) stats->last_tick = track->last_tick;
+    }
+    stats->duration_ns = tempo_map_time_ns(tempo_map, stats->last_tick);
+
+    stats->resolution_ns = STATS_RESOLUTION_NS;
+    while (stats->duration_ns / stats->resolution_ns >= STATS_MAX_BUCKETS) stats->resolution_ns *= 2;
+
+    DensityScanContext scan = {
+        .tracks = tracks,
+        .tempo_map = tempo_map,
+        .resolution_ns = stats->resolution_ns,
+        .bucket_count = stats->duration_ns / stats->resolution_ns + 1,
+    };
+    scan.note_ons = calloc(scan.bucket_count, sizeof(*scan.note_ons));
+    scan.polyphony = calloc(scan.bucket_count, sizeof(*scan.polyphony));
+
+    bool ok = scan.note_ons && scan.polyphony;
+    if (!ok) {
+        fprintf(stderr, "Memory allocation failed\n");
+    } else {
+        ok = run_track_jobs(tracks, track_count, thread_count, scan_track_density, &scan) > 0;
+    }
+
+    if (ok) {
+        // Notes per second over a sliding one-second window of buckets
+        const size_t window = stats->resolution_ns < 1000000000ULL ? 1000000000ULL / stats->resolution_ns : 1;
+        int64_t polyphony = 0;
+        uint64_t nps = 0;
+        for (size_t i = 0; i < scan.bucket_count; i++) {
+            const uint32_t note_ons = atomic_load_explicit(&scan.note_ons[i], memory_order_relaxed);
+
+            // Order inside a bucket is lost, so assume every note starting in it overlaps
+            const int64_t peak = polyphony + note_ons;
+            if (peak > 0 && (uint64_t)peak > stats->peak_polyphony) stats->peak_polyphony = (uint64_t)peak;
+            polyphony += atomic_load_explicit(&scan.polyphony[i], memory_order_relaxed);
+
+            nps += note_ons;
+            if (i >= window) nps -= atomic_load_explicit(&scan.note_ons[i - window], memory_order_relaxed);
+            if (nps > stats->peak_nps) stats->peak_nps = nps;
+
+            // Note-offs that ended a sounding note are the note-ons less the change in polyphony
+            const int64_t burst = 2 * (int64_t)note_ons - atomic_load_explicit(&scan.polyphony[i], memory_order_relaxed);
+            if (burst > 0 && (uint64_t)burst > stats->peak_burst) stats->peak_burst = (uint64_t)burst;
+        }
+    }
+
+    free(scan.note_ons);
+    free(scan.polyphony);
+
+    if (!ok) {
+        free_tempo_map(tempo_map);
+        free_midi_stats(stats);
+        return false;
+    }
+
+    const uint64_t end_time = monotonic_us();
+    printf("Scanned %llu events, %llu notes and %zu tempo changes in %ldms (%ldμs).\n",
+        (unsigned long long)stats->event_count, (unsigned long long)stats->note_on_count, tempo_count,
+        (long)((end_time - start_time) / 1000), (long)(end_time - start_time));
+    printf("Duration %.3fs, peak polyphony %llu, peak %llu notes per second, %llu at once, largest payload %zu bytes.\n",
+        (double)stats->duration_ns / 1e9, (unsigned long long)stats->peak_polyphony,
+        (unsigned long long)stats->peak_nps, (unsigned long long)stats->peak_burst, stats->largest_payload);
+
+    return true;
+}
+
+void free_midi_stats(MidiFileStats* stats) {
+    free(stats->tracks);
+    stats->tracks = NULL;
+    stats->track_count = 0;
+}
+
+inline __attribute__((always_inline)) static uint64_t track_heap_key(const uint32_t tick, const int index) {
+    return (uint64_t)tick << 32 | (uint32_t)index;
+}
+
+inline __attribute__((always_inline)) static void track_heap_sift_down(TrackHeap* heap, int i) {
+    const uint64_t key = heap->keys[i];
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count && heap->keys[child + 1] < heap->keys[child]) child++;
+        if (heap->keys[child] >= key) break;
+        heap->keys[i] = heap->keys[child];
+        i = child;
+    }
+    heap->keys[i] = key;
+}
+
+inline __attribute__((always_inline)) static void track_heap_push(TrackHeap* heap, const uint64_t key) {
+    int i = heap->count++;
+    while (i > 0) {
+        const int parent = (i - 1) / 2;
+        if (heap->keys[parent] <= key) break;
+        heap->keys[i] = heap->keys[parent];
+        i = parent;
+    }
+    heap->keys[i] = key;
+}
+
+// Drop the root
+inline __attribute__((always_inline)) static void track_heap_pop(TrackHeap* heap) {
+    if (--heap->count > 0) {
+        heap->keys[0] = heap->keys[heap->count];
+        track_heap_sift_down(heap, 0);
+    }
+}
+
+// Swap the root for a new key; cheaper than a pop followed by a push
+inline __attribute__((always_inline)) static void track_heap_replace_top(TrackHeap* heap, const uint64_t key) {
+    heap->keys[0] = key;
+    track_heap_sift_down(heap, 0);
+}
+
+// K-way merge of all tracks into one time-ordered PackedTrack. Meta tables and payloads are
+// concatenated and event indices rebased, so the result plays like any other single track.
+bool merge_tracks(const PackedTrack* tracks, const int track_count, PackedTrack* merged) {
+    const uint64_t start_time = monotonic_us();
+    memset(merged, 0, sizeof(PackedTrack));
+
+    size_t event_count = 0, meta_count = 0, payload_size = 0;
+    for (int i = 0; i < track_count; i++) {
+        event_count += tracks[i].event_count;
+        meta_count += tracks[i].meta_count;
+        payload_size += tracks[i].payload_size;
+    }
+
+    if (meta_count > PACKED_META_INDEX_MAX + 1ULL) {
+        fprintf(stderr, "Too many meta events to merge\n");
+        return false;
+    }
+
+    merged->events = malloc((event_count > 0 ? event_count : 1) * sizeof(PackedEvent));
+    merged->metas = malloc((meta_count > 0 ? meta_count : 1) * sizeof(PackedMeta));
+    merged->payload = malloc(payload_size > 0 ? payload_size : 1);
+    size_t* cursors = calloc(track_count > 0 ? track_count : 1, sizeof(size_t));
+    uint32_t* meta_base = malloc((track_count > 0 ? track_count : 1) * sizeof(uint32_t));
+    TrackHeap heap = { malloc((track_count > 0 ? track_count : 1) * sizeof(uint64_t)), 0 };
+    if (!merged->events || !merged->metas || !merged->payload || !cursors || !meta_base || !heap.keys) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free_packed_track(merged);
+        free(cursors);
+        free(meta_base);
+        free(heap.keys);
+        return false;
+    }
+
+    for (int i = 0; i < track_count; i++) {
+        const PackedTrack* track = &tracks[i];
+        meta_base[i] = (uint32_t)merged->meta_count;
+
+        for (size_t m = 0; m < track->meta_count; m++) {
+            PackedMeta meta = track->metas[m];
+            meta.offset += (uint32_t)merged->payload_size;
+            merged->metas[merged->meta_count++] = meta;
+        }
+
+        memcpy(&merged->payload[merged->payload_size], track->payload, track->payload_size);
+        merged->payload_size += track->payload_size;
+
+        if (track->event_count > 0) {
+            track_heap_push(&heap, track_heap_key(track->events[0].tick, i));
+        }
+    }
+
+    while (heap.count > 0) {
+        const int i = (int)(heap.keys[0] & 0xFFFFFFFF);
+        const PackedTrack* track = &tracks[i];
+
+        PackedEvent event = track->events[cursors[i]++];
+        if ((event.message & 0xF0) == 0xF0) {
+            event.message = (event.message & 0xFF) | (meta_base[i] + (event.message >> 8)) << 8;
+        }
+        merged->events[merged->event_count++] = event;
+
+        if (cursors[i] < track->event_count) {
+            track_heap_replace_top(&heap, track_heap_key(track->events[cursors[i]].tick, i));
+        } else {
+            track_heap_pop(&heap);
+        }
+    }
+
+    free(cursors);
+    free(meta_base);
+    free(heap.keys);
+
+    const uint64_t end_time = monotonic_us();
+    const size_t bytes = merged->event_count * sizeof(PackedEvent) + merged->meta_count * sizeof(PackedMeta) + merged->payload_size;
+
+    printf("Merged %zu events from %d tracks in %ldms (%ldμs), %.1fMB.\n", merged->event_count, track_count,
+        (long)((end_time - start_time) / 1000), (long)(end_time - start_time), (double)bytes / (1024.0 * 1024.0));
+
+    return true;
+}
+
+inline __attribute__((always_inline)) static void sequencer_emit(Sequencer* seq, const uint32_t message) {
+    if (seq->message_count == seq->message_capacity) {
+        const size_t capacity = seq->message_capacity * 2;
+        uint32_t* new_messages = realloc(seq->messages, capacity * sizeof(uint32_t));
+        if (!new_messages) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        seq->messages = new_messages;
+        seq->message_capacity = capacity;
+    }
+    seq->messages[seq->message_count++] = message;
+}
+
+// Decode and handle every event of a streaming track that is due at the current tick
+inline __attribute__((always_inline)) static void sequencer_advance_track(Sequencer* seq, TrackData* track) {
+    while (track->data != NULL && (uint64_t)track->tick <= seq->tick) {
+        update_command(track);
+        update_message(track);
+
+        const uint32_t message = track->message;
+
+        if ((message & 0xF0) < 0xF0) {
+            sequencer_emit(seq, message);
+        } else if ((message & 0xFF) == 0xFF) {
+            process_meta_event(track);
+        }
+        // SysEx is dropped: sinks only take short messages
+
+        if (track->data != NULL) {
+            if (track->offset >= track->length) {
+                end_track(track);
+            } else {
+                update_tick(track);
+            }
+        }
+    }
+}
+
+// Same for a pre-decoded track; returns the new cursor
+inline __attribute__((always_inline)) static size_t sequencer_advance_packed(Sequencer* seq, const PackedTrack* track, size_t cursor) {
+    while (cursor < track->event_count && track->events[cursor].tick <= seq->tick) {
+        const uint32_t message = track->events[cursor].message;
+
+        // Meta events were applied at load time and SysEx is dropped, so only channel messages go out
+        const uint8_t status = message & 0xF0;
+        if (seq->notes_only ? status == 0x80 || status == 0x90 : status < 0xF0) {
+            sequencer_emit(seq, message);
+        }
+
+        cursor++;
+    }
+    return cursor;
+}
+
+// Scan every track on every step; cheapest when most tracks have an event on most ticks
+static void sequencer_step_tracks_linear(Sequencer* seq) {
+    uint64_t next_tick = UINT64_MAX;
+
+    for (int i = 0; i < seq->track_count; i++) {
+        TrackData* track = &seq->tracks[i];
+        if (track->data == NULL) continue;
+
+        sequencer_advance_track(seq, track);
+
+        if (track->data != NULL && (uint64_t)track->tick < next_tick) {
+            next_tick = track->tick;
+        }
+    }
+
+    seq->next_tick = next_tick;
+}
+
+// Only touch the tracks that are due; the root of the heap is always the next tick
+static void sequencer_step_tracks_heap(Sequencer* seq) {
+    TrackHeap* heap = &seq->heap;
+
+    while (heap->count > 0 && (heap->keys[0] >> 32) <= seq->tick) {
+        const int i = (int)(heap->keys[0] & 0xFFFFFFFF);
+        TrackData* track = &seq->tracks[i];
+
+        sequencer_advance_track(seq, track);
+
+        if (track->data != NULL) {
+            track_heap_replace_top(heap, track_heap_key((uint32_t)track->tick, i));
+        } else {
+            track_heap_pop(heap);
+        }
+    }
+
+    seq->next_tick = heap->count > 0 ? heap->keys[0] >> 32 : UINT64_MAX;
+}
+
+static void sequencer_step_packed_linear(Sequencer* seq) {
+    uint64_t next_tick = UINT64_MAX;
+
+    for (int i = 0; i < seq->track_count; i++) {
+        const PackedTrack* track = &seq->packed[i];
+        const size_t cursor = sequencer_advance_packed(seq, track, seq->cursors[i]);
+        seq->cursors[i] = cursor;
+
+        if (cursor < track->event_count && track->events[cursor].tick < next_tick) {
+            next_tick = track->events[cursor].tick;
+        }
+    }
+
+    seq->next_tick = next_tick;
+}
+
+static void sequencer_step_packed_heap(Sequencer* seq) {
+    TrackHeap* heap = &seq->heap;
+
+    while (heap->count > 0 && (heap->keys[0] >> 32) <= seq->tick) {
+        const int i = (int)(heap->keys[0] & 0xFFFFFFFF);
+        const PackedTrack* track = &seq->packed[i];
+        const size_t cursor = sequencer_advance_packed(seq, track, seq->cursors[i]);
+        seq->cursors[i] = cursor;
+
+        if (cursor < track->event_count) {
+            track_heap_replace_top(heap, track_heap_key(track->events[cursor].tick, i));
+        } else {
+            track_heap_pop(heap);
+        }
+    }
+
+    seq->next_tick = heap->count > 0 ? heap->keys[0] >> 32 : UINT64_MAX;
+}
+
+static bool sequencer_init(Sequencer* seq, const int track_count, const TempoMap* tempo_map, const MidiScheduler scheduler) {
+    memset(seq, 0, sizeof(Sequencer));
+    seq->scheduler = scheduler;
+    seq->track_count = track_count;
+    seq->tempo_map = tempo_map;
+    seq->message_capacity = 1024;
+    seq->messages = malloc(seq->message_capacity * sizeof(uint32_t));
+    seq->heap.keys = malloc((track_count > 0 ? track_count : 1) * sizeof(uint64_t));
+    if (!seq->messages || !seq->heap.keys) {
+        fprintf(stderr, "Memory allocation failed\n");
+        sequencer_free(seq);
+        return false;
+    }
+    return true;
+}
+
+bool sequencer_init_tracks(Sequencer* seq, TrackData* tracks, const int track_count, const TempoMap* tempo_map, const MidiScheduler scheduler) {
+    if (!sequencer_init(seq, track_count, tempo_map, scheduler)) return false;
+    seq->tracks = tracks;
+
+    for (int i = 0; i < track_count; i++) {
+        if (tracks[i].data != NULL) {
+            track_heap_push(&seq->heap, track_heap_key((uint32_t)tracks[i].tick, i));
+        }
+    }
+    return true;
+}
+
+bool sequencer_init_packed(Sequencer* seq, const PackedTrack* tracks, const int track_count, const TempoMap* tempo_map, const MidiScheduler scheduler) {
+    if (!sequencer_init(seq, track_count, tempo_map, scheduler)) return false;
+    seq->packed = tracks;
+    seq->cursors = calloc(track_count > 0 ? track_count : 1, sizeof(size_t));
+    if (!seq->cursors) {
+        fprintf(stderr, "Memory allocation failed\n");
+        sequencer_free(seq);
+        return false;
+    }
+
+    for (int i = 0; i < track_count; i++) {
+        if (tracks[i].event_count > 0) {
+            track_heap_push(&seq->heap, track_heap_key(tracks[i].events[0].tick, i));
+        }
+    }
+    return true;
+}
+
+void sequencer_free(Sequencer* seq) {
+    free(seq->messages);
+    free(seq->cursors);
+    free(seq->heap.keys);
+    seq->messages = NULL;
+    seq->cursors = NULL;
+    seq->heap.keys = NULL;
+}
+
+// Collect the channel messages due at the next tick into seq->messages and stamp them with
+// their absolute playback time from the tempo map
+void sequencer_step(Sequencer* seq) {
+    seq->tick = seq->next_tick;
+    seq->message_count = 0;
+
+    // Ticks only move forward, so the tempo segment is found by walking instead of searching
+    const TempoMap* map = seq->tempo_map;
+    while (seq->tempo_index + 1 < map->count && map->entries[seq->tempo_index + 1].tick <= seq->tick) {
+        seq->tempo_index++;
+    }
+    seq->time_ns = tempo_entry_time_ns(&map->entries[seq->tempo_index], map->time_div, seq->tick);
+
+    if (seq->packed) {
+        if (seq->scheduler == MIDI_SCHEDULER_HEAP) {
+            sequencer_step_packed_heap(seq);
+        } else {
+            sequencer_step_packed_linear(seq);
+        }
+    } else {
+        if (seq->scheduler == MIDI_SCHEDULER_HEAP) {
+            sequencer_step_tracks_heap(seq);
+        } else {
+            sequencer_step_tracks_linear(seq);
+        }
+    }
+
+    seq->done = seq->next_tick == UINT64_MAX;
+    seq->delta_tick = seq->done ? 0 : seq->next_tick - seq->tick;
+}
+
+// Track what a channel message does to the state a synth would be in at this point
+inline __attribute__((always_inline)) static void channel_state_apply(ChannelState* channels, const uint32_t message) {
+    ChannelState* channel = &channels[message & 0x0F];
+    const uint8_t data1 = (message >> 8) & 0x7F;
+    const uint8_t data2 = (message >> 16) & 0x7F;
+
+    switch (message & 0xF0) {
+        case 0x80:
+            channel->notes[data1] = 0;
+            break;
+        case 0x90:
+            channel->notes[data1] = data2;
+            break;
+        case 0xB0:
+            channel->controllers[data1] = data2;
+            channel->controller_set[data1 >> 5] |= 1u << (data1 & 31);
+            break;
+        case 0xC0:
+            channel->program = data1;
+            channel->flags |= CHANNEL_PROGRAM_SET;
+            break;
+        case 0xE0:
+            channel->pitch_bend = data1 | (uint16_t)data2 << 7;
+            channel->flags |= CHANNEL_PITCH_SET;
+            break;
+        default:
+            break;
+    }
+}
+
+// Messages that bring a synth into the given state; messages needs room for CHANNEL_STATE_MAX_MESSAGES
+size_t channel_state_messages(const ChannelState* channels, uint32_t* messages) {
+    size_t count = 0;
+
+    for (uint32_t c = 0; c < MIDI_CHANNELS; c++) {
+        const ChannelState* channel = &channels[c];
+
+        if (channel->flags & CHANNEL_PROGRAM_SET) {
+            messages[count++] = 0xC0 | c | (uint32_t)channel->program << 8;
+        }
+        for (uint32_t cc = 0; cc < 128; cc++) {
+            if (channel->controller_set[cc >> 5] & (1u << (cc & 31))) {
+                messages[count++] = 0xB0 | c | cc << 8 | (uint32_t)channel->controllers[cc] << 16;
+            }
+        }
+        if (channel->flags & CHANNEL_PITCH_SET) {
+            messages[count++] = 0xE0 | c | (uint32_t)(channel->pitch_bend & 0x7F) << 8 | (uint32_t)(channel->pitch_bend >> 7) << 16;
+        }
+        for (uint32_t note = 0; note < 128; note++) {
+            if (channel->notes[note]) {
+                messages[count++] = 0x90 | c | note << 8 | (uint32_t)channel->notes[note] << 16;
+            }
+        }
+    }
+
+    return count;
+}
+
+static size_t seek_snapshot_bytes(const int track_count) {
+    return sizeof(SeekPoint) + track_count * sizeof(TrackPosition) + MIDI_CHANNELS * sizeof(ChannelState);
+}
+
+static void seek_index_capture(SeekIndex* index, const Sequencer* seq, const ChannelState* channels) {
+    const size_t n = index->count++;
+    TrackPosition* positions = &index->positions[n * index->track_count];
+
+    index->points[n].tick = seq->next_tick;
+    index->points[n].time_ns = tempo_map_time_ns(seq->tempo_map, seq->next_tick);
+
+    for (int i = 0; i < index->track_count; i++) {
+        if (seq->packed) {
+            positions[i].offset = seq->cursors[i];
+            positions[i].tick = 0;
+            positions[i].message = 0;
+        } else {
+            const TrackData* track = &seq->tracks[i];
+            positions[i].offset = track->data ? track->offset : TRACK_POSITION_ENDED;
+            positions[i].tick = (uint32_t)track->tick;
+            positions[i].message = track->message;
+        }
+    }
+
+    memcpy(&index->channels[n * MIDI_CHANNELS], channels, MIDI_CHANNELS * sizeof(ChannelState));
+}
+
+// Out of budget: keep every other snapshot and space the rest twice as far apart
+static void seek_index_decimate(SeekIndex* index) {
+    const size_t track_count = index->track_count;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < index->count; i += 2, kept++) {
+        index->points[kept] = index->points[i];
+        memmove(&index->positions[kept * track_count], &index->positions[i * track_count], track_count * sizeof(TrackPosition));
+        memmove(&index->channels[kept * MIDI_CHANNELS], &index->channels[i * MIDI_CHANNELS], MIDI_CHANNELS * sizeof(ChannelState));
+    }
+
+    index->count = kept;
+    index->interval_ns *= 2;
+}
+
+// Walk the whole song once on a private copy of seq and record a snapshot every interval.
+// Has to run before seq starts playing. Streaming tracks that own their buffers hand them over
+// to the index, so reaching end-of-track no longer frees data a later seek may need.
+bool build_seek_index(Sequencer* seq, const uint32_t interval_ms, const size_t max_bytes, SeekIndex* index) {
+    const uint64_t start_time = monotonic_us();
+    const int track_count = seq->track_count;
+
+    memset(index, 0, sizeof(SeekIndex));
+    index->track_count = track_count;
+    index->interval_ns = (uint64_t)(interval_ms > 0 ? interval_ms : 1) * 1000000ULL;
+
+    const size_t snapshot_bytes = seek_snapshot_bytes(track_count);
+    index->capacity = max_bytes / snapshot_bytes;
+    if (index->capacity < 2) index->capacity = 2;
+
+    index->points = malloc(index->capacity * sizeof(SeekPoint));
+    index->positions = malloc(index->capacity * track_count * sizeof(TrackPosition) + 1);
+    index->channels = malloc(index->capacity * MIDI_CHANNELS * sizeof(ChannelState));
+    ChannelState* channels = calloc(MIDI_CHANNELS, sizeof(ChannelState));
+    TrackData* clones = NULL;
+
+    if (!index->points || !index->positions || !index->channels || !channels) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(channels);
+        free_seek_index(index);
+        return false;
+    }
+
+    if (!seq->packed) {
+        index->track_data = malloc((track_count > 0 ? track_count : 1) * sizeof(uint8_t*));
+        index->track_length = malloc((track_count > 0 ? track_count : 1) * sizeof(size_t));
+        index->owned = malloc((track_count > 0 ? track_count : 1) * sizeof(uint8_t*));
+        clones = malloc((track_count > 0 ? track_count : 1) * sizeof(TrackData));
+        if (!index->track_data || !index->track_length || !index->owned || !clones) {
+            fprintf(stderr, "Memory allocation failed\n");
+            free(channels);
+            free(clones);
+            free_seek_index(index);
+            return false;
+        }
+
+        for (int i = 0; i < track_count; i++) {
+            TrackData* track = &seq->tracks[i];
+            if (track->owns_data) {
+                if (track->data) index->owned[index->owned_count++] = track->data;
+                free(track->long_msg);
+                track->long_msg = NULL;
+                track->long_msg_capacity = 0;
+                track->owns_data = false;
+            }
+            index->track_data[i] = track->data;
+            index->track_length[i] = track->length;
+            clones[i] = *track;
+        }
+    }
+
+    Sequencer scan;
+    const bool ok = seq->packed
+        ? sequencer_init_packed(&scan, seq->packed, track_count, seq->tempo_map, MIDI_SCHEDULER_HEAP)
+        : sequencer_init_tracks(&scan, clones, track_count, seq->tempo_map, MIDI_SCHEDULER_HEAP);
+    if (!ok) {
+        free(channels);
+        free(clones);
+        free_seek_index(index);
+        return false;
+    }
+
+    uint64_t next_snapshot = 0;
+    while (!scan.done) {
+        // A snapshot holds everything before the next step, so resuming from it replays nothing twice
+        if (tempo_map_time_ns(scan.tempo_map, scan.next_tick) >= next_snapshot) {
+            if (index->count == index->capacity) seek_index_decimate(index);
+            if (index->count == 0 || tempo_map_time_ns(scan.tempo_map, scan.next_tick) >= index->points[index->count - 1].time_ns + index->interval_ns) {
+                seek_index_capture(index, &scan, channels);
+            }
+            next_snapshot = index->points[index->count - 1].time_ns + index->interval_ns;
+        }
+
+        sequencer_step(&scan);
+        for (size_t i = 0; i < scan.message_count; i++) {
+            channel_state_apply(channels, scan.messages[i]);
+        }
+    }
+
+    sequencer_free(&scan);
+    free(channels);
+    free(clones);
+
+    const uint64_t end_time = monotonic_us();
+    printf("Built seek index: %zu snapshots every %lums, %.1fMB in %ldms.\n", index->count,
+        (unsigned long)(index->interval_ns / 1000000), (double)(index->count * snapshot_bytes) / (1024.0 * 1024.0),
+        (long)((end_time - start_time) / 1000));
+
+    return true;
+}
+
+void free_seek_index(SeekIndex* index) {
+    for (size_t i = 0; i < index->owned_count; i++) {
+        free(index->owned[i]);
+    }
+    free(index->owned);
+    free(index->track_data);
+    free(index->track_length);
+    free(index->points);
+    free(index->positions);
+    free(index->channels);
+    memset(index, 0, sizeof(SeekIndex));
+}
+
+// Move seq to time_ns: restore the closest earlier snapshot, then replay silently up to the target.
+// channels receives the synth state at that point; see channel_state_messages.
+bool sequencer_seek(Sequencer* seq, const SeekIndex* index, const uint64_t time_ns, ChannelState* channels) {
+    if (index->count == 0 || index->track_count != seq->track_count) return false;
+
+    size_t lo = 0, hi = index->count;
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (index->points[mid].time_ns <= time_ns) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const TrackPosition* positions = &index->positions[lo * index->track_count];
+    seq->heap.count = 0;
+
+    for (int i = 0; i < seq->track_count; i++) {
+        if (seq->packed) {
+            seq->cursors[i] = positions[i].offset;
+            if (positions[i].offset < seq->packed[i].event_count) {
+                track_heap_push(&seq->heap, track_heap_key(seq->packed[i].events[positions[i].offset].tick, i));
+            }
+        } else {
+            TrackData* track = &seq->tracks[i];
+            if (positions[i].offset == TRACK_POSITION_ENDED || !index->track_data[i]) {
+                track->data = NULL;
+                track->length = 0;
+                continue;
+            }
+            track->data = index->track_data[i];
+            track->length = index->track_length[i];
+            track->offset = positions[i].offset;
+            track->tick = (int)positions[i].tick;
+            track->message = positions[i].message;
+            track_heap_push(&seq->heap, track_heap_key(positions[i].tick, i));
+        }
+    }
+
+    memcpy(channels, &index->channels[lo * MIDI_CHANNELS], MIDI_CHANNELS * sizeof(ChannelState));
+
+    seq->next_tick = index->points[lo].tick;
+    seq->tempo_index = tempo_map_find(seq->tempo_map, seq->next_tick);
+    seq->done = false;
+
+    // Short replay from the snapshot; nothing is sent, only the channel state is kept up to date
+    while (!seq->done && tempo_map_time_ns(seq->tempo_map, seq->next_tick) < time_ns) {
+        sequencer_step(seq);
+        for (size_t i = 0; i < seq->message_count; i++) {
+            channel_state_apply(channels, seq->messages[i]);
+        }
+    }
+
+    // Past the end the song is over where its last event was: one more step there yields nothing and ends it,
+    // and deadlines, counted from the origin, don't wrap
+    seq->origin_ns = time_ns;
+    if (seq->done) {
+        seq->next_tick = seq->tick;
+        seq->done = false;
+        seq->origin_ns = seq->time_ns;
+    }
+    return true;
+}
+
+inline __attribute__((always_inline)) static void play_midi_loop(
+    Sequencer* seq,
+    MidiSink* sink,
+    MidiTimer* timer,
+    MidiLimiter* limiter,
+    MidiMetrics* metrics,
+    const NoteCallbacks* callbacks,
+    const NoteCallbackMode mode
+) {
+    MidiThreadMetrics* dispatch = &metrics->threads[MIDI_METRICS_DISPATCH];
+    const uint64_t start_time = midi_timer_now_ns();
+    midi_metrics_start(metrics, start_time, seq->origin_ns);
+
+    // Stage times come from the clock reads the timer and the lag already make
+    uint64_t mark = start_time;
+    while (true) {
+        sequencer_step(seq);
+
+        // Sleep to the absolute deadline, so a late step doesn't push every later one back
+        const uint64_t deadline = start_time + (seq->time_ns - seq->origin_ns);
+        const uint64_t lateness = midi_timer_wait_until(timer, deadline);
+        if (midi_timer_cancelled(timer)) break;
+        midi_metrics_lateness(dispatch, lateness);
+        midi_metrics_add(&dispatch->schedule_ns, timer->entered_ns - mark);
+        mark = deadline + lateness;
+
+        // The batch is filtered in place; the sequencer refills it on the next step
+        const size_t count = filter_channel_messages(seq->messages, seq->message_count, seq->messages,
+            limiter, seq->time_ns - seq->origin_ns, callbacks, mode, dispatch);
+        submit_midi_sink(sink, seq->messages, count);
+        if (seq->message_count > 0) {
+            const uint64_t sent = midi_timer_now_ns();
+            midi_metrics_lag(dispatch, sent - deadline);
+            midi_metrics_add(&dispatch->dispatch_ns, sent - mark);
+            mark = sent;
+        }
+
+        if (seq->done) break;
+    }
+
+    midi_metrics_stop(metrics);
+}
+
+void play_midi(Sequencer* seq, MidiSink* sink, MidiTimer* timer, MidiLimiter* limiter, MidiMetrics* metrics, const NoteCallbacks* callbacks) {
+    switch (callbacks->mode) {
+        case NOTE_CALLBACKS_NONE:
+            play_midi_loop(seq, sink, timer, limiter, metrics, callbacks, NOTE_CALLBACKS_NONE);
+            break;
+        case NOTE_CALLBACKS_PER_NOTE:
+            play_midi_loop(seq, sink, timer, limiter, metrics, callbacks, NOTE_CALLBACKS_PER_NOTE);
+            break;
+        case NOTE_CALLBACKS_BATCH:
+            play_midi_loop(seq, sink, timer, limiter, metrics, callbacks, NOTE_CALLBACKS_BATCH);
+            break;
+    }
+}
+
+// Offline: no deadlines, every step goes out as soon as it is decoded. Time is split between the sequencer
+// and the dispatch at every step. Stops early, returning false, once the run takes longer than budget_ns.
+inline __attribute__((always_inline)) static bool play_midi_offline_loop(
+    Sequencer* seq,
+    MidiSink* sink,
+    MidiLimiter* limiter,
+    MidiMetrics* metrics,
+    const NoteCallbacks* callbacks,
+    const NoteCallbackMode mode,
+    const uint64_t budget_ns,
+    MidiOfflineReport* report
+) {
+    MidiThreadMetrics* dispatch = &metrics->threads[MIDI_METRICS_DISPATCH];
+    const uint64_t start_time = midi_timer_now_ns();
+    midi_metrics_start(metrics, start_time, seq->origin_ns);
+
+    uint64_t now = start_time;
+    bool finished = true;
+    while (true) {
+        sequencer_step(seq);
+        const uint64_t stepped = midi_timer_now_ns();
+        report->schedule_ns += stepped - now;
+        report->events += seq->message_count;
+        midi_metrics_add(&dispatch->schedule_ns, stepped - now);
+
+        const size_t count = filter_channel_messages(seq->messages, seq->message_count, seq->messages,
+            limiter, seq->time_ns - seq->origin_ns, callbacks, mode, dispatch);
+        submit_midi_sink(sink, seq->messages, count);
+        now = midi_timer_now_ns();
+        report->dispatch_ns += now - stepped;
+        midi_metrics_add(&dispatch->dispatch_ns, now - stepped);
+
+        if (seq->done) break;
+        if (budget_ns && now - start_time > budget_ns) {
+            finished = false;
+            break;
+        }
+    }
+
+    midi_metrics_stop(metrics);
+    report->play_ns = now - start_time;
+    report->song_ns = seq->time_ns - seq->origin_ns;
+    return finished;
+}
+
+bool play_midi_offline(Sequencer* seq, MidiSink* sink, MidiLimiter* limiter, MidiMetrics* metrics, const NoteCallbacks* callbacks,
+    const uint64_t budget_ns, MidiOfflineReport* report) {
+    switch (callbacks->mode) {
+        case NOTE_CALLBACKS_NONE:
+            return play_midi_offline_loop(seq, sink, limiter, metrics, callbacks, NOTE_CALLBACKS_NONE, budget_ns, report);
+        case NOTE_CALLBACKS_PER_NOTE:
+            return play_midi_offline_loop(seq, sink, limiter, metrics, callbacks, NOTE_CALLBACKS_PER_NOTE, budget_ns, report);
+        case NOTE_CALLBACKS_BATCH:
+            return play_midi_offline_loop(seq, sink, limiter, metrics, callbacks, NOTE_CALLBACKS_BATCH, budget_ns, report);
+    }
+    return false;
+}
+
+// Event with its playback time already resolved through the tempo map
+typedef struct {
+    uint64_t time;      // Nanoseconds since playback start
+    uint32_t message;
+} TimedEvent;
+
+// Bounded single-producer/single-consumer buffer between the lookahead producer and the dispatcher
+typedef struct {
+    TimedEvent* events;
+    size_t mask;
+    _Alignas(64) atomic_size_t head;    // Written by the producer
+    _Alignas(64) atomic_size_t tail;    // Written by the dispatcher
+    _Alignas(64) atomic_bool primed;    // Producer has filled the window (or the buffer, or the song)
+    atomic_bool producer_done;
+    atomic_bool started;
+    atomic_bool cancelled;              // The dispatcher stopped early; the producer quits too
+    uint64_t start_time;                // Playback start on the monotonic clock, valid once started
+    uint64_t window;                    // How far ahead of real time the producer may run (ns)
+    Sequencer* seq;
+    MidiThreadPolicy producer_policy;
+    MidiThreadMetrics* producer_metrics;
+} LookaheadBuffer;
+
+#define LOOKAHEAD_IDLE_SLEEP 1000000    // 1ms, while the buffer is full or the window is used up
+#define LOOKAHEAD_UNDERRUN_SLEEP 100000 // 100μs, while the dispatcher waits on a late producer
+#define LOOKAHEAD_BATCH 256             // Most messages the dispatcher hands to the sink at once
+
+// Block until the dispatcher is less than one window behind event_time; false once playback was cancelled
+inline __attribute__((always_inline)) static bool lookahead_wait_window(LookaheadBuffer* buffer, const uint64_t event_time) {
+    while (true) {
+        if (!atomic_load_explicit(&buffer->started, memory_order_acquire)) {
+            if (event_time <= buffer->window) return true;
+        } else {
+            const uint64_t now = midi_timer_now_ns() - buffer->start_time;
+            if (event_time <= now + buffer->window) return true;
+        }
+        atomic_store_explicit(&buffer->primed, true, memory_order_release);
+        if (atomic_load_explicit(&buffer->cancelled, memory_order_acquire)) return false;
+        midi_timer_sleep_ns(LOOKAHEAD_IDLE_SLEEP);
+    }
+}
+
+static void* lookahead_producer(void* arg) {
+    LookaheadBuffer* buffer = (LookaheadBuffer*)arg;
+    Sequencer* seq = buffer->seq;
+
+    // The thread ends with playback, so its scheduling is never restored
+    if (buffer->producer_policy.priority > 0 || buffer->producer_policy.cpu >= 0) {
+        MidiThreadState state;
+        midi_thread_apply(&buffer->producer_policy, "lookahead", &state);
+    }
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    bool cancelled = false;
+
+    while (!cancelled) {
+        // The producer runs ahead of its deadlines, so it can afford the clock reads
+        const uint64_t stepping = midi_timer_now_ns();
+        sequencer_step(seq);
+        midi_metrics_add(&buffer->producer_metrics->schedule_ns, midi_timer_now_ns() - stepping);
+
+        const uint64_t event_time = seq->time_ns - seq->origin_ns;
+        if (seq->message_count > 0 && !lookahead_wait_window(buffer, event_time)) break;
+
+        for (size_t i = 0; i < seq->message_count && !cancelled; i++) {
+            while (head - atomic_load_explicit(&buffer->tail, memory_order_acquire) > buffer->mask) {
+                atomic_store_explicit(&buffer->head, head, memory_order_release);
+                atomic_store_explicit(&buffer->primed, true, memory_order_release);
+                cancelled = atomic_load_explicit(&buffer->cancelled, memory_order_acquire);
+                if (cancelled) break;
+                midi_timer_sleep_ns(LOOKAHEAD_IDLE_SLEEP);
+            }
+            if (cancelled) break;
+            buffer->events[head & buffer->mask].time = event_time;
+            buffer->events[head & buffer->mask].message = seq->messages[i];
+            head++;
+        }
+        atomic_store_explicit(&buffer->head, head, memory_order_release);
+        midi_metrics_add(&buffer->producer_metrics->events, seq->message_count);
+
+        if (seq->done) break;
+    }
+
+    atomic_store_explicit(&buffer->producer_done, true, memory_order_release);
+    atomic_store_explicit(&buffer->primed, true, memory_order_release);
+    return NULL;
+}
+
+// Dispatcher side of the lookahead buffer; sleeps to each deadline and sends whatever is due
+inline __attribute__((always_inline)) static void lookahead_dispatch(
+    LookaheadBuffer* buffer,
+    MidiSink* sink,
+    MidiTimer* timer,
+    MidiLimiter* limiter,
+    MidiMetrics* metrics,
+    const NoteCallbacks* callbacks,
+    const NoteCallbackMode mode
+) {
+    MidiThreadMetrics* dispatch = &metrics->threads[MIDI_METRICS_DISPATCH];
+    const TimedEvent* events = buffer->events;
+    uint32_t batch[LOOKAHEAD_BATCH];
+
+    size_t tail = 0;
+    bool dry = false;
+    while (true) {
+        const size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        atomic_store_explicit(&metrics->buffer_fill, head - tail, memory_order_relaxed);
+        midi_metrics_max(&metrics->buffer_peak, head - tail);
+
+        if (tail == head) {
+            if (atomic_load_explicit(&buffer->producer_done, memory_order_acquire) &&
+                tail == atomic_load_explicit(&buffer->head, memory_order_acquire)) {
+                break;
+            }
+            // Either a rest, with the producer waiting for its window, or the producer fell behind real time
+            if (midi_timer_cancelled(timer)) break;
+            dry = true;
+            midi_timer_sleep_ns(LOOKAHEAD_UNDERRUN_SLEEP);
+            continue;
+        }
+
+        const uint64_t time = events[tail & buffer->mask].time;
+        const uint64_t deadline = buffer->start_time + time;
+
+        // Running dry only hurt if what finally came was already due
+        if (dry) {
+            if (midi_timer_now_ns() > deadline) midi_metrics_add(&metrics->underruns, 1);
+            dry = false;
+        }
+        const uint64_t lateness = midi_timer_wait_until(timer, deadline);
+        if (midi_timer_cancelled(timer)) break;
+        midi_metrics_lateness(dispatch, lateness);
+
+        // Everything stamped with the same time goes out without another clock read, in as few submits as fit
+        while (tail != head && events[tail & buffer->mask].time == time) {
+            size_t count = 0;
+            while (tail != head && count < LOOKAHEAD_BATCH && events[tail & buffer->mask].time == time) {
+                batch[count++] = events[tail & buffer->mask].message;
+                tail++;
+            }
+            count = filter_channel_messages(batch, count, batch, limiter, time, callbacks, mode, dispatch);
+            submit_midi_sink(sink, batch, count);
+        }
+        atomic_store_explicit(&buffer->tail, tail, memory_order_release);
+        const uint64_t sent = midi_timer_now_ns();
+        midi_metrics_lag(dispatch, sent - deadline);
+        midi_metrics_add(&dispatch->dispatch_ns, sent - (deadline + lateness));
+    }
+}
+
+// Parse ahead of real time on a producer thread; this thread only sleeps to each deadline and sends
+void play_midi_lookahead(
+    Sequencer* seq,
+    const uint32_t lookahead_ms,
+    const size_t capacity,
+    MidiSink* sink,
+    MidiTimer* timer,
+    MidiLimiter* limiter,
+    const MidiThreadPolicy* producer_policy,
+    const bool lock_memory,
+    MidiMetrics* metrics,
+    const NoteCallbacks* callbacks
+) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+
+    LookaheadBuffer* buffer = aligned_alloc(64, sizeof(LookaheadBuffer));
+    TimedEvent* events = malloc(size * sizeof(TimedEvent));
+    if (!buffer || !events) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(buffer);
+        free(events);
+        return;
+    }
+
+    // Allocated after the song was locked, so it is faulted in and pinned separately
+    if (lock_memory) {
+        memset(events, 0, size * sizeof(TimedEvent));
+        midi_lock_region(events, size * sizeof(TimedEvent));
+    }
+
+    buffer->events = events;
+    buffer->mask = size - 1;
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
+    atomic_init(&buffer->primed, false);
+    atomic_init(&buffer->producer_done, false);
+    atomic_init(&buffer->started, false);
+    atomic_init(&buffer->cancelled, false);
+    buffer->start_time = 0;
+    buffer->window = (uint64_t)lookahead_ms * 1000000ULL;
+    buffer->seq = seq;
+    buffer->producer_policy = *producer_policy;
+    buffer->producer_metrics = &metrics->threads[MIDI_METRICS_PRODUCER];
+    atomic_store_explicit(&metrics->buffer_capacity, size, memory_order_relaxed);
+
+    pthread_t producer_thread;
+    if (pthread_create(&producer_thread, NULL, lookahead_producer, buffer) != 0) {
+        fprintf(stderr, "Could not start lookahead thread\n");
+        free(events);
+        free(buffer);
+        return;
+    }
+
+    // Let the producer fill its window before the clock starts
+    const uint64_t prime_start = midi_timer_now_ns();
+    while (!atomic_load_explicit(&buffer->primed, memory_order_acquire)) {
+        midi_timer_sleep_ns(LOOKAHEAD_UNDERRUN_SLEEP);
+    }
+    printf("Lookahead primed %zu events in %ldms.\n", atomic_load(&buffer->head),
+        (long)((midi_timer_now_ns() - prime_start) / 1000000));
+
+    buffer->start_time = midi_timer_now_ns();
+    atomic_store_explicit(&buffer->started, true, memory_order_release);
+    midi_metrics_start(metrics, buffer->start_time, seq->origin_ns);
+
+    switch (callbacks->mode) {
+        case NOTE_CALLBACKS_NONE:
+            lookahead_dispatch(buffer, sink, timer, limiter, metrics, callbacks, NOTE_CALLBACKS_NONE);
+            break;
+        case NOTE_CALLBACKS_PER_NOTE:
+            lookahead_dispatch(buffer, sink, timer, limiter, metrics, callbacks, NOTE_CALLBACKS_PER_NOTE);
+            break;
+        case NOTE_CALLBACKS_BATCH:
+            lookahead_dispatch(buffer, sink, timer, limiter, metrics, callbacks, NOTE_CALLBACKS_BATCH);
+            break;
+    }
+
+    if (midi_timer_cancelled(timer)) atomic_store_explicit(&buffer->cancelled, true, memory_order_release);
+    pthread_join(producer_thread, NULL);
+    midi_metrics_stop(metrics);
+
+    const uint64_t underruns = atomic_load_explicit(&metrics->underruns, memory_order_relaxed);
+    if (underruns > 0) {
+        printf("Lookahead buffer ran dry %lu times.\n", (unsigned long)underruns);
+    }
+
+    free(events);
+    free(buffer);
+}
+
+TrackData* load_midi_file(const char* filename, uint16_t* time_div, int* track_count) {
+    TrackData* tracks = NULL;
+    FILE* file = fopen(filename, "rb");
+
+    if (!file) {
+        fprintf(stderr, "Could not open file\n");
+        return NULL;
+    }
+
+    clock_t start_time = clock();
+
+    char header[4];
+    fread(header, 1, 4, file);
+    if (strncmp(header, "MThd", 4) != 0) {
+        fprintf(stderr, "Not a MIDI file\n");
+        fclose(file);
+        return NULL;
+    }
+
+    uint32_t header_length;
+    fread(&header_length, 4, 1, file);
+    header_length = fntohl(header_length);
+    if (header_length != 6) {
+        fprintf(stderr, "Invalid header length\n");
+        fclose(file);
+        return NULL;
+    }
+
+    uint16_t format;
+    fread(&format, 2, 1, file);
+    format = fntohs(format);
+
+    uint16_t num_tracks;
+    fread(&num_tracks, 2, 1, file);
+    num_tracks = fntohs(num_tracks);
+
+    fread(time_div, 2, 1, file);
+    *time_div = fntohs(*time_div);
+
+    if (*time_div >= 0x8000) {
+        fprintf(stderr, "SMPTE timing not supported\n");
+        fclose(file);
+        return NULL;
+    }
+    if (*time_div == 0) {
+        fprintf(stderr, "Invalid time division\n");
+        fclose(file);
+        return NULL;
+    }
+
+    printf("%d tracks\n", num_tracks);
+
+    tracks = malloc(num_tracks * sizeof(TrackData));
+    if (!tracks) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(file);
+        return NULL;
+    }
+
+    // Initialize tracks
+    for (int i = 0; i < num_tracks; i++) {
+        init_track_data(&tracks[i]);
+    }
+
+    int valid_tracks = 0;
+    for (int i = 0; i < num_tracks; ++i) {
+        fread(header, 1, 4, file);
+        if (strncmp(header, "MTrk", 4) != 0) {
+            continue;
+        }
+
+        uint32_t length;
+        fread(&length, 4, 1, file);
+        length = fntohl(length);
+
+        // Allocate memory for track data
+        tracks[valid_tracks].data = malloc(length);
+        if (!tracks[valid_tracks].data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            for (int j = 0; j < valid_tracks; j++) {
+                free_track_data(&tracks[j]);
+            }
+            free(tracks);
+            fclose(file);
+            return NULL;
+        }
+
+        // Allocate initial long message buffer
+        tracks[valid_tracks].long_msg = malloc(256);
+        if (!tracks[valid_tracks].long_msg) {
+            fprintf(stderr, "Memory allocation failed\n");
+            free(tracks[valid_tracks].data);
+            for (int j = 0; j < valid_tracks; j++) {
+                free_track_data(&tracks[j]);
+            }
+            free(tracks);
+            fclose(file);
+            return NULL;
+        }
+
+        tracks[valid_tracks].long_msg_capacity = 256;
+        tracks[valid_tracks].length = length;
+        tracks[valid_tracks].data_capacity = length;
+        tracks[valid_tracks].tick = 0;
+        tracks[valid_tracks].offset = 0;
+        tracks[valid_tracks].message = 0;
+        tracks[valid_tracks].temp = 0;
+
+        fread(tracks[valid_tracks].data, 1, length, file);
+        update_tick(&tracks[valid_tracks]);
+        valid_tracks++;
+    }
+
+    *track_count = valid_tracks;
+
+    const clock_t end_time = clock();
+    const double duration_seconds = (double)(end_time - start_time) / CLOCKS_PER_SEC;
+    const long duration_microseconds = (long)(duration_seconds * 1000000);
+    const long duration_milliseconds = (long)(duration_seconds * 1000);
+
+    printf("Parsed in %ldms (%ldμs).\n", duration_milliseconds, duration_microseconds);
+
+    fclose(file);
+    return tracks;
+}
+
+static inline uint32_t read_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint16_t read_be16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// Same as load_midi_file, but every track points straight into a read-only mapping of the
+// file. Nothing is copied, so pages are only faulted in once playback actually reaches them.
+TrackData* load_midi_file_mapped(const char* filename, uint16_t* time_div, int* track_count, MidiMapping* mapping) {
+    mapping->base = NULL;
+    mapping->size = 0;
+
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file\n");
+        return NULL;
+    }
+
+    clock_t start_time = clock();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 14) {
+        fprintf(stderr, "Not a MIDI file\n");
+        close(fd);
+        return NULL;
+    }
+
+    // The decoder reads an event's data bytes without looking at the track end, like it does on the heap, so
+    // the file goes on top of zeroed pages that run at least a page past it; reading past a file-backed
+    // mapping's last page would fault
+    const size_t size = (size_t)st.st_size;
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t mapped = (size + page_size - 1) / page_size * page_size + page_size;
+    uint8_t* base = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mapped);
+        base = MAP_FAILED;
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Could not map file\n");
+        return NULL;
+    }
+
+    // Tracks are read front to back, so let the kernel read ahead aggressively
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    if (memcmp(base, "MThd", 4) != 0) {
+        fprintf(stderr, "Not a MIDI file\n");
+        munmap(base, mapped);
+        return NULL;
+    }
+
+    if (read_be32(base + 4) != 6) {
+        fprintf(stderr, "Invalid header length\n");
+        munmap(base, mapped);
+        return NULL;
+    }
+
+    const uint16_t num_tracks = read_be16(base + 10);
+    *time_div = read_be16(base + 12);
+
+    if (*time_div >= 0x8000) {
+        fprintf(stderr, "SMPTE timing not supported\n");
+        munmap(base, mapped);
+        return NULL;
+    }
+    if (*time_div == 0) {
+        fprintf(stderr, "Invalid time division\n");
+        munmap(base, mapped);
+        return NULL;
+    }
+
+    printf("%d tracks\n", num_tracks);
+
+    TrackData* tracks = malloc(num_tracks * sizeof(TrackData));
+    if (!tracks) {
+        fprintf(stderr, "Memory allocation failed\n");
+        munmap(base, mapped);
+        return NULL;
+    }
+
+    const uintptr_t page_mask = ~((uintptr_t)page_size - 1);
+
+    int valid_tracks = 0;
+    size_t pos = 14;
+    while (valid_tracks < num_tracks && pos + 8 <= size) {
+        size_t length = read_be32(base + pos + 4);
+        const bool is_track = memcmp(base + pos, "MTrk", 4) == 0;
+        pos += 8;
+
+        // Truncated files keep whatever is actually there
+        if (length > size - pos) length = size - pos;
+
+        if (is_track) {
+            TrackData* track = &tracks[valid_tracks];
+            init_track_data(track);
+            track->data = base + pos;
+            track->length = length;
+            track->owns_data = false;
+
+            // Every track starts playing at once, so only its head is needed up front
+            const uintptr_t head = (uintptr_t)track->data & page_mask;
+            const size_t prefetch = length < MAPPED_TRACK_PREFETCH ? length : MAPPED_TRACK_PREFETCH;
+            madvise((void*)head, (uintptr_t)track->data + prefetch - head, MADV_WILLNEED);
+
+            update_tick(track);
+            valid_tracks++;
+        }
+
+        pos += length;
+    }
+
+    *track_count = valid_tracks;
+    mapping->base = base;
+    mapping->size = mapped;
+
+    const clock_t end_time = clock();
+    const double duration_seconds = (double)(end_time - start_time) / CLOCKS_PER_SEC;
+    const long duration_microseconds = (long)(duration_seconds * 1000000);
+    const long duration_milliseconds = (long)(duration_seconds * 1000);
+
+    printf("Mapped in %ldms (%ldμs).\n", duration_milliseconds, duration_microseconds);
+
+    return tracks;
+}
+
+void unmap_midi_file(MidiMapping* mapping) {
+    if (mapping->base) munmap(mapping->base, mapping->size);
+    mapping->base = NULL;
+    mapping->size = 0;
+}
+
+void InitMIDIPlayerOptions(MidiPlayerOptions* options) {
+    options->use_mmap = false;
+    options->predecode = false;
+    options->decode_threads = 0;
+    options->merge_timeline = false;
+    options->scheduler = MIDI_SCHEDULER_LINEAR;
+    options->lookahead_ms = 0;
+    options->lookahead_events = 1 << 20;
+    options->start_ms = 0;
+    options->seek_interval_ms = 5000;
+    options->seek_index_bytes = 64 * 1024 * 1024;
+    options->collect_stats = false;
+    options->max_note_ons = 0;
+    options->max_polyphony = 0;
+    options->max_nps = 0;
+    options->stats_callback = NULL;
+    options->use_cache = false;
+    options->cache_dir = NULL;
+    options->sink = MIDI_SINK_OMNIMIDI;
+    options->sink_device = NULL;
+    options->spin_us = 0;
+    options->realtime = false;
+    options->realtime_priority = 80;
+    options->dispatch_cpu = -1;
+    options->producer_cpu = -1;
+    options->min_velocity = 5;
+    options->drop_duplicate_notes = false;
+    options->max_notes_per_key_ms = 0;
+    options->nps_ceiling = 0;
+    options->offline = false;
+    options->offline_min_speed = 0.0;
+    options->offline_report = NULL;
+    options->note_batch_callback = NULL;
+    options->metrics = NULL;
+    options->metrics_path = NULL;
+    options->metrics_format = MIDI_METRICS_CSV;
+    options->metrics_interval_ms = 1000;
+    options->preload_bytes = 512ULL * 1024 * 1024;
+    options->roll_callback = NULL;
+    options->shards = 0;
+    options->shard_by = MIDI_SHARD_TRACKS;
+    options->shard_devices = NULL;
+    options->shard_tolerance_us = 2000;
+}
+
+// Everything PlayMIDIWithOptions plays from: raw tracks, or pre-decoded ones from the decoder or a cache
+typedef struct {
+    uint16_t time_div;
+    TrackData* tracks;
+    int track_count;
+    MidiMapping mapping;
+    PackedTrack* packed;
+    int packed_count;
+    TempoMap tempo_map;
+    MidiFileStats stats;
+    bool has_stats;
+    SeekIndex seek_index;
+    MidiCache cache;            // Owns packed, tempo_map and seek_index when cached is set
+    bool cached;
+} LoadedSong;
+
+static bool stats_within_limits(const MidiPlayerOptions* options, const MidiFileStats* stats) {
+    if (options->max_note_ons && stats->note_on_count > options->max_note_ons) {
+        fprintf(stderr, "MIDI file has %llu note-ons, limit is %llu\n", (unsigned long long)stats->note_on_count, (unsigned long long)options->max_note_ons);
+        return false;
+    }
+    if (options->max_polyphony && stats->peak_polyphony > options->max_polyphony) {
+        fprintf(stderr, "MIDI file reaches a polyphony of %llu, limit is %llu\n", (unsigned long long)stats->peak_polyphony, (unsigned long long)options->max_polyphony);
+        return false;
+    }
+    if (options->max_nps && stats->peak_nps > options->max_nps) {
+        fprintf(stderr, "MIDI file peaks at %llu notes per second, limit is %llu\n", (unsigned long long)stats->peak_nps, (unsigned long long)options->max_nps);
+        return false;
+    }
+    return true;
+}
+
+static void free_raw_tracks(LoadedSong* song) {
+    if (song->tracks) {
+        for (int i = 0; i < song->track_count; i++) {
+            free_track_data(&song->tracks[i]);
+        }
+        free(song->tracks);
+        song->tracks = NULL;
+    }
+    unmap_midi_file(&song->mapping);
+}
+
+static void free_loaded_song(LoadedSong* song) {
+    if (song->cached) {
+        close_midi_cache(&song->cache);
+    } else {
+        free_tempo_map(&song->tempo_map);
+        free_seek_index(&song->seek_index);
+        if (song->packed) free_packed_tracks(song->packed, song->packed_count);
+    }
+    free_midi_stats(&song->stats);
+    free_raw_tracks(song);
+    memset(song, 0, sizeof(LoadedSong));
+}
+
+// Parse the file and prepare it the way options ask for. On failure the caller still frees song.
+static bool load_song(char* file, const MidiPlayerOptions* options, LoadedSong* song) {
+    song->tracks = options->use_mmap
+        ? load_midi_file_mapped(file, &song->time_div, &song->track_count, &song->mapping)
+        : load_midi_file(file, &song->time_div, &song->track_count);
+    if (!song->tracks) return false;
+
+    // The statistics pass also produces the tempo map, so it is only built once.
+    // A cache always carries the statistics.
+    const bool want_stats = options->collect_stats || options->stats_callback || options->use_cache ||
+        options->max_note_ons || options->max_polyphony || options->max_nps;
+
+    if (want_stats) {
+        if (!scan_midi_stats(song->tracks, song->track_count, song->time_div, options->decode_threads, &song->tempo_map, &song->stats)) return false;
+        song->has_stats = true;
+        if (!stats_within_limits(options, &song->stats)) return false;
+
+        // Grow every long message buffer once to the largest payload of its track
+        for (int i = 0; i < song->track_count; i++) {
+            TrackData* track = &song->tracks[i];
+            const size_t largest = song->stats.tracks[i].largest_payload;
+            if (!track->owns_data || track->long_msg_capacity >= largest) continue;
+
+            uint8_t* new_buf = realloc(track->long_msg, largest);
+            if (!new_buf) {
+                fprintf(stderr, "Memory allocation failed\n");
+                return false;
+            }
+            track->long_msg = new_buf;
+            track->long_msg_capacity = largest;
+        }
+    }
+
+    if (options->predecode || options->merge_timeline || options->use_cache) {
+        song->packed = pack_tracks(song->tracks, song->track_count, options->decode_threads, song->stats.tracks);
+        song->packed_count = song->track_count;
+
+        // The raw tracks are no longer needed once everything has been decoded
+        free_raw_tracks(song);
+        if (!song->packed) return false;
+
+        if (options->merge_timeline) {
+            PackedTrack* merged = malloc(sizeof(PackedTrack));
+            const bool merged_ok = merged && merge_tracks(song->packed, song->packed_count, merged);
+
+            // The merged timeline replaces the per-track arrays
+            free_packed_tracks(song->packed, song->packed_count);
+            song->packed = NULL;
+            if (!merged_ok) {
+                free(merged);
+                return false;
+            }
+
+            // A merged timeline is a single track, so playback is one linear walk
+            song->packed = merged;
+            song->packed_count = 1;
+        }
+    }
+
+    return true;
+}
+
+static void lock_song_region(const void* data, const size_t size, size_t* locked, size_t* touched) {
+    if (!data || size == 0) return;
+    if (midi_lock_region(data, size)) {
+        *locked += size;
+    } else {
+        *touched += size;
+    }
+}
+
+// Fault in and pin everything playback reads, so no page fault lands in the middle of a deadline
+static void lock_song_memory(const LoadedSong* song, const Sequencer* seq) {
+    if (midi_lock_all_memory()) {
+        printf("Locked all memory.\n");
+        return;
+    }
+
+    // Usually RLIMIT_MEMLOCK: fall back to the song's own buffers
+    size_t locked = 0, touched = 0;
+    for (int i = 0; song->packed && i < song->packed_count; i++) {
+        lock_song_region(song->packed[i].events, song->packed[i].event_count * sizeof(PackedEvent), &locked, &touched);
+        lock_song_region(song->packed[i].metas, song->packed[i].meta_count * sizeof(PackedMeta), &locked, &touched);
+        lock_song_region(song->packed[i].payload, song->packed[i].payload_size, &locked, &touched);
+    }
+    for (int i = 0; song->tracks && i < song->track_count; i++) {
+        lock_song_region(song->tracks[i].data, song->tracks[i].length, &locked, &touched);
+    }
+    lock_song_region(song->tempo_map.entries, song->tempo_map.count * sizeof(TempoEntry), &locked, &touched);
+    lock_song_region(song->seek_index.points, song->seek_index.count * sizeof(SeekPoint), &locked, &touched);
+    lock_song_region(seq->messages, seq->message_capacity * sizeof(uint32_t), &locked, &touched);
+    lock_song_region(seq->cursors, seq->track_count * sizeof(size_t), &locked, &touched);
+    lock_song_region(seq->heap.keys, seq->track_count * sizeof(uint64_t), &locked, &touched);
+
+    if (touched > 0) {
+        fprintf(stderr, "Cannot lock %.1fMB of song data, pre-faulted it instead\n", (double)touched / (1024.0 * 1024.0));
+    }
+    if (locked > 0) {
+        printf("Locked %.1fMB of song data.\n", (double)locked / (1024.0 * 1024.0));
+    }
+}
+
+// Offline run and its report. With the song length known up front, a run that can't reach offline_min_speed
+// is cut off as soon as that is certain; otherwise it is judged at the end.
+static bool run_offline(Sequencer* seq, MidiSink* sink, MidiLimiter* limiter, MidiMetrics* metrics, const NoteCallbacks* callbacks,
+    const MidiPlayerOptions* options, const MidiFileStats* stats, const uint64_t run_start, const uint64_t load_end) {
+    MidiOfflineReport report;
+    memset(&report, 0, sizeof(MidiOfflineReport));
+
+    const uint64_t play_start = midi_timer_now_ns();
+    report.load_ns = load_end - run_start;
+    report.prepare_ns = play_start - load_end;
+
+    uint64_t budget_ns = 0;
+    if (options->offline_min_speed > 0 && stats) {
+        const uint64_t skipped = (uint64_t)options->start_ms * 1000000ULL;
+        const uint64_t song_ns = stats->duration_ns > skipped ? stats->duration_ns - skipped : 0;
+        const uint64_t allowed = (uint64_t)((double)song_ns / options->offline_min_speed);
+        const uint64_t used = play_start - run_start;
+        budget_ns = allowed > used ? allowed - used : 1;
+    }
+
+    const bool finished = play_midi_offline(seq, sink, limiter, metrics, callbacks, budget_ns, &report);
+
+    report.total_ns = midi_timer_now_ns() - run_start;
+    report.events_per_second = report.play_ns ? (double)report.events * 1e9 / (double)report.play_ns : 0.0;
+    report.speed = report.total_ns ? (double)report.song_ns / (double)report.total_ns : 0.0;
+    report.too_slow = options->offline_min_speed > 0 && (!finished || report.speed < options->offline_min_speed);
+
+    printf("Offline: %llu events in %ldms (%ldμs), %.0f events/s, %.1fx real time.\n",
+        (unsigned long long)report.events, (long)(report.total_ns / 1000000), (long)(report.total_ns / 1000),
+        report.events_per_second, report.speed);
+    printf("Phases: load %ldms, prepare %ldms, schedule %ldms, dispatch %ldms.\n",
+        (long)(report.load_ns / 1000000), (long)(report.prepare_ns / 1000000),
+        (long)(report.schedule_ns / 1000000), (long)(report.dispatch_ns / 1000000));
+    if (report.too_slow) {
+        fprintf(stderr, "MIDI file plays at %.1fx real time%s, minimum is %.1fx\n", report.speed,
+            finished ? "" : " (cut off)", options->offline_min_speed);
+    }
+
+    if (options->metrics_path) {
+        FILE* dump = fopen(options->metrics_path, "w");
+        if (dump) {
+            MidiMetricsSnapshot snapshot;
+            midi_metrics_snapshot(metrics, &snapshot);
+            const uint64_t nps = report.song_ns ? snapshot.note_ons * 1000000000ULL / report.song_ns : 0;
+            midi_metrics_write(dump, options->metrics_format, &snapshot, nps, true);
+            fclose(dump);
+        } else {
+            fprintf(stderr, "Could not open metrics file %s\n", options->metrics_path);
+        }
+    }
+
+    if (options->offline_report) *options->offline_report = report;
+    return !report.too_slow;
+}
+
+// A song ready for its first sequencer step. Heap allocated and never moved, since the sequencer points into it.
+typedef struct {
+    LoadedSong song;
+    Sequencer seq;
+    char* file;
+    uint64_t run_start;         // When preparing started
+    uint64_t load_end;          // When the file was loaded, before the tempo map and sequencer
+    uint64_t ready;             // When preparing finished
+    uint64_t play_start;        // When the last play's clock started and stopped, 0 before it ran
+    uint64_t play_end;
+    atomic_int refs;            // The player and every MidiRoll over the song
+} PreparedSong;
+
+static void free_prepared_song(PreparedSong* prepared) {
+    sequencer_free(&prepared->seq);
+    free_loaded_song(&prepared->song);
+    free(prepared);
+}
+
+static void release_prepared_song(PreparedSong* prepared) {
+    if (atomic_fetch_sub_explicit(&prepared->refs, 1, memory_order_acq_rel) == 1) free_prepared_song(prepared);
+}
+
+// Everything up to playback: load or reopen from the cache, tempo map, sequencer, seek index and cache write.
+// Touches no sink, so it can run on another thread while a song plays. A seekable song always gets a seek index.
+static PreparedSong* prepare_song(char* file, const MidiPlayerOptions* options, const bool seekable) {
+    const clock_t start_time = clock();
+    PreparedSong* prepared = calloc(1, sizeof(PreparedSong));
+    if (!prepared) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    prepared->file = file;
+    prepared->run_start = midi_timer_now_ns();
+    atomic_init(&prepared->refs, 1);
+
+    LoadedSong* song = &prepared->song;
+    MidiCacheKey cache_key = {0};
+    char* cache_path = NULL;
+    bool cache_key_ok = false;
+
+    if (options->use_cache) {
+        cache_path = midi_cache_path(file, options->cache_dir);
+        cache_key_ok = cache_path && midi_cache_key(file, &cache_key);
+        song->cached = cache_key_ok && open_midi_cache(cache_path, &cache_key, options->merge_timeline, &song->cache);
+    }
+
+    bool ok;
+    if (song->cached) {
+        // Everything is used straight from the mapping
+        song->time_div = song->cache.time_div;
+        song->packed = song->cache.tracks;
+        song->packed_count = song->cache.track_count;
+        song->tempo_map = song->cache.tempo_map;
+        song->seek_index = song->cache.seek_index;
+        song->stats = song->cache.stats;
+        song->has_stats = true;
+        ok = stats_within_limits(options, &song->stats);
+    } else {
+        ok = load_song(file, options, song);
+    }
+
+    if (!ok) {
+        free_prepared_song(prepared);
+        free(cache_path);
+        return NULL;
+    }
+
+    prepared->load_end = midi_timer_now_ns();
+    const clock_t end_time = clock();
+    const double duration_seconds = (double)(end_time - start_time) / CLOCKS_PER_SEC;
+    const long duration_milliseconds = (long)(duration_seconds * 1000);
+
+    printf("MIDI initialization took %ldms.\n", duration_milliseconds);
+
+    ok = song->tempo_map.entries != NULL;
+    if (!ok) {
+        ok = song->packed
+            ? build_tempo_map_packed(song->packed, song->packed_count, song->time_div, &song->tempo_map)
+            : build_tempo_map_tracks(song->tracks, song->track_count, song->time_div, options->decode_threads, &song->tempo_map);
+    }
+    if (ok) {
+        ok = song->packed
+            ? sequencer_init_packed(&prepared->seq, song->packed, song->packed_count, &song->tempo_map, options->scheduler)
+            : sequencer_init_tracks(&prepared->seq, song->tracks, song->track_count, &song->tempo_map, options->scheduler);
+    }
+
+    // A fresh cache gets the seek index too, so later runs can start anywhere without a rebuild
+    const bool write_cache = options->use_cache && !song->cached && cache_key_ok;
+    if (ok && !song->cached && (seekable || options->start_ms > 0 || write_cache)) {
+        ok = build_seek_index(&prepared->seq, options->seek_interval_ms, options->seek_index_bytes, &song->seek_index);
+    }
+
+    if (ok && write_cache) {
+        // Playback goes on without a cache if it can't be written
+        write_midi_cache(cache_path, &cache_key, options->merge_timeline, song->time_div, song->packed, song->packed_count,
+            &song->tempo_map, &song->seek_index, &song->stats);
+    }
+    free(cache_path);
+
+    if (!ok) {
+        free_prepared_song(prepared);
+        return NULL;
+    }
+    prepared->ready = midi_timer_now_ns();
+    return prepared;
+}
+
+// A cursor of its own over a song's pre-decoded tracks. Packed tracks are never written during playback,
+// so it can run on any thread, at any distance from the playhead.
+struct MidiRoll {
+    PreparedSong* song;         // Held until the roll is closed
+    Sequencer seq;
+    size_t next;                // First message of seq.messages not read yet
+    uint64_t origin_ns;
+};
+
+static bool sequencer_copy(Sequencer* copy, const Sequencer* seq) {
+    const size_t track_count = seq->track_count > 0 ? seq->track_count : 1;
+    *copy = *seq;
+    copy->messages = malloc(seq->message_capacity * sizeof(uint32_t));
+    copy->heap.keys = malloc(track_count * sizeof(uint64_t));
+    copy->cursors = seq->cursors ? malloc(track_count * sizeof(size_t)) : NULL;
+    if (!copy->messages || !copy->heap.keys || (seq->cursors && !copy->cursors)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        sequencer_free(copy);
+        return false;
+    }
+
+    memcpy(copy->messages, seq->messages, seq->message_count * sizeof(uint32_t));
+    memcpy(copy->heap.keys, seq->heap.keys, seq->heap.count * sizeof(uint64_t));
+    if (seq->cursors) memcpy(copy->cursors, seq->cursors, seq->track_count * sizeof(size_t));
+    return true;
+}
+
+// Start a roll where playback starts. After a seek, the notes already sounding come first, at the seek point.
+static MidiRoll* open_midi_roll(PreparedSong* prepared, const uint32_t start_ms) {
+    LoadedSong* song = &prepared->song;
+    if (!song->packed) {
+        fprintf(stderr, "The piano roll needs pre-decoded tracks\n");
+        return NULL;
+    }
+
+    MidiRoll* roll = calloc(1, sizeof(MidiRoll));
+    if (!roll) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    if (!sequencer_init_packed(&roll->seq, song->packed, song->packed_count, &song->tempo_map, MIDI_SCHEDULER_HEAP)) {
+        free(roll);
+        return NULL;
+    }
+
+    if (start_ms > 0) {
+        ChannelState channels[MIDI_CHANNELS];
+        roll->origin_ns = (uint64_t)start_ms * 1000000ULL;
+        if (!sequencer_seek(&roll->seq, &song->seek_index, roll->origin_ns, channels)) {
+            sequencer_free(&roll->seq);
+            free(roll);
+            return NULL;
+        }
+
+        // The last replayed step is already read; the sounding notes take its place
+        roll->seq.message_count = 0;
+        roll->seq.time_ns = roll->origin_ns;
+        for (int c = 0; c < MIDI_CHANNELS; c++) {
+            for (int n = 0; n < 128; n++) {
+                if (channels[c].notes[n]) sequencer_emit(&roll->seq, 0x90 | c | (n << 8) | (channels[c].notes[n] << 16));
+            }
+        }
+    }
+
+    // The seek replay above needs every channel message for the synth state; from here on only notes are drawn
+    roll->seq.notes_only = true;
+
+    atomic_fetch_add_explicit(&prepared->refs, 1, memory_order_relaxed);
+    roll->song = prepared;
+    return roll;
+}
+
+MidiRoll* midi_roll_copy(const MidiRoll* roll) {
+    MidiRoll* copy = malloc(sizeof(MidiRoll));
+    if (!copy) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    *copy = *roll;
+    if (!sequencer_copy(&copy->seq, &roll->seq)) {
+        free(copy);
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&roll->song->refs, 1, memory_order_relaxed);
+    return copy;
+}
+
+// Note-ons and note-offs (velocity 0) due before until_ns, in song order. Times are from the start of the song,
+// not from where playback started.
+size_t midi_roll_read(MidiRoll* roll, const uint64_t until_ns, MidiNoteEvent* notes, const size_t max) {
+    Sequencer* seq = &roll->seq;
+    size_t count = 0;
+
+    while (count < max) {
+        if (roll->next == seq->message_count) {
+            if (seq->done || tempo_map_time_ns(seq->tempo_map, seq->next_tick) >= until_ns) break;
+            sequencer_step(seq);
+            roll->next = 0;
+            continue;
+        }
+
+        const uint32_t message = seq->messages[roll->next++];
+        const uint8_t status = message & 0xF0;
+        if (status != 0x90 && status != 0x80) continue;
+
+        notes[count++] = (MidiNoteEvent){
+            .time_ns = seq->time_ns,
+            .channel = message & 0x0F,
+            .note = (message >> 8) & 0x7F,
+            .velocity = status == 0x90 ? (message >> 16) & 0x7F : 0,
+        };
+    }
+    return count;
+}
+
+uint64_t midi_roll_origin_ns(const MidiRoll* roll) {
+    return roll->origin_ns;
+}
+
+// Every note of the song has been read
+bool midi_roll_done(const MidiRoll* roll) {
+    return roll->seq.done && roll->next == roll->seq.message_count;
+}
+
+void midi_roll_close(MidiRoll* roll) {
+    if (!roll) return;
+    sequencer_free(&roll->seq);
+    release_prepared_song(roll->song);
+    free(roll);
+}
+
+// Sharded playback: the song is split between worker threads, each with a sequencer, limiter, timer and sink of
+// its own. They share the tempo map and play to one clock. Nothing blocks: every worker publishes the song time
+// of the step it is about to send, and one that gets more than the tolerance ahead of the slowest waits for it.
+
+#define SHARD_START_LEAD_NS 20000000ULL    // 20ms for every worker to be up before the first deadline
+#define SHARD_SYNC_SLEEP 50000             // 50μs, while a worker waits for a slower one
+#define SHARD_ALL_CHANNELS 0xFFFF
+#define SHARD_DEVICE_MAX 4096
+
+typedef struct PlayerShard PlayerShard;
+
+struct PlayerShard {
+    _Alignas(64) atomic_uint_least64_t due_ns;  // Song time of the step about to go out, UINT64_MAX once done
+    Sequencer seq;
+    PackedTrack* tracks;        // Shallow copies of this worker's tracks, or NULL when it walks all of them
+    uint16_t channels;          // Bitmask of the channels this worker sends
+    MidiSink* sink;
+    MidiLimiter* limiter;
+    MidiTimer timer;
+    MidiThreadMetrics* metrics;
+    MidiThreadPolicy policy;
+    const NoteCallbacks* callbacks;
+    const PlayerShard* peers;   // Every worker, this one included
+    int peer_count;
+    int index;
+    uint64_t start_ns;          // Song time 0 on CLOCK_MONOTONIC, the same for every worker
+    uint64_t tolerance_ns;
+    uint64_t holds;             // Steps held back for a slower worker
+};
+
+// Keep the messages of the channels in mask, in order
+inline __attribute__((always_inline)) static size_t keep_shard_channels(uint32_t* messages, const size_t count, const uint16_t mask) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if ((mask >> (messages[i] & 0x0F)) & 1) messages[n++] = messages[i];
+    }
+    return n;
+}
+
+// Whether another worker still has to send something from more than the tolerance before time.
+// The one furthest behind never waits, so the workers can't all stall.
+inline __attribute__((always_inline)) static bool shard_ahead(const PlayerShard* shard, const uint64_t time) {
+    if (time <= shard->tolerance_ns) return false;
+    const uint64_t oldest = time - shard->tolerance_ns;
+    for (int i = 0; i < shard->peer_count; i++) {
+        if (i != shard->index && atomic_load_explicit(&shard->peers[i].due_ns, memory_order_acquire) < oldest) return true;
+    }
+    return false;
+}
+
+inline __attribute__((always_inline)) static void play_shard_loop(PlayerShard* shard, const NoteCallbackMode mode) {
+    Sequencer* seq = &shard->seq;
+
+    // As in play_midi_loop, stage times reuse the timer's and the lag's clock reads
+    uint64_t mark = midi_timer_now_ns();
+    while (true) {
+        sequencer_step(seq);
+        const uint64_t time = seq->time_ns - seq->origin_ns;
+        atomic_store_explicit(&shard->due_ns, time, memory_order_release);
+
+        size_t count = seq->message_count;
+        if (shard->channels != SHARD_ALL_CHANNELS) count = keep_shard_channels(seq->messages, count, shard->channels);
+
+        // Steps with nothing for this worker aren't waited for
+        if (count > 0) {
+            const uint64_t deadline = shard->start_ns + time;
+            const uint64_t lateness = midi_timer_wait_until(&shard->timer, deadline);
+            midi_metrics_lateness(shard->metrics, lateness);
+            midi_metrics_add(&shard->metrics->schedule_ns, shard->timer.entered_ns - mark);
+            uint64_t woke = deadline + lateness;
+
+            if (shard_ahead(shard, time)) {
+                shard->holds++;
+                while (shard_ahead(shard, time)) midi_timer_sleep_ns(SHARD_SYNC_SLEEP);
+                woke = midi_timer_now_ns();
+            }
+
+            // Checked after the hold too: a cancelled worker stops publishing, which lets the others through
+            if (midi_timer_cancelled(&shard->timer)) break;
+
+            count = filter_channel_messages(seq->messages, count, seq->messages, shard->limiter, time,
+                shard->callbacks, mode, shard->metrics);
+            submit_midi_sink(shard->sink, seq->messages, count);
+            mark = midi_timer_now_ns();
+            midi_metrics_lag(shard->metrics, mark - deadline);
+            midi_metrics_add(&shard->metrics->dispatch_ns, mark - woke);
+        }
+
+        if (seq->done) break;
+    }
+
+    atomic_store_explicit(&shard->due_ns, UINT64_MAX, memory_order_release);
+}
+
+static void* shard_thread(void* arg) {
+    PlayerShard* shard = (PlayerShard*)arg;
+
+    // The thread ends with playback, so its scheduling is never restored
+    if (shard->policy.priority > 0 || shard->policy.cpu >= 0) {
+        MidiThreadState state;
+        midi_thread_apply(&shard->policy, "shard", &state);
+    }
+
+    switch (shard->callbacks->mode) {
+        case NOTE_CALLBACKS_NONE:
+            play_shard_loop(shard, NOTE_CALLBACKS_NONE);
+            break;
+        case NOTE_CALLBACKS_PER_NOTE:
+            play_shard_loop(shard, NOTE_CALLBACKS_PER_NOTE);
+            break;
+        case NOTE_CALLBACKS_BATCH:
+            play_shard_loop(shard, NOTE_CALLBACKS_BATCH);
+            break;
+    }
+    return NULL;
+}
+
+// Sequencer over some of seq's packed tracks that picks up where seq is, so a seek carries over
+static bool sequencer_init_subset(Sequencer* subset, const Sequencer* seq, const PackedTrack* tracks, const int* indices, const int count) {
+    if (!sequencer_init_packed(subset, tracks, count, seq->tempo_map, seq->scheduler)) return false;
+
+    subset->heap.count = 0;
+    for (int i = 0; i < count; i++) {
+        const size_t cursor = seq->cursors[indices[i]];
+        subset->cursors[i] = cursor;
+        if (cursor < tracks[i].event_count) {
+            track_heap_push(&subset->heap, track_heap_key(tracks[i].events[cursor].tick, i));
+        }
+    }
+
+    subset->next_tick = seq->next_tick;
+    subset->tempo_index = seq->tempo_index;
+    subset->origin_ns = seq->origin_ns;
+    subset->done = seq->done;
+    return true;
+}
+
+// Deal the tracks out biggest first, each to the worker with the fewest events so far, so every worker gets one
+static bool assign_shard_tracks(const PackedTrack* tracks, const int track_count, const int shard_count, int* owner) {
+    TrackOrder* order = malloc(track_count * sizeof(TrackOrder));
+    if (!order) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    for (int i = 0; i < track_count; i++) {
+        order[i].index = i;
+        order[i].length = tracks[i].event_count;
+    }
+    qsort(order, track_count, sizeof(TrackOrder), compare_track_order);
+
+    uint64_t events[MIDI_MAX_SHARDS] = {0};
+    int assigned[MIDI_MAX_SHARDS] = {0};
+    for (int i = 0; i < track_count; i++) {
+        int best = 0;
+        for (int s = 1; s < shard_count; s++) {
+            if (events[s] < events[best] || (events[s] == events[best] && assigned[s] < assigned[best])) best = s;
+        }
+        owner[order[i].index] = best;
+        events[best] += order[i].length;
+        assigned[best]++;
+    }
+
+    free(order);
+    return true;
+}
+
+// Synth state after a seek. Split by channel, each worker sends its own channels. Split by track, which worker
+// holds a sounding note isn't known, so every port gets the channel setup without the notes.
+static void send_shard_state(PlayerShard* shard, const uint32_t* state, const size_t state_count, const bool with_notes, uint32_t* messages) {
+    size_t count = 0;
+    for (size_t i = 0; i < state_count; i++) {
+        const uint32_t message = state[i];
+        if (!((shard->channels >> (message & 0x0F)) & 1)) continue;
+        if (!with_notes && (message & 0xF0) == 0x90) continue;
+        messages[count++] = message;
+    }
+    count = filter_channel_messages(messages, count, messages, shard->limiter, 0, shard->callbacks, shard->callbacks->mode, shard->metrics);
+    submit_midi_sink(shard->sink, messages, count);
+}
+
+// Play seq's song with one worker per sink, picking up where seq is. channels is the synth state after a seek, or NULL.
+// Timing and limiter counts are added to timer and limiter for the report.
+static bool play_midi_sharded(const LoadedSong* song, const Sequencer* seq, MidiSink* sinks, const int sink_count,
+    const MidiPlayerOptions* options, const ChannelState* channels, MidiLimiter* limiter, MidiTimer* timer,
+    MidiMetrics* metrics, const NoteCallbacks* callbacks) {
+    // A merged timeline is one track, so it can only be split by channel
+    const bool by_tracks = options->shard_by == MIDI_SHARD_TRACKS && song->packed_count > 1;
+    int shard_count = sink_count;
+    if (by_tracks && shard_count > song->packed_count) shard_count = song->packed_count;
+    if (shard_count > MIDI_CHANNELS && !by_tracks) shard_count = MIDI_CHANNELS;
+
+    PlayerShard* shards = aligned_alloc(64, shard_count * sizeof(PlayerShard));
+    int* owner = by_tracks ? malloc(song->packed_count * sizeof(int)) : NULL;
+    int* indices = by_tracks ? malloc(song->packed_count * sizeof(int)) : NULL;
+    uint32_t* state = channels ? malloc(2 * CHANNEL_STATE_MAX_MESSAGES * sizeof(uint32_t)) : NULL;
+    bool ok = shards && (!by_tracks || (owner && indices)) && (!channels || state);
+    if (!ok) {
+        fprintf(stderr, "Memory allocation failed\n");
+    } else {
+        memset(shards, 0, shard_count * sizeof(PlayerShard));
+        if (by_tracks) ok = assign_shard_tracks(song->packed, song->packed_count, shard_count, owner);
+    }
+
+    // Every worker runs the callbacks, one at a time
+    pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER;
+    NoteCallbacks shared = *callbacks;
+    shared.lock = &callback_lock;
+
+    // Each worker gets its share of the ceiling
+    const uint32_t ceiling = options->nps_ceiling ? (options->nps_ceiling + shard_count - 1) / shard_count : 0;
+
+    for (int i = 0; ok && i < shard_count; i++) {
+        PlayerShard* shard = &shards[i];
+        atomic_init(&shard->due_ns, 0);
+        shard->sink = &sinks[i];
+        shard->metrics = &metrics->shards[i];
+        shard->callbacks = &shared;
+        shard->peers = shards;
+        shard->peer_count = shard_count;
+        shard->index = i;
+        shard->tolerance_ns = (uint64_t)options->shard_tolerance_us * 1000ULL;
+        shard->policy = (MidiThreadPolicy){ options->realtime ? options->realtime_priority : 0,
+            options->realtime && options->dispatch_cpu >= 0 ? options->dispatch_cpu + i : -1 };
+        midi_timer_init(&shard->timer, (uint64_t)options->spin_us * 1000ULL);
+        shard->timer.cancel = timer->cancel;
+
+        shard->limiter = malloc(sizeof(MidiLimiter));
+        if (!shard->limiter) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ok = false;
+            break;
+        }
+        midi_limiter_init(shard->limiter, options->min_velocity, options->drop_duplicate_notes, options->max_notes_per_key_ms, ceiling);
+
+        if (by_tracks) {
+            int count = 0;
+            for (int t = 0; t < song->packed_count; t++) {
+                if (owner[t] == i) indices[count++] = t;
+            }
+            shard->channels = SHARD_ALL_CHANNELS;
+            shard->tracks = malloc((count > 0 ? count : 1) * sizeof(PackedTrack));
+            if (!shard->tracks) {
+                fprintf(stderr, "Memory allocation failed\n");
+                ok = false;
+                break;
+            }
+            for (int t = 0; t < count; t++) {
+                shard->tracks[t] = song->packed[indices[t]];
+            }
+            ok = sequencer_init_subset(&shard->seq, seq, shard->tracks, indices, count);
+        } else {
+            for (int c = i; c < MIDI_CHANNELS; c += shard_count) {
+                shard->channels |= (uint16_t)(1 << c);
+            }
+            ok = sequencer_copy(&shard->seq, seq);
+        }
+    }
+
+    if (ok) {
+        atomic_store_explicit(&metrics->shard_count, shard_count, memory_order_relaxed);
+        printf("Playing on %d shards by %s, at most %uμs apart.\n", shard_count, by_tracks ? "track" : "channel",
+            options->shard_tolerance_us);
+
+        if (channels) {
+            const size_t state_count = channel_state_messages(channels, state);
+            for (int i = 0; i < shard_count; i++) {
+                send_shard_state(&shards[i], state, state_count, !by_tracks, state + CHANNEL_STATE_MAX_MESSAGES);
+            }
+        }
+
+        // No start barrier: song time 0 is set a little ahead, so every worker is up before its first deadline
+        const uint64_t start_ns = midi_timer_now_ns() + SHARD_START_LEAD_NS;
+        for (int i = 0; i < shard_count; i++) {
+            shards[i].start_ns = start_ns;
+        }
+
+        pthread_t threads[MIDI_MAX_SHARDS];
+        int started = 0;
+        while (started < shard_count && pthread_create(&threads[started], NULL, shard_thread, &shards[started]) == 0) {
+            started++;
+        }
+        if (started < shard_count) {
+            fprintf(stderr, "Could not start shard thread\n");
+            ok = false;
+
+            // The rest never play, so the running workers mustn't wait on them
+            for (int i = started; i < shard_count; i++) {
+                atomic_store_explicit(&shards[i].due_ns, UINT64_MAX, memory_order_release);
+            }
+        }
+
+        const uint64_t now = midi_timer_now_ns();
+        if (now < start_ns) midi_timer_sleep_ns(start_ns - now);
+        midi_metrics_start(metrics, start_ns, seq->origin_ns);
+
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        midi_metrics_stop(metrics);
+
+        for (int i = 0; i < shard_count; i++) {
+            midi_timer_merge(timer, &shards[i].timer);
+            midi_limiter_merge(limiter, shards[i].limiter);
+            if (shards[i].holds > 0) {
+                printf("Shard %d waited for a slower one %lu times.\n", i, (unsigned long)shards[i].holds);
+            }
+        }
+    }
+
+    for (int i = 0; shards && i < shard_count; i++) {
+        sequencer_free(&shards[i].seq);
+        free(shards[i].tracks);
+        free(shards[i].limiter);
+    }
+    pthread_mutex_destroy(&callback_lock);
+    free(state);
+    free(indices);
+    free(owner);
+    free(shards);
+    return ok;
+}
+
+// Workers a playback runs on: one unless sharding is asked for, and always one offline, where a single thread is measured
+static int player_shard_count(const MidiPlayerOptions* options) {
+    if (options->offline || options->shards <= 1) return 1;
+    return options->shards < MIDI_MAX_SHARDS ? options->shards : MIDI_MAX_SHARDS;
+}
+
+// Device of a worker's sink: its entry in shard_devices, or sink_device where there is none
+static const char* shard_device(const MidiPlayerOptions* options, const int shard, char* buffer, const size_t size) {
+    const char* entry = options->shard_devices;
+    for (int i = 0; entry && i < shard; i++) {
+        entry = strchr(entry, ',');
+        if (entry) entry++;
+    }
+    if (!entry) return options->sink_device;
+
+    const char* end = strchr(entry, ',');
+    size_t length = end ? (size_t)(end - entry) : strlen(entry);
+    if (length == 0) return options->sink_device;
+    if (length >= size) length = size - 1;
+    memcpy(buffer, entry, length);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+static void close_player_sinks(MidiSink* sinks, const int count) {
+    for (int i = 0; i < count; i++) {
+        close_midi_sink(&sinks[i]);
+    }
+}
+
+// One sink per worker. Returns how many were opened, 0 if any of them failed.
+static int open_player_sinks(const MidiPlayerOptions* options, MidiSink* sinks) {
+    const int count = player_shard_count(options);
+    if (count == 1) return open_midi_sink(&sinks[0], options->sink, options->sink_device) ? 1 : 0;
+
+    char (*buffers)[SHARD_DEVICE_MAX] = malloc(count * sizeof(*buffers));
+    if (!buffers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 0;
+    }
+
+    const char* devices[MIDI_MAX_SHARDS];
+    int opened = 0;
+    for (; opened < count; opened++) {
+        const char* device = shard_device(options, opened, buffers[opened], SHARD_DEVICE_MAX);
+        devices[opened] = device;
+
+        // KDMAPI has one stream per loaded library, so every OmniMIDI worker needs a copy of its own
+        bool shared = false;
+        for (int i = 0; options->sink == MIDI_SINK_OMNIMIDI && i < opened && !shared; i++) {
+            shared = strcmp(devices[i] ? devices[i] : "", device ? device : "") == 0;
+            if (shared) {
+                fprintf(stderr, "Shards %d and %d both use %s; give each OmniMIDI shard its own copy of the library\n",
+                    i, opened, device ? device : "the default OmniMIDI library");
+            }
+        }
+        if (shared || !open_midi_sink(&sinks[opened], options->sink, device)) break;
+    }
+
+    free(buffers);
+    if (opened < count) {
+        close_player_sinks(sinks, opened);
+        return 0;
+    }
+    return count;
+}
+
+// Play a prepared song to its end, on the calling thread or one worker per sink. The song stays the caller's to free.
+// Setting cancel stops realtime playback at its next wait; offline runs always go to the end.
+static bool play_prepared_song(PreparedSong* prepared, MidiSink* sinks, const int sink_count, const MidiPlayerOptions* options, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback,
+    const atomic_bool* cancel)
+{
+    LoadedSong* song = &prepared->song;
+    Sequencer* seq = &prepared->seq;
+    MidiSink* sink = &sinks[0];
+    uint64_t sink_messages = 0;
+    uint64_t sink_batches = 0;
+    for (int i = 0; i < sink_count; i++) {
+        sink_messages += sinks[i].message_count;
+        sink_batches += sinks[i].batch_count;
+    }
+    bool ok = true;
+
+    // Streaming tracks are rewritten as they play, so workers can't share them
+    const bool sharded = sink_count > 1 && song->packed;
+    if (sink_count > 1 && !sharded) fprintf(stderr, "Sharded playback needs pre-decoded tracks, playing on one sink\n");
+
+    // A preloaded song waited for the one before it; that wait is no part of its own phases
+    const uint64_t idle = midi_timer_now_ns() - prepared->ready;
+
+    if (song->has_stats && options->stats_callback) options->stats_callback(&song->stats);
+    printf("\n\n\nPlaying midi file: %s\n", prepared->file);
+
+    // Heap allocated: the per-key tables are too big for a caller's thread stack
+    MidiLimiter* limiter = malloc(sizeof(MidiLimiter));
+    if (!limiter) {
+        fprintf(stderr, "Memory allocation failed\n");
+        ok = false;
+    } else {
+        midi_limiter_init(limiter, options->min_velocity, options->drop_duplicate_notes, options->max_notes_per_key_ms, options->nps_ceiling);
+    }
+
+    const NoteCallbacks callbacks = make_note_callbacks(options->note_batch_callback, note_on_callback, note_off_callback);
+
+    // Counters live in the caller's metrics if there are any, so it can poll them during playback
+    MidiMetrics* owned_metrics = NULL;
+    MidiMetrics* metrics = options->metrics;
+    if (ok && !metrics) {
+        metrics = owned_metrics = aligned_alloc(64, sizeof(MidiMetrics));
+        if (!metrics) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ok = false;
+        }
+    }
+    if (metrics) midi_metrics_reset(metrics);
+
+    // The roll goes out before the metrics start, so its reader never pairs it with the last song's clock
+    if (ok && options->roll_callback) {
+        MidiRoll* roll = open_midi_roll(prepared, options->start_ms);
+        if (roll) options->roll_callback(roll);
+    }
+
+    ChannelState channels[MIDI_CHANNELS];
+    if (ok && options->start_ms > 0) {
+        ok = sequencer_seek(seq, &song->seek_index, (uint64_t)options->start_ms * 1000000ULL, channels);
+
+        // Bring the synth into the state it would be in had the song played from the start.
+        // Sharded, every worker does that for its own sink.
+        if (ok && !sharded) {
+            uint32_t* messages = malloc(CHANNEL_STATE_MAX_MESSAGES * sizeof(uint32_t));
+            size_t count = messages ? channel_state_messages(channels, messages) : 0;
+            count = filter_channel_messages(messages, count, messages, limiter, 0, &callbacks, callbacks.mode,
+                &metrics->threads[MIDI_METRICS_DISPATCH]);
+            submit_midi_sink(sink, messages, count);
+            free(messages);
+        }
+        if (ok) printf("Started at %ums.\n", options->start_ms);
+    }
+
+    MidiTimer timer;
+    midi_timer_init(&timer, (uint64_t)options->spin_us * 1000ULL);
+    timer.cancel = cancel;
+
+    if (ok && options->offline) {
+        ok = run_offline(seq, sink, limiter, metrics, &callbacks, options, song->has_stats ? &song->stats : NULL,
+            prepared->run_start + idle, prepared->load_end + idle);
+    } else if (ok) {
+        // The dispatcher outranks the producer: a late send is audible, a late parse only shrinks the lookahead
+        const MidiThreadPolicy dispatch_policy = { options->realtime ? options->realtime_priority : 0, options->realtime ? options->dispatch_cpu : -1 };
+        const MidiThreadPolicy producer_policy = { options->realtime ? options->realtime_priority - 1 : 0, options->realtime ? options->producer_cpu : -1 };
+        MidiThreadState dispatch_state = {0};
+
+        if (options->realtime) {
+            lock_song_memory(song, seq);
+            if (midi_thread_apply(&dispatch_policy, "dispatch", &dispatch_state)) {
+                printf("Playing at SCHED_FIFO %d.\n", options->realtime_priority);
+            }
+        }
+
+        // Playback goes on without the metrics dump if its file can't be opened
+        LoggerArgs logger_args = {
+            .metrics = metrics,
+            .npsCallback = note_per_second_callback,
+            .format = options->metrics_format,
+            .interval_ns = (uint64_t)(options->metrics_interval_ms ? options->metrics_interval_ms : 1000) * 1000000ULL,
+        };
+        if (options->metrics_path) {
+            logger_args.dump = fopen(options->metrics_path, "w");
+            if (!logger_args.dump) fprintf(stderr, "Could not open metrics file %s\n", options->metrics_path);
+        }
+        pthread_t logger_thread;
+        const bool logging = start_logger(&logger_thread, &logger_args);
+
+        if (sharded) {
+            if (options->lookahead_ms > 0) printf("Lookahead is not used in sharded playback.\n");
+            ok = play_midi_sharded(song, seq, sinks, sink_count, options, options->start_ms > 0 ? channels : NULL,
+                limiter, &timer, metrics, &callbacks);
+        } else if (options->lookahead_ms > 0) {
+            // No need for a buffer bigger than the whole song. Pre-decoded tracks know their size without the statistics
+            // pass; a full-size buffer for every song of a playlist costs milliseconds between them.
+            size_t song_events = SIZE_MAX;
+            if (song->has_stats) {
+                song_events = song->stats.event_count;
+            } else if (song->packed) {
+                song_events = 0;
+                for (int i = 0; i < song->packed_count; i++) song_events += song->packed[i].event_count;
+            }
+            size_t lookahead_events = options->lookahead_events;
+            if (song_events < lookahead_events) lookahead_events = song_events + 1;
+            play_midi_lookahead(seq, options->lookahead_ms, lookahead_events, sink, &timer, limiter, &producer_policy, options->realtime,
+                metrics, &callbacks);
+        } else {
+            play_midi(seq, sink, &timer, limiter, metrics, &callbacks);
+        }
+
+        if (logging) stop_logger(logger_thread, &logger_args);
+        if (logger_args.dump) fclose(logger_args.dump);
+
+        if (options->realtime) {
+            midi_thread_restore(&dispatch_state);
+            midi_unlock_memory();
+        }
+    }
+
+    if (ok && metrics) {
+        MidiClock clock;
+        midi_metrics_clock(metrics, &clock);
+        prepared->play_start = clock.start_ns;
+        prepared->play_end = clock.start_ns ? clock.start_ns + clock.elapsed_ns : 0;
+    }
+
+    midi_timer_report(&timer);
+    if (limiter) midi_limiter_report(limiter);
+    free(limiter);
+    free(owned_metrics);
+    uint64_t sent_messages = 0;
+    uint64_t sent_batches = 0;
+    for (int i = 0; i < sink_count; i++) {
+        sent_messages += sinks[i].message_count;
+        sent_batches += sinks[i].batch_count;
+    }
+    if (sink_count > 1) {
+        printf("Sent %llu messages to %d %s sinks in %llu batches.\n", (unsigned long long)(sent_messages - sink_messages),
+            sink_count, midi_sink_name(sink->type), (unsigned long long)(sent_batches - sink_batches));
+    } else {
+        printf("Sent %llu messages to %s in %llu batches.\n", (unsigned long long)(sent_messages - sink_messages),
+            midi_sink_name(sink->type), (unsigned long long)(sent_batches - sink_batches));
+    }
+
+    return ok;
+}
+
+bool PlayMIDIWithOptions(char* file, const MidiPlayerOptions* options, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback)
+{
+    // Initialize MIDI
+    MidiSink sinks[MIDI_MAX_SHARDS];
+    const int sink_count = open_player_sinks(options, sinks);
+    if (sink_count == 0) {
+        return 1;
+    }
+
+    PreparedSong* prepared = prepare_song(file, options, false);
+    const bool ok = prepared && play_prepared_song(prepared, sinks, sink_count, options, note_on_callback, note_off_callback, note_per_second_callback, NULL);
+
+    // Clean up
+    if (prepared) release_prepared_song(prepared);
+    close_player_sinks(sinks, sink_count);
+
+    return ok ? 0 : 1;
+}
+
+// A roll over a song that isn't played, starting at start_ms, for walking its timeline at any speed.
+// Takes the same loading options as playback and needs pre-decoded tracks too; no sink is opened.
+MidiRoll* OpenMIDIRoll(char* file, const MidiPlayerOptions* options) {
+    PreparedSong* prepared = prepare_song(file, options, false);
+    if (!prepared) return NULL;
+
+    MidiRoll* roll = open_midi_roll(prepared, options->start_ms);
+    release_prepared_song(prepared);
+    return roll;
+}
+
+// Peak memory of a prepared song, guessed from its file size: pre-decoded events take about three times
+// their encoded size, and a merged timeline keeps the per-track copy while it is built
+static uint64_t estimate_song_bytes(const char* file, const MidiPlayerOptions* options) {
+    struct stat st;
+    if (stat(file, &st) != 0) return 0;
+
+    uint64_t bytes = (uint64_t)st.st_size;
+    if (options->merge_timeline) {
+        bytes *= 6;
+    } else if (options->predecode || options->use_cache) {
+        bytes *= 3;
+    }
+    return bytes;
+}
+
+typedef struct {
+    char* file;                 // Song to prepare, or NULL
+    const MidiPlayerOptions* options;
+    PreparedSong* finished;     // Song that just ended, freed here instead of between two songs
+    PreparedSong* prepared;     // Result, NULL on failure
+} PreloadArgs;
+
+static void* preload_song(void* arg) {
+    PreloadArgs* args = (PreloadArgs*)arg;
+    if (args->finished) release_prepared_song(args->finished);
+    args->prepared = args->file ? prepare_song(args->file, args->options, false) : NULL;
+    return NULL;
+}
+
+// Play files back to back through one set of sinks. While a song plays, the next one is prepared on a background
+// thread, so it starts right after the last event of the one before. Only the first song starts at start_ms.
+bool PlayMIDIPlaylist(char** files, const int file_count, const MidiPlayerOptions* options, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback)
+{
+    if (file_count < 1) return 1;
+
+    MidiSink sinks[MIDI_MAX_SHARDS];
+    const int sink_count = open_player_sinks(options, sinks);
+    if (sink_count == 0) {
+        return 1;
+    }
+
+    MidiPlayerOptions rest = *options;
+    rest.start_ms = 0;
+
+    int failed = 0;
+    PreparedSong* current = prepare_song(files[0], options, false);
+    PreparedSong* finished = NULL;
+    uint64_t last_end = 0;      // When the song before stopped playing
+
+    for (int i = 0; i < file_count; i++) {
+        if (!current) {
+            failed++;
+        }
+
+        PreloadArgs preload = { i + 1 < file_count ? files[i + 1] : NULL, &rest, finished, NULL };
+        pthread_t preload_thread;
+        bool preloading = false;
+        if (preload.file) {
+            const uint64_t estimate = estimate_song_bytes(preload.file, &rest);
+            if (estimate <= options->preload_bytes) {
+                preloading = pthread_create(&preload_thread, NULL, preload_song, &preload) == 0;
+            } else {
+                printf("Not preloading %s: about %.1fMB, limit is %.1fMB.\n", preload.file,
+                    (double)estimate / (1024.0 * 1024.0), (double)options->preload_bytes / (1024.0 * 1024.0));
+            }
+        }
+
+        if (current && !play_prepared_song(current, sinks, sink_count, i == 0 ? options : &rest, note_on_callback, note_off_callback, note_per_second_callback, NULL)) {
+            failed++;
+        }
+
+        // Silence between two songs: the last one's teardown, this one's setup and whatever preloading didn't hide
+        if (current && current->play_start && !options->offline) {
+            if (last_end) printf("Gap after the previous song: %.1fms.\n", (double)(current->play_start - last_end) / 1e6);
+            last_end = current->play_end;
+        } else {
+            last_end = 0;
+        }
+
+        if (preloading) {
+            pthread_join(preload_thread, NULL);
+            finished = current;
+            current = preload.prepared;
+        } else {
+            // No room to hold two songs at once: let the last one go before the next is loaded
+            if (preload.finished) release_prepared_song(preload.finished);
+            if (current) release_prepared_song(current);
+            finished = NULL;
+            current = preload.file ? prepare_song(preload.file, &rest, false) : NULL;
+        }
+    }
+
+    if (finished) release_prepared_song(finished);
+    if (current) release_prepared_song(current);
+    close_player_sinks(sinks, sink_count);
+
+    printf("Played %d of %d files.\n", file_count - failed, file_count);
+    return failed ? 1 : 0;
+}
+
+bool PlayMIDI(char* file, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback)
+{
+    MidiPlayerOptions options;
+    InitMIDIPlayerOptions(&options);
+    return PlayMIDIWithOptions(file, &options, note_on_callback, note_off_callback, note_per_second_callback);
+}
+
+struct MidiPlayer {
+    MidiPlayerOptions options;  // The caller's; start_ms is where a loaded song starts, then each play starts at position_ns
+    NoteOnCallback note_on_callback;
+    NoteOffCallback note_off_callback;
+    NotePerSecondCallback note_per_second_callback;
+    MidiSink sinks[MIDI_MAX_SHARDS];
+    int sink_count;
+    MidiMetrics* owned_metrics; // When the caller passed none; options.metrics points at whichever is used
+    PreparedSong* song;
+    bool rewind;                // The song's sequencer has moved since it was loaded
+    atomic_uint_least64_t position_ns; // Where the next play starts
+    atomic_int state;           // MidiPlayerState
+    atomic_bool cancel;         // Stops the play in progress at its next wait
+    pthread_t thread;
+    pthread_mutex_t lock;       // Held by every call that changes what plays
+    pthread_cond_t wake;        // A play was requested, or the player is going away
+    pthread_cond_t idle;        // A play ended
+    bool requested;
+    bool busy;                  // The thread is in a play
+    bool quit;
+};
+
+// All notes off and the sustain pedal up on every channel of every sink
+static void silence_player_sinks(MidiSink* sinks, const int sink_count) {
+    uint32_t messages[MIDI_CHANNELS * 2];
+    for (int c = 0; c < MIDI_CHANNELS; c++) {
+        messages[c * 2] = 0xB0 | c | 64 << 8;
+        messages[c * 2 + 1] = 0xB0 | c | 123 << 8;
+    }
+    for (int i = 0; i < sink_count; i++) {
+        submit_midi_sink(&sinks[i], messages, MIDI_CHANNELS * 2);
+    }
+}
+
+static void* player_thread(void* arg) {
+    MidiPlayer* player = (MidiPlayer*)arg;
+
+    pthread_mutex_lock(&player->lock);
+    while (true) {
+        while (!player->requested && !player->quit) pthread_cond_wait(&player->wake, &player->lock);
+        if (player->quit) break;
+        player->requested = false;
+        player->busy = true;
+        atomic_store_explicit(&player->cancel, false, memory_order_relaxed);
+
+        const uint64_t start_ns = atomic_load_explicit(&player->position_ns, memory_order_relaxed);
+        MidiPlayerOptions options = player->options;
+        options.start_ms = (uint32_t)(start_ns / 1000000ULL);
+        PreparedSong* song = player->song;
+        const bool rewind = player->rewind && options.start_ms == 0;
+        player->rewind = true;
+        pthread_mutex_unlock(&player->lock);
+
+        // Anywhere but the start is reached by seeking anyway
+        bool ok = true;
+        if (rewind) {
+            ChannelState channels[MIDI_CHANNELS];
+            ok = sequencer_seek(&song->seq, &song->song.seek_index, 0, channels);
+            if (!ok) fprintf(stderr, "Could not rewind the song\n");
+        }
+        if (ok) {
+            ok = play_prepared_song(song, player->sinks, player->sink_count, &options, player->note_on_callback,
+                player->note_off_callback, player->note_per_second_callback, &player->cancel);
+        }
+
+        // Stopped early: the clock says how far it got, unless it never started; the notes still sounding are let go
+        const bool cancelled = ok && atomic_load_explicit(&player->cancel, memory_order_relaxed);
+        uint64_t position = 0;
+        if (cancelled) {
+            MidiClock clock;
+            midi_metrics_clock(options.metrics, &clock);
+            position = clock.start_ns ? clock.song_ns : start_ns;
+            silence_player_sinks(player->sinks, player->sink_count);
+        }
+
+        pthread_mutex_lock(&player->lock);
+        atomic_store_explicit(&player->position_ns, position, memory_order_relaxed);
+        atomic_store_explicit(&player->state, cancelled ? MIDI_PLAYER_PAUSED : MIDI_PLAYER_STOPPED, memory_order_release);
+        player->busy = false;
+        pthread_cond_broadcast(&player->idle);
+    }
+    pthread_mutex_unlock(&player->lock);
+    return NULL;
+}
+
+// With the lock held: cancel a play in progress or about to start and wait for it to end. Returns whether there was one.
+static bool halt_player(MidiPlayer* player) {
+    const bool playing = player->requested || player->busy;
+    player->requested = false;
+    if (player->busy) {
+        atomic_store_explicit(&player->cancel, true, memory_order_relaxed);
+        while (player->busy) pthread_cond_wait(&player->idle, &player->lock);
+    }
+    return playing;
+}
+
+// Opens the sinks for the player's lifetime. The options are copied; their metrics, if any, must outlive the player.
+MidiPlayer* CreateMIDIPlayer(const MidiPlayerOptions* options, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback,
+    const NotePerSecondCallback note_per_second_callback) {
+    MidiPlayer* player = calloc(1, sizeof(MidiPlayer));
+    if (!player) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    player->options = *options;
+    player->note_on_callback = note_on_callback;
+    player->note_off_callback = note_off_callback;
+    player->note_per_second_callback = note_per_second_callback;
+
+    // The position of a paused song comes from the clock, so there always are metrics
+    if (!player->options.metrics) {
+        player->owned_metrics = aligned_alloc(64, sizeof(MidiMetrics));
+        if (!player->owned_metrics) {
+            fprintf(stderr, "Memory allocation failed\n");
+            free(player);
+            return NULL;
+        }
+        midi_metrics_reset(player->owned_metrics);
+        player->options.metrics = player->owned_metrics;
+    }
+
+    player->sink_count = open_player_sinks(&player->options, player->sinks);
+    if (player->sink_count == 0) {
+        free(player->owned_metrics);
+        free(player);
+        return NULL;
+    }
+
+    atomic_init(&player->position_ns, 0);
+    atomic_init(&player->state, MIDI_PLAYER_EMPTY);
+    atomic_init(&player->cancel, false);
+    pthread_mutex_init(&player->lock, NULL);
+    pthread_cond_init(&player->wake, NULL);
+    pthread_cond_init(&player->idle, NULL);
+    if (pthread_create(&player->thread, NULL, player_thread, player) != 0) {
+        fprintf(stderr, "Could not start the player thread\n");
+        pthread_cond_destroy(&player->idle);
+        pthread_cond_destroy(&player->wake);
+        pthread_mutex_destroy(&player->lock);
+        close_player_sinks(player->sinks, player->sink_count);
+        free(player->owned_metrics);
+        free(player);
+        return NULL;
+    }
+    return player;
+}
+
+void DestroyMIDIPlayer(MidiPlayer* player) {
+    if (!player) return;
+
+    pthread_mutex_lock(&player->lock);
+    halt_player(player);
+    player->quit = true;
+    pthread_cond_signal(&player->wake);
+    pthread_mutex_unlock(&player->lock);
+    pthread_join(player->thread, NULL);
+
+    if (player->song) release_prepared_song(player->song);
+    close_player_sinks(player->sinks, player->sink_count);
+    pthread_cond_destroy(&player->idle);
+    pthread_cond_destroy(&player->wake);
+    pthread_mutex_destroy(&player->lock);
+    free(player->owned_metrics);
+    free(player);
+}
+
+// Replaces whatever was loaded, stopping it first, and goes to the options' start. The song is decoded once,
+// with a seek index, for every later play.
+bool MIDIPlayerLoad(MidiPlayer* player, char* file) {
+    pthread_mutex_lock(&player->lock);
+    halt_player(player);
+    if (player->song) release_prepared_song(player->song);
+
+    player->song = prepare_song(file, &player->options, true);
+    player->rewind = false;
+    atomic_store_explicit(&player->position_ns, (uint64_t)player->options.start_ms * 1000000ULL, memory_order_relaxed);
+    atomic_store_explicit(&player->state, player->song ? MIDI_PLAYER_STOPPED : MIDI_PLAYER_EMPTY, memory_order_release);
+    const bool ok = player->song != NULL;
+    pthread_mutex_unlock(&player->lock);
+    return ok;
+}
+
+// Start or resume from the current position and return right away; the song plays on the player's thread
+bool MIDIPlayerPlay(MidiPlayer* player) {
+    pthread_mutex_lock(&player->lock);
+    const bool ok = player->song != NULL;
+    if (ok && !player->requested && !player->busy) {
+        player->requested = true;
+        atomic_store_explicit(&player->state, MIDI_PLAYER_PLAYING, memory_order_release);
+        pthread_cond_signal(&player->wake);
+    }
+    pthread_mutex_unlock(&player->lock);
+    return ok;
+}
+
+// Returns once playback has stopped and its notes have been let go
+void MIDIPlayerPause(MidiPlayer* player) {
+    pthread_mutex_lock(&player->lock);
+    if (halt_player(player) && atomic_load_explicit(&player->state, memory_order_relaxed) == MIDI_PLAYER_PLAYING) {
+        atomic_store_explicit(&player->state, MIDI_PLAYER_PAUSED, memory_order_release);
+    }
+    pthread_mutex_unlock(&player->lock);
+}
+
+void MIDIPlayerStop(MidiPlayer* player) {
+    pthread_mutex_lock(&player->lock);
+    halt_player(player);
+    if (player->song) {
+        atomic_store_explicit(&player->position_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&player->state, MIDI_PLAYER_STOPPED, memory_order_release);
+    }
+    pthread_mutex_unlock(&player->lock);
+}
+
+// Move to time_ns into the song, to the millisecond. A playing song goes on from there; channel state and
+// the notes sounding at that point are restored when it next plays.
+bool MIDIPlayerSeek(MidiPlayer* player, const uint64_t time_ns) {
+    pthread_mutex_lock(&player->lock);
+    const bool ok = player->song != NULL;
+    if (ok) {
+        const bool playing = halt_player(player);
+        atomic_store_explicit(&player->position_ns, time_ns, memory_order_relaxed);
+        if (playing) {
+            player->requested = true;
+            atomic_store_explicit(&player->state, MIDI_PLAYER_PLAYING, memory_order_release);
+            pthread_cond_signal(&player->wake);
+        } else {
+            atomic_store_explicit(&player->state, time_ns ? MIDI_PLAYER_PAUSED : MIDI_PLAYER_STOPPED, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&player->lock);
+    return ok;
+}
+
+// Song time: the clock while a play runs, otherwise where the next one starts
+uint64_t MIDIPlayerPosition(MidiPlayer* player) {
+    if (atomic_load_explicit(&player->state, memory_order_acquire) == MIDI_PLAYER_PLAYING) {
+        MidiClock clock;
+        midi_metrics_clock(player->options.metrics, &clock);
+        if (clock.playing) return clock.song_ns;
+    }
+    return atomic_load_explicit(&player->position_ns, memory_order_relaxed);
+}
+
+MidiPlayerState MIDIPlayerGetState(MidiPlayer* player) {
+    return (MidiPlayerState)atomic_load_explicit(&player->state, memory_order_acquire);
+}
+
+// Counters of the current or last play; every play starts them over
+void MIDIPlayerStats(MidiPlayer* player, MidiMetricsSnapshot* snapshot) {
+    midi_metrics_snapshot(player->options.metrics, snapshot);
+}
@@ -6,6 +6,9 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "midisink.h"
+#include "midimetrics.h"
+
 // Track data structure
 typedef struct {
     uint8_t* data;
@@ -16,15 +19,350 @@ typedef struct {
     size_t long_msg_len;
     size_t long_msg_capacity;
     size_t data_capacity;
+    bool owns_data;     // false when data/long_msg point into a MidiMapping
 } TrackData;
 
+// Read-only mapping of a whole MIDI file, shared by all of its tracks
+typedef struct {
+    uint8_t* base;
+    size_t size;        // Whole mapping, with the zeroed pages past the end of the file
+} MidiMapping;
+
+// Largest meta table index that fits in a PackedEvent message
+#define PACKED_META_INDEX_MAX 0xFFFFFF
+
+// Pre-decoded event. Channel messages are stored as the packed short message;
+// Meta/SysEx keep their status byte in the low 8 bits and a PackedTrack.metas index above it.
+typedef struct {
+    uint32_t tick;      // Absolute tick
+    uint32_t message;
+} PackedEvent;
+
+// Meta/SysEx payload, split out of the event stream
+typedef struct {
+    uint32_t offset;    // Into PackedTrack.payload
+    uint32_t length;
+    uint32_t tick;      // Absolute tick of the event
+    uint8_t status;     // 0xFF or 0xF0
+    uint8_t type;       // Meta type, 0 for SysEx
+} PackedMeta;
+
+// Track decoded ahead of playback into flat arrays
+typedef struct {
+    PackedEvent* events;
+    size_t event_count;
+    PackedMeta* metas;
+    size_t meta_count;
+    uint8_t* payload;
+    size_t payload_size;
+} PackedTrack;
+
+// How the player finds the tracks that are due on each step
+typedef enum {
+    MIDI_SCHEDULER_LINEAR,  // Scan every track; best when nearly all tracks are busy
+    MIDI_SCHEDULER_HEAP,    // Min-heap keyed by next tick; cost scales with due tracks only
+} MidiScheduler;
+
+// Most player workers in sharded playback
+#define MIDI_MAX_SHARDS MIDI_METRICS_SHARDS
+
+// How sharded playback splits a song between its workers
+typedef enum {
+    MIDI_SHARD_TRACKS,      // Whole tracks, balanced by event count; a merged timeline is split by channel instead
+    MIDI_SHARD_CHANNELS,    // Channel c goes to worker c % shards
+} MidiShardMode;
+
+// Per-track counts from the statistics pass; exactly what pack_track will store
+typedef struct {
+    size_t event_count;         // Channel, meta and SysEx events
+    size_t meta_count;
+    size_t payload_size;        // Meta/SysEx payload bytes
+    size_t largest_payload;
+    uint64_t note_on_count;
+    uint64_t note_off_count;
+    uint64_t last_tick;
+} TrackStats;
+
+// Whole-file statistics, gathered at load time
+typedef struct {
+    uint64_t event_count;
+    uint64_t note_on_count;
+    uint64_t note_off_count;
+    uint64_t peak_polyphony;    // Upper bound on notes sounding at once, at resolution_ns; note-offs match within their track
+    uint64_t peak_nps;          // Most note-ons in any one-second window
+    uint64_t peak_burst;        // Most note-ons and note-offs in any one bucket of resolution_ns, such as a chord on one tick
+    size_t largest_payload;     // Biggest meta/SysEx payload in bytes
+    uint64_t last_tick;
+    uint64_t duration_ns;
+    uint64_t resolution_ns;     // Bucket size the peaks were measured at
+    TrackStats* tracks;         // track_count entries
+    int track_count;
+} MidiFileStats;
+
+typedef void (*MidiStatsCallback)(const MidiFileStats* stats);
+
+// Most notes handed to a NoteBatchCallback in one call
+#define NOTE_BATCH_SIZE 512
+
+// Note as delivered to a NoteBatchCallback
+typedef struct {
+    uint64_t time_ns;           // When the note was due, in song time since playback started: MidiClock.elapsed_ns
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;           // 0 for a note-off
+} MidiNoteEvent;
+
+// Called on the playback thread with the notes of each dispatch step, before the limiter.
+// In sharded playback it runs on the workers, one call at a time.
+typedef void (*NoteBatchCallback)(const MidiNoteEvent* events, size_t count);
+
+// Read-only cursor over a playing song's pre-decoded notes, for drawing them ahead of the playhead.
+// Keeps the song alive until it is closed.
+typedef struct MidiRoll MidiRoll;
+
+// Called on the playback thread as each song starts, with a roll that is the callee's to close
+typedef void (*MidiRollCallback)(MidiRoll* roll);
+
+// What an offline run measured, all in wall-clock time
+typedef struct {
+    uint64_t load_ns;           // File, statistics and pre-decoding, or opening the cache
+    uint64_t prepare_ns;        // Tempo map, sequencer, seek index and cache write
+    uint64_t schedule_ns;       // Sequencer steps
+    uint64_t dispatch_ns;       // Callbacks, limiter and sink
+    uint64_t play_ns;
+    uint64_t total_ns;
+    uint64_t song_ns;           // Song time played; short of the whole song if the run was cut off
+    uint64_t events;            // Messages the sequencer produced
+    double events_per_second;   // Over play_ns
+    double speed;               // song_ns / total_ns, in multiples of real time
+    bool too_slow;              // Below offline_min_speed
+} MidiOfflineReport;
+
+// Playback options
+typedef struct {
+    bool use_mmap;              // Map the file instead of copying every track into its own buffer
+    bool predecode;             // Decode every track into PackedTrack arrays before playback starts
+    int decode_threads;         // Threads used for pre-decoding, 0 for one per CPU
+    bool merge_timeline;        // Merge all tracks into one time-ordered array (implies predecode, costs RAM)
+    MidiScheduler scheduler;
+    uint32_t lookahead_ms;      // Parse this far ahead of real time on a producer thread, 0 to play directly
+    size_t lookahead_events;    // Capacity of the lookahead buffer, rounded up to a power of two
+    uint32_t start_ms;          // Start playback this far into the song
+    uint32_t seek_interval_ms;  // Snapshot spacing of the seek index; grows to fit seek_index_bytes
+    size_t seek_index_bytes;    // Memory budget of the seek index
+    bool collect_stats;         // Run the statistics pass before playback; implied by the limits below
+    uint64_t max_note_ons;      // Refuse files with more note-ons than this, 0 for no limit
+    uint64_t max_polyphony;     // Refuse files whose peak polyphony is higher, 0 for no limit
+    uint64_t max_nps;           // Refuse files whose peak notes per second are higher, 0 for no limit
+    MidiStatsCallback stats_callback; // Called with the statistics before playback starts, or NULL
+    bool use_cache;             // Reopen from a pre-decoded cache file, writing it on the first run (implies predecode)
+    const char* cache_dir;      // Where cache files go, NULL to keep them next to the MIDI file
+    MidiSinkType sink;          // Output backend
+    const char* sink_device;    // OmniMIDI library path or ALSA "client:port", NULL for the default
+    uint32_t spin_us;           // Spin this long before each deadline instead of sleeping, for μs accuracy at the cost of CPU
+    bool realtime;              // SCHED_FIFO playback threads and locked song memory; falls back when not permitted
+    int realtime_priority;      // SCHED_FIFO priority of the dispatcher; the lookahead producer runs one below
+    int dispatch_cpu;           // Core the dispatching thread is pinned to in real-time mode, -1 for any; shard worker i gets the one i above
+    int producer_cpu;           // Core the lookahead producer is pinned to in real-time mode, -1 for any
+    uint8_t min_velocity;       // Note-ons below this velocity never reach the synth
+    bool drop_duplicate_notes;  // Drop note-ons for a channel+key that is already sounding
+    uint32_t max_notes_per_key_ms; // Note-ons per channel+key per millisecond, 0 for no limit
+    uint32_t nps_ceiling;       // Note-ons per second sent to the synth, quietest dropped first; 0 for no limit
+    bool offline;               // Play as fast as possible without waiting for deadlines; lookahead and real-time mode are ignored
+    double offline_min_speed;   // Offline: fail files that don't play at least this many times faster than real time, 0 for no limit
+    MidiOfflineReport* offline_report; // Offline: filled in after the run, or NULL
+    NoteBatchCallback note_batch_callback; // Takes the place of the per-note callbacks when set
+    MidiMetrics* metrics;       // Filled live during playback for the caller to poll, or NULL; also the playback clock
+    const char* metrics_path;   // Write a metrics row here every metrics_interval_ms, NULL for none
+    MidiMetricsFormat metrics_format;
+    uint32_t metrics_interval_ms; // Also how often the notes per second callback runs
+    uint64_t preload_bytes;     // Playlist: most memory the next song may take while the current one plays
+    MidiRollCallback roll_callback; // Hands out a MidiRoll per song, or NULL; needs predecode, merge_timeline or use_cache
+    int shards;                 // Player workers, each with a sink of its own; 0 or 1 plays on one thread. Needs pre-decoded tracks
+    MidiShardMode shard_by;
+    const char* shard_devices;  // Comma-separated sink device per worker, sink_device where an entry is missing or empty
+    uint32_t shard_tolerance_us; // How far ahead of the slowest worker another may send
+} MidiPlayerOptions;
+
+// Function pointer type for SendDirectData
+typedef void (*SendDirectDataFunc)(uint32_t);
+
+// Tempo used until the first 0x51 event, in microseconds per quarter note (120 BPM)
+#define MIDI_DEFAULT_TEMPO 500000
+
+// Tempo segment: from tick on, every quarter note lasts usec_per_quarter
+typedef struct {
+    uint64_t tick;
+    uint64_t time_ns;           // Playback time at tick
+    uint32_t usec_per_quarter;
+} TempoEntry;
+
+// Every tempo change of a song, for converting between ticks and playback time
+typedef struct {
+    TempoEntry* entries;        // Sorted by tick; entries[0] is always at tick 0
+    size_t count;
+    uint16_t time_div;
+} TempoMap;
+
+inline __attribute__((always_inline)) static uint64_t tempo_entry_time_ns(const TempoEntry* entry, const uint16_t time_div, const uint64_t tick) {
+    return entry->time_ns + (uint64_t)((unsigned __int128)(tick - entry->tick) * entry->usec_per_quarter * 1000 / time_div);
+}
+
+// Binary min-heap of (tick << 32 | track index) keys, so equal ticks pop in track order
+typedef struct {
+    uint64_t* keys;
+    int count;
+} TrackHeap;
+
+// Walks either streaming or pre-decoded tracks and hands out the channel messages due on each tick
+typedef struct {
+    MidiScheduler scheduler;
+    TrackData* tracks;          // Streaming source, or NULL
+    const PackedTrack* packed;  // Pre-decoded source, or NULL
+    int track_count;
+    size_t* cursors;            // Next event of each packed track
+    TrackHeap heap;
+    uint64_t tick;              // Tick of the current batch
+    uint64_t next_tick;
+    uint64_t delta_tick;        // Ticks until the next batch
+    uint64_t time_ns;           // Playback time of the current batch
+    const TempoMap* tempo_map;
+    size_t tempo_index;         // Tempo segment the current batch falls in
+    uint64_t origin_ns;         // Song time playback started from, 0 unless seeked
+    bool done;
+    bool notes_only;            // Hand out note-ons and note-offs only, for the piano roll
+    uint32_t* messages;         // Channel messages due at tick
+    size_t message_count;
+    size_t message_capacity;
+} Sequencer;
+
+#define MIDI_CHANNELS 16
+
+#define CHANNEL_PROGRAM_SET 0x01
+#define CHANNEL_PITCH_SET 0x02
+
+// Most messages channel_state_messages can produce
+#define CHANNEL_STATE_MAX_MESSAGES (MIDI_CHANNELS * (1 + 128 + 1 + 128))
+
+// What a synth channel looks like at some point in the song
+typedef struct {
+    uint8_t controllers[128];
+    uint8_t notes[128];         // Velocity of each sounding key, 0 when off
+    uint32_t controller_set[4]; // Bitmask of controllers that have been sent
+    uint16_t pitch_bend;
+    uint8_t program;
+    uint8_t flags;              // CHANNEL_PROGRAM_SET | CHANNEL_PITCH_SET
+} ChannelState;
+
+#define TRACK_POSITION_ENDED UINT64_MAX
+
+// Where a track was when a snapshot was taken
+typedef struct {
+    uint64_t offset;            // Byte offset for streaming tracks, event index for packed tracks
+    uint32_t tick;
+    uint32_t message;           // Running-status message
+} TrackPosition;
+
+typedef struct {
+    uint64_t tick;              // Next tick to play when resuming from this snapshot
+    uint64_t time_ns;
+} SeekPoint;
+
+// Resume snapshots taken at fixed intervals through the song
+typedef struct {
+    SeekPoint* points;
+    TrackPosition* positions;   // track_count per snapshot
+    ChannelState* channels;     // MIDI_CHANNELS per snapshot
+    size_t count;
+    size_t capacity;
+    int track_count;
+    uint64_t interval_ns;
+    uint8_t** track_data;       // Start of every streaming track, restored on seek
+    size_t* track_length;
+    uint8_t** owned;            // Track buffers taken over from the loader, freed with the index
+    size_t owned_count;
+} SeekIndex;
+
 // Callback function types
 typedef void (*NoteOnCallback)(uint8_t channel, uint8_t note, uint8_t velocity);
 typedef void (*NoteOffCallback)(uint8_t channel, uint8_t note);
 
 typedef void (*NotePerSecondCallback)(uint64_t note_per_second);
 
+// Loading
+TrackData* load_midi_file(const char* filename, uint16_t* time_div, int* track_count);
+TrackData* load_midi_file_mapped(const char* filename, uint16_t* time_div, int* track_count, MidiMapping* mapping);
+void unmap_midi_file(MidiMapping* mapping);
+void free_track_data(TrackData* track);
+int decode_variable_length(TrackData* track);
+
+// Pre-decoding
+int default_thread_count();
+bool pack_track(TrackData* track, const TrackStats* sizes, PackedTrack* packed);
+PackedTrack* pack_tracks(TrackData* tracks, int track_count, int thread_count, const TrackStats* sizes);
+void free_packed_track(PackedTrack* packed);
+void free_packed_tracks(PackedTrack* packed, int track_count);
+bool merge_tracks(const PackedTrack* tracks, int track_count, PackedTrack* merged);
+
+// Tempo
+bool build_tempo_map_packed(const PackedTrack* tracks, int track_count, uint16_t time_div, TempoMap* map);
+bool build_tempo_map_tracks(const TrackData* tracks, int track_count, uint16_t time_div, int thread_count, TempoMap* map);
+size_t tempo_map_find(const TempoMap* map, uint64_t tick);
+uint64_t tempo_map_time_ns(const TempoMap* map, uint64_t tick);
+uint64_t tempo_map_tick_at(const TempoMap* map, uint64_t time_ns);
+void free_tempo_map(TempoMap* map);
+
+// Statistics
+bool scan_midi_stats(const TrackData* tracks, int track_count, uint16_t time_div, int thread_count, TempoMap* tempo_map, MidiFileStats* stats);
+void free_midi_stats(MidiFileStats* stats);
+
+// Scheduling
+bool sequencer_init_tracks(Sequencer* seq, TrackData* tracks, int track_count, const TempoMap* tempo_map, MidiScheduler scheduler);
+bool sequencer_init_packed(Sequencer* seq, const PackedTrack* tracks, int track_count, const TempoMap* tempo_map, MidiScheduler scheduler);
+void sequencer_step(Sequencer* seq);
+void sequencer_free(Sequencer* seq);
+
+// Seeking
+bool build_seek_index(Sequencer* seq, uint32_t interval_ms, size_t max_bytes, SeekIndex* index);
+bool sequencer_seek(Sequencer* seq, const SeekIndex* index, uint64_t time_ns, ChannelState* channels);
+size_t channel_state_messages(const ChannelState* channels, uint32_t* messages);
+void free_seek_index(SeekIndex* index);
+
 // Public function
+void InitMIDIPlayerOptions(MidiPlayerOptions* options);
 bool PlayMIDI(char* file, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback);
+bool PlayMIDIWithOptions(char* file, const MidiPlayerOptions* options, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback);
+bool PlayMIDIPlaylist(char** files, int file_count, const MidiPlayerOptions* options, const NoteOnCallback note_on_callback, const NoteOffCallback note_off_callback, const NotePerSecondCallback note_per_second_callback);
+MidiRoll* OpenMIDIRoll(char* file, const MidiPlayerOptions* options);
+
+// Player handle: the sinks stay open and a loaded song stays decoded across plays, and playback runs on a
+// thread of the player's own, so the caller keeps control. Every call but DestroyMIDIPlayer may come from any
+// thread; the calls that change what plays wait for playback to stop first.
+typedef struct MidiPlayer MidiPlayer;
+
+typedef enum {
+    MIDI_PLAYER_EMPTY,          // Nothing loaded
+    MIDI_PLAYER_STOPPED,        // At the start, or back there after the song ended
+    MIDI_PLAYER_PLAYING,
+    MIDI_PLAYER_PAUSED,
+} MidiPlayerState;
+
+MidiPlayer* CreateMIDIPlayer(const MidiPlayerOptions* options, NoteOnCallback note_on_callback, NoteOffCallback note_off_callback, NotePerSecondCallback note_per_second_callback);
+void DestroyMIDIPlayer(MidiPlayer* player);
+bool MIDIPlayerLoad(MidiPlayer* player, char* file);
+bool MIDIPlayerPlay(MidiPlayer* player);
+void MIDIPlayerPause(MidiPlayer* player);
+void MIDIPlayerStop(MidiPlayer* player);
+bool MIDIPlayerSeek(MidiPlayer* player, uint64_t time_ns);
+uint64_t MIDIPlayerPosition(MidiPlayer* player);
+MidiPlayerState MIDIPlayerGetState(MidiPlayer* player);
+void MIDIPlayerStats(MidiPlayer* player, MidiMetricsSnapshot* snapshot);
+
+// Piano roll
+MidiRoll* midi_roll_copy(const MidiRoll* roll);
+size_t midi_roll_read(MidiRoll* roll, uint64_t until_ns, MidiNoteEvent* notes, size_t max);
+uint64_t midi_roll_origin_ns(const MidiRoll* roll);
+bool midi_roll_done(const MidiRoll* roll);
+void midi_roll_close(MidiRoll* roll);
 
 #endif
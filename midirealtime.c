@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "midirealtime.h"
+
+_Static_assert(sizeof(cpu_set_t) == sizeof(((MidiThreadState*)0)->cpus), "cpu_set_t size");
+
+// Switch the calling thread to SCHED_FIFO and pin it. Each step that isn't permitted is reported
+// and skipped, so playback always goes ahead. Returns true if everything asked for was applied.
+bool midi_thread_apply(const MidiThreadPolicy* policy, const char* role, MidiThreadState* saved) {
+    const pthread_t self = pthread_self();
+    bool ok = true;
+    memset(saved, 0, sizeof(MidiThreadState));
+
+    if (policy->priority > 0) {
+        struct sched_param param;
+        pthread_getschedparam(self, &saved->policy, &param);
+        saved->priority = param.sched_priority;
+
+        const int min = sched_get_priority_min(SCHED_FIFO);
+        const int max = sched_get_priority_max(SCHED_FIFO);
+        param.sched_priority = policy->priority < min ? min : policy->priority > max ? max : policy->priority;
+
+        const int err = pthread_setschedparam(self, SCHED_FIFO, &param);
+        if (err == 0) {
+            saved->scheduled = true;
+        } else {
+            fprintf(stderr, "Cannot run the %s thread at SCHED_FIFO %d (%s), keeping normal priority\n",
+                role, param.sched_priority, strerror(err));
+            ok = false;
+        }
+    }
+
+    if (policy->cpu >= 0) {
+        cpu_set_t cpus;
+        pthread_getaffinity_np(self, sizeof(cpu_set_t), &cpus);
+        memcpy(saved->cpus, &cpus, sizeof(cpu_set_t));
+
+        CPU_ZERO(&cpus);
+        CPU_SET(policy->cpu, &cpus);
+        const int err = policy->cpu < CPU_SETSIZE ? pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpus) : EINVAL;
+        if (err == 0) {
+            saved->pinned = true;
+        } else {
+            fprintf(stderr, "Cannot pin the %s thread to CPU %d (%s)\n", role, policy->cpu, strerror(err));
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+void midi_thread_restore(const MidiThreadState* saved) {
+    const pthread_t self = pthread_self();
+
+    if (saved->scheduled) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = saved->priority;
+        pthread_setschedparam(self, saved->policy, &param);
+    }
+
+    if (saved->pinned) {
+        cpu_set_t cpus;
+        memcpy(&cpus, saved->cpus, sizeof(cpu_set_t));
+        pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpus);
+    }
+}
+
+// Lock every page the process has mapped right now, which also faults them all in.
+// MCL_FUTURE is left out on purpose: with it every later allocation counts against RLIMIT_MEMLOCK.
+bool midi_lock_all_memory() {
+    return mlockall(MCL_CURRENT) == 0;
+}
+
+// Fallback for a single buffer: lock it, or at least take its page faults now instead of during playback
+bool midi_lock_region(const void* data, const size_t size) {
+    if (!data || size == 0) return true;
+    if (mlock(data, size) == 0) return true;
+
+    const long page = sysconf(_SC_PAGESIZE);
+    const volatile uint8_t* bytes = (const volatile uint8_t*)data;
+    for (size_t i = 0; i < size; i += (size_t)page) {
+        (void)bytes[i];
+    }
+    (void)bytes[size - 1];
+    return false;
+}
+
+void midi_unlock_memory() {
+    munlockall();
+}
@@ -0,0 +1,31 @@
+// midi_realtime.h
+#ifndef MIDI_REALTIME_H
+#define MIDI_REALTIME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// How a playback thread should be scheduled
+typedef struct {
+    int priority;               // SCHED_FIFO priority 1-99, 0 to keep the normal scheduler
+    int cpu;                    // Core to pin the thread to, -1 for any
+} MidiThreadPolicy;
+
+// What a thread looked like before midi_thread_apply, so it can be put back
+typedef struct {
+    int policy;
+    int priority;
+    bool scheduled;             // Scheduler was changed
+    bool pinned;                // Affinity was changed
+    uint64_t cpus[16];          // cpu_set_t
+} MidiThreadState;
+
+bool midi_thread_apply(const MidiThreadPolicy* policy, const char* role, MidiThreadState* saved);
+void midi_thread_restore(const MidiThreadState* saved);
+
+bool midi_lock_all_memory();
+bool midi_lock_region(const void* data, size_t size);
+void midi_unlock_memory();
+
+#endif
@@ -0,0 +1,129 @@
+// midi_ring.h
+#ifndef MIDI_RING_H
+#define MIDI_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define MIDI_EVENT_NOTE_ON 0x01
+
+// Note event handed from the MIDI thread to the renderer
+typedef struct {
+    uint32_t time_us;   // Song time the player scheduled the note for, wrapping every 71 minutes
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+    uint8_t flags;      // MIDI_EVENT_NOTE_ON
+} MidiEvent;
+
+_Static_assert(sizeof(MidiEvent) == 8, "MidiEvent size");
+
+// Lock-free ring from one producer thread to one consumer thread.
+// Indices run freely and are masked on access, so all capacity slots are usable.
+// The producer can move to a bigger buffer; the consumer follows once it has read everything before the move.
+typedef struct {
+    MidiEvent* events;                  // Producer's buffer, from malloc
+    uint32_t mask;
+    atomic_bool ready;                  // Both buffers are set
+    _Atomic(MidiEvent*) grown;          // Buffer the producer moved to, until the consumer takes it
+    uint32_t grown_mask;
+    uint32_t grown_at;                  // Head when the producer moved
+    _Alignas(64) atomic_uint head;      // Written by the producer
+    uint32_t tail_cache;                // Producer's last look at tail
+    _Alignas(64) atomic_uint tail;      // Written by the consumer
+    uint32_t head_cache;                // Consumer's last look at head
+    MidiEvent* read_events;             // Consumer's buffer
+    uint32_t read_mask;
+} EventRing;
+
+inline __attribute__((always_inline)) static void event_ring_init(EventRing* ring) {
+    ring->events = NULL;
+    ring->mask = 0;
+    ring->read_events = NULL;
+    ring->read_mask = 0;
+    ring->grown_mask = 0;
+    ring->grown_at = 0;
+    ring->tail_cache = 0;
+    ring->head_cache = 0;
+    atomic_init(&ring->ready, false);
+    atomic_init(&ring->grown, NULL);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+// capacity must be a power of two; either side may already be polling
+inline __attribute__((always_inline)) static void event_ring_publish(EventRing* ring, MidiEvent* events, const uint32_t capacity) {
+    ring->events = events;
+    ring->mask = capacity - 1;
+    ring->read_events = events;
+    ring->read_mask = capacity - 1;
+    atomic_store_explicit(&ring->ready, true, memory_order_release);
+}
+
+// Producer only, between pushes. New events go to the bigger buffer; the consumer frees the old one when it
+// moves over. Returns false while the consumer has yet to take the previous one.
+inline __attribute__((always_inline)) static bool event_ring_grow(EventRing* ring, MidiEvent* events, const uint32_t capacity) {
+    if (atomic_load_explicit(&ring->grown, memory_order_acquire) != NULL) return false;
+
+    ring->grown_at = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->grown_mask = capacity - 1;
+    ring->events = events;
+    ring->mask = capacity - 1;
+    atomic_store_explicit(&ring->grown, events, memory_order_release);
+    return true;
+}
+
+// Returns how many of the events fit; the rest are dropped
+inline __attribute__((always_inline)) static size_t event_ring_push_batch(EventRing* ring, const MidiEvent* events, const size_t count) {
+    if (!atomic_load_explicit(&ring->ready, memory_order_acquire)) return 0;
+
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const uint32_t capacity = ring->mask + 1;
+    uint32_t space = capacity - (head - ring->tail_cache);
+    if (space < count) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        space = capacity - (head - ring->tail_cache);
+    }
+
+    const uint32_t n = count < space ? (uint32_t)count : space;
+    for (uint32_t i = 0; i < n; i++) {
+        ring->events[(head + i) & ring->mask] = events[i];
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    return n;
+}
+
+// Returns how many events were copied to events, at most max
+inline __attribute__((always_inline)) static size_t event_ring_pop_batch(EventRing* ring, MidiEvent* events, const size_t max) {
+    if (!atomic_load_explicit(&ring->ready, memory_order_acquire)) return 0;
+
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    MidiEvent* grown = atomic_load_explicit(&ring->grown, memory_order_acquire);
+    if (grown && tail == ring->grown_at) {
+        free(ring->read_events);
+        ring->read_events = grown;
+        ring->read_mask = ring->grown_mask;
+        atomic_store_explicit(&ring->grown, NULL, memory_order_release);
+        grown = NULL;
+    }
+
+    uint32_t available = ring->head_cache - tail;
+    if (available == 0) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        available = ring->head_cache - tail;
+    }
+    // Events from the move on are in the new buffer
+    if (grown && available > ring->grown_at - tail) available = ring->grown_at - tail;
+
+    const uint32_t n = available < max ? available : (uint32_t)max;
+    for (uint32_t i = 0; i < n; i++) {
+        events[i] = ring->read_events[(tail + i) & ring->read_mask];
+    }
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    return n;
+}
+
+#endif
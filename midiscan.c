@@ -0,0 +1,313 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "midiscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIDI_SCAN_X86 1
+#endif
+
+enum {
+    SCAN_MORE,
+    SCAN_END,                   // End-of-track
+    SCAN_FAILED,                // The callback gave up
+};
+
+typedef struct {
+    const uint8_t* data;
+    size_t length;
+    size_t offset;
+    uint32_t tick;              // The regular decoder's int, wrapping the same way
+    uint8_t status;             // Running status
+    TrackStats stats;
+    MidiScanMetaCallback meta_callback;
+    void* context;
+} ScanState;
+
+// Bit i of high is the top bit of the byte at base + i
+typedef struct {
+    size_t base;
+    uint64_t high;
+} ScanWindow;
+
+typedef uint64_t (*ClassifyFunc)(const uint8_t* bytes);
+
+#ifdef MIDI_SCAN_X86
+__attribute__((target("sse2"))) static inline uint64_t classify_sse2(const uint8_t* bytes) {
+    uint64_t high = 0;
+    for (int i = 0; i < MIDI_SCAN_WINDOW / 16; i++) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)(bytes + i * 16));
+        high |= (uint64_t)(uint16_t)_mm_movemask_epi8(chunk) << (i * 16);
+    }
+    return high;
+}
+
+__attribute__((target("avx2"))) static inline uint64_t classify_avx2(const uint8_t* bytes) {
+    const __m256i low = _mm256_loadu_si256((const __m256i*)bytes);
+    const __m256i high = _mm256_loadu_si256((const __m256i*)(bytes + 32));
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(low) | (uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32;
+}
+#endif
+
+// decode_variable_length on a window-less cursor: stops at the end of the track even mid-quantity
+inline __attribute__((always_inline)) static uint32_t scalar_vlq(ScanState* s) {
+    uint32_t result = 0;
+    if (s->offset >= s->length) return 0;
+    uint8_t byte;
+    do {
+        byte = s->data[s->offset++];
+        result = (result << 7) | (byte & 0x7F);
+    } while ((byte & 0x80) && s->offset < s->length);
+    return result;
+}
+
+// A quantity of size bytes, 1 to 4, gathered from one 32-bit load and no branches
+inline __attribute__((always_inline)) static uint32_t vlq_word(const uint8_t* bytes, const unsigned size) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    word = __builtin_bswap32(word);
+    const uint32_t value = (word >> 3 & 0x0FE00000) | (word >> 2 & 0x001FC000) | (word >> 1 & 0x00003F80) | (word & 0x7F);
+    return value >> (7 * (4 - size));
+}
+
+// The run of set top bits from the cursor is the quantity's length, less one. Longer than 4 bytes, or too close
+// to the end of the track for a window, it goes a byte at a time.
+inline __attribute__((always_inline)) static uint32_t window_vlq(ScanState* s, ScanWindow* window, const ClassifyFunc classify) {
+    if (s->offset + 4 > window->base + MIDI_SCAN_WINDOW) {
+        if (s->offset + MIDI_SCAN_WINDOW > s->length) return scalar_vlq(s);
+        window->base = s->offset;
+        window->high = classify(s->data + s->offset);
+    }
+    const uint64_t high = window->high >> (s->offset - window->base);
+    if (!(high & 1)) return s->data[s->offset++];
+    const unsigned run = (unsigned)__builtin_ctzll(~high);
+    if (run >= 4) return scalar_vlq(s);
+    const uint32_t value = vlq_word(s->data + s->offset, run + 1);
+    s->offset += run + 1;
+    return value;
+}
+
+// The regular decoder reads the missing bytes of a truncated last event past the end; they count as 0 here
+inline __attribute__((always_inline)) static uint8_t scan_byte(const ScanState* s, const size_t offset, const bool windowed) {
+    if (windowed) return s->data[offset];
+    return offset < s->length ? s->data[offset] : 0;
+}
+
+// One event and the delta after it, counted exactly as scan_track always has: update_command, update_message,
+// then update_tick. Without a classifier every byte is looked at on its own.
+inline __attribute__((always_inline)) static int scan_event(ScanState* s, ScanWindow* window, const ClassifyFunc classify) {
+    const bool windowed = classify != NULL;
+
+    const uint8_t lead = s->data[s->offset];
+    if (lead >= 0x80) {
+        s->offset++;
+        s->status = lead;
+    }
+
+    const uint8_t status = s->status;
+    if (status < 0xC0 || (status >= 0xE0 && status < 0xF0)) {
+        const uint8_t velocity = scan_byte(s, s->offset + 1, windowed);
+        s->offset += 2;
+        s->stats.event_count++;
+        const uint8_t type = status & 0xF0;
+        if (windowed) {
+            // Whether a note starts or ends is as good as random, so it is counted without a branch
+            const bool note_on = type == 0x90 && velocity != 0;
+            s->stats.note_on_count += note_on;
+            s->stats.note_off_count += (type == 0x80 || type == 0x90) && !note_on;
+        } else if (type == 0x90 && velocity != 0) {
+            s->stats.note_on_count++;
+        } else if (type == 0x80 || type == 0x90) {
+            s->stats.note_off_count++;
+        }
+    } else if (status < 0xE0) {
+        s->offset += 1;
+        s->stats.event_count++;
+    } else if (status == 0xFF || status == 0xF0) {
+        const uint8_t type = status == 0xFF ? scan_byte(s, s->offset, windowed) : 0;
+        s->offset += 1;
+        size_t length = (size_t)(int)(windowed ? window_vlq(s, window, classify) : scalar_vlq(s));
+        const size_t room = s->offset < s->length ? s->length - s->offset : 0;
+        if (length > room) length = room;
+        const uint8_t* payload = s->data + s->offset;
+        s->offset += length;
+
+        if (status == 0xFF && type == 0x2F) return SCAN_END;
+        s->stats.event_count++;
+        s->stats.meta_count++;
+        s->stats.payload_size += length;
+        if (length > s->stats.largest_payload) s->stats.largest_payload = length;
+        if (s->meta_callback && !s->meta_callback(s->context, (uint64_t)(int)s->tick, status, type, payload, length)) {
+            return SCAN_FAILED;
+        }
+    }
+
+    s->tick += windowed ? window_vlq(s, window, classify) : scalar_vlq(s);
+    return SCAN_MORE;
+}
+
+// Status bytes of events with two data bytes; before the first status the decoder reads two as well
+inline __attribute__((always_inline)) static bool two_data_bytes(const uint8_t status) {
+    return status < 0xC0 || (status & 0xF0) == 0xE0;
+}
+
+// Counts one event of a run: data bytes at data[0] and data[1], a one-byte delta at data[2]
+inline __attribute__((always_inline)) static void count_run_event(ScanState* s, const uint8_t status, const uint8_t* data) {
+    const uint8_t type = status & 0xF0;
+    const bool note_on = type == 0x90 && data[1] != 0;
+    s->stats.note_on_count += note_on;
+    s->stats.note_off_count += (type == 0x80 || type == 0x90) && !note_on;
+    s->tick += data[2];
+}
+
+// Most of a file is channel events with two data bytes and one-byte deltas, and those have a fixed layout: three
+// bytes with their top bit clear under running status, a status byte and three such bytes without it. The window
+// holds the top bits, so every stretch of running status is measured with one count of clear bits and its events
+// are counted back to back, instead of decoding every byte after the one before. Returns whether it counted any.
+inline __attribute__((always_inline)) static bool scan_run(ScanState* s, ScanWindow* window, const ClassifyFunc classify) {
+    if (s->offset + 8 > window->base + MIDI_SCAN_WINDOW) {
+        window->base = s->offset;
+        window->high = classify(s->data + s->offset);
+    }
+    const unsigned position = (unsigned)(s->offset - window->base);
+    const uint64_t high = window->high >> position;
+    const unsigned room = MIDI_SCAN_WINDOW - position;
+    const uint8_t* data = s->data + s->offset;
+    uint8_t status = s->status;
+    uint64_t events = 0;
+    unsigned at = 0;
+
+    while (at + 4 <= room) {
+        const uint64_t ahead = high >> at;
+        if (ahead & 1) {
+            const unsigned start = at;
+            while (at + 4 <= room && ((high >> at) & 0xF) == 1 && two_data_bytes(data[at])) {
+                status = data[at];
+                count_run_event(s, status, data + at + 1);
+                at += 4;
+            }
+            if (at == start) break;
+            events += (at - start) / 4;
+        } else if ((ahead & 0xF) == 0x8) {
+            // A single event under running status between two with a status, like a note-off after its note-on
+            if (!two_data_bytes(status)) break;
+            count_run_event(s, status, data + at);
+            at += 3;
+            events++;
+        } else {
+            if (!two_data_bytes(status)) break;
+            const unsigned clear = ahead ? (unsigned)__builtin_ctzll(ahead) : room - at;
+            const unsigned count = clear / 3;
+            if (count == 0) break;
+            for (unsigned i = 0; i < count; i++) {
+                count_run_event(s, status, data + at + i * 3);
+            }
+            at += count * 3;
+            events += count;
+        }
+    }
+
+    s->status = status;
+    s->offset += at;
+    s->stats.event_count += events;
+    return events > 0;
+}
+
+// Windowed while a whole window fits ahead of every event, so its bytes can be read unchecked; the rest of the
+// track goes a byte at a time
+inline __attribute__((always_inline)) static int scan_events(ScanState* state, const ClassifyFunc classify) {
+    ScanState s = *state;
+    int result = SCAN_MORE;
+    if (classify && s.offset + MIDI_SCAN_WINDOW <= s.length) {
+        ScanWindow window = { s.offset, classify(s.data + s.offset) };
+        while (result == SCAN_MORE && s.offset + MIDI_SCAN_WINDOW <= s.length) {
+            if (!scan_run(&s, &window, classify)) result = scan_event(&s, &window, classify);
+        }
+    }
+    while (result == SCAN_MORE && s.offset < s.length) result = scan_event(&s, NULL, NULL);
+    *state = s;
+    return result;
+}
+
+static int scan_scalar(ScanState* state) {
+    return scan_events(state, NULL);
+}
+
+#ifdef MIDI_SCAN_X86
+__attribute__((target("sse2"))) static int scan_sse2(ScanState* state) {
+    return scan_events(state, classify_sse2);
+}
+
+__attribute__((target("avx2"))) static int scan_avx2(ScanState* state) {
+    return scan_events(state, classify_avx2);
+}
+#endif
+
+bool midi_scan_supported(const MidiScanLevel level) {
+    switch (level) {
+        case MIDI_SCAN_SCALAR:
+            return true;
+#ifdef MIDI_SCAN_X86
+        case MIDI_SCAN_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case MIDI_SCAN_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+// The widest level this CPU runs
+MidiScanLevel midi_scan_level(void) {
+    MidiScanLevel level = MIDI_SCAN_LEVELS - 1;
+    while (level > MIDI_SCAN_SCALAR && !midi_scan_supported(level)) level--;
+    return level;
+}
+
+const char* midi_scan_level_name(const MidiScanLevel level) {
+    switch (level) {
+        case MIDI_SCAN_SCALAR: return "scalar";
+        case MIDI_SCAN_SSE2: return "sse2";
+        case MIDI_SCAN_AVX2: return "avx2";
+        default: return "unknown";
+    }
+}
+
+// The statistics pass over one track, from its cursor to end-of-track or the end of its data. Counts and ticks
+// come out exactly as the regular decoder would have them, whatever the level; one the CPU lacks runs scalar.
+// Leaves the cursor's offset and tick where the pass stopped. Returns false if the callback failed.
+bool midi_scan_track(TrackData* track, MidiScanLevel level, TrackStats* stats, const MidiScanMetaCallback meta_callback, void* context) {
+    ScanState state = {
+        .data = track->data,
+        .length = track->data ? track->length : 0,
+        .offset = track->offset,
+        .tick = (uint32_t)track->tick,
+        .status = track->message & 0xFF,
+        .meta_callback = meta_callback,
+        .context = context,
+    };
+    if (!midi_scan_supported(level)) level = MIDI_SCAN_SCALAR;
+
+    int result;
+    switch (level) {
+#ifdef MIDI_SCAN_X86
+        case MIDI_SCAN_AVX2:
+            result = scan_avx2(&state);
+            break;
+        case MIDI_SCAN_SSE2:
+            result = scan_sse2(&state);
+            break;
+#endif
+        default:
+            result = scan_scalar(&state);
+    }
+
+    state.stats.last_tick = (uint64_t)(int)state.tick;
+    *stats = state.stats;
+    track->offset = state.offset;
+    track->tick = (int)state.tick;
+    return result != SCAN_FAILED;
+}
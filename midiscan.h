@@ -0,0 +1,31 @@
+// midi_scan.h
+#ifndef MIDI_SCAN_H
+#define MIDI_SCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "midiplayer.h"
+
+#define MIDI_SCAN_WINDOW 64         // Bytes classified at once by the vector scanners
+
+// Instruction sets the counting pass can run on. The vector scanners classify a window of bytes by their top
+// bit in one go, which shows where the status bytes are and where every delta time and length ends without
+// looking at the bytes one by one.
+typedef enum {
+    MIDI_SCAN_SCALAR,               // A byte at a time, exactly like the regular decoder
+    MIDI_SCAN_SSE2,
+    MIDI_SCAN_AVX2,
+    MIDI_SCAN_LEVELS,
+} MidiScanLevel;
+
+// Every meta event and SysEx but end-of-track; type is 0 for SysEx. Returning false fails the scan.
+typedef bool (*MidiScanMetaCallback)(void* context, uint64_t tick, uint8_t status, uint8_t type, const uint8_t* payload, size_t length);
+
+MidiScanLevel midi_scan_level(void);
+bool midi_scan_supported(MidiScanLevel level);
+const char* midi_scan_level_name(MidiScanLevel level);
+bool midi_scan_track(TrackData* track, MidiScanLevel level, TrackStats* stats, MidiScanMetaCallback meta_callback, void* context);
+
+#endif
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dlfcn.h>
+
+#include "midisink.h"
+
+#define OMNIMIDI_LIBRARY "./libOmniMIDI.so"
+#define ALSA_LIBRARY "libasound.so.2"
+
+// OmniMIDI / KDMAPI
+//
+// KDMAPI has no call that takes several short messages, so a batch is a tight loop over
+// SendDirectData inside the sink instead of one indirect call per message in the player.
+
+typedef struct {
+    void (*SendDirectData)(uint32_t);
+    bool (*TerminateKDMAPIStream)();
+} OmniMidiSink;
+
+static void omnimidi_submit(MidiSink* sink, const uint32_t* messages, const size_t count) {
+    void (*SendDirectData)(uint32_t) = ((OmniMidiSink*)sink->backend)->SendDirectData;
+    for (size_t i = 0; i < count; i++) {
+        SendDirectData(messages[i]);
+    }
+}
+
+static void omnimidi_close(MidiSink* sink) {
+    OmniMidiSink* omni = (OmniMidiSink*)sink->backend;
+    if (omni->TerminateKDMAPIStream) omni->TerminateKDMAPIStream();
+}
+
+static bool open_omnimidi(MidiSink* sink, const char* device) {
+    void* midi_lib = dlopen(device ? device : OMNIMIDI_LIBRARY, RTLD_LAZY);
+    if (!midi_lib) {
+        fprintf(stderr, "Failed to load OmniMIDI.so: %s\n", dlerror());
+        return false;
+    }
+
+    // Clear any existing error
+    dlerror();
+
+    bool (*IsKDMAPIAvailable)() = dlsym(midi_lib, "IsKDMAPIAvailable");
+    bool (*InitializeKDMAPIStream)() = dlsym(midi_lib, "InitializeKDMAPIStream");
+    void (*SendDirectData)(uint32_t) = dlsym(midi_lib, "SendDirectData");
+    const char* dlsym_error = dlerror();
+    if (dlsym_error || !IsKDMAPIAvailable || !InitializeKDMAPIStream || !SendDirectData) {
+        fprintf(stderr, "Cannot load KDMAPI: %s\n", dlsym_error ? dlsym_error : "missing symbol");
+        dlclose(midi_lib);
+        return false;
+    }
+
+    if (!IsKDMAPIAvailable() || !InitializeKDMAPIStream()) {
+        fprintf(stderr, "MIDI initialization failed\n");
+        dlclose(midi_lib);
+        return false;
+    }
+
+    OmniMidiSink* omni = malloc(sizeof(OmniMidiSink));
+    if (!omni) {
+        fprintf(stderr, "Memory allocation failed\n");
+        dlclose(midi_lib);
+        return false;
+    }
+    omni->SendDirectData = SendDirectData;
+    omni->TerminateKDMAPIStream = dlsym(midi_lib, "TerminateKDMAPIStream");
+
+    sink->library = midi_lib;
+    sink->backend = omni;
+    sink->submit = omnimidi_submit;
+    sink->close = omnimidi_close;
+    return true;
+}
+
+// ALSA sequencer
+//
+// libasound is opened at runtime like OmniMIDI, so neither its headers nor the library are needed
+// to build. Every batch is queued with snd_seq_event_output and flushed with a single drain.
+
+#define SND_SEQ_OPEN_OUTPUT 1
+#define SND_SEQ_PORT_CAP_READ (1 << 0)
+#define SND_SEQ_PORT_CAP_SUBS_READ (1 << 5)
+#define SND_SEQ_PORT_TYPE_MIDI_GENERIC (1 << 1)
+#define SND_SEQ_PORT_TYPE_APPLICATION (1 << 20)
+#define SND_SEQ_QUEUE_DIRECT 253
+#define SND_SEQ_ADDRESS_UNKNOWN 253
+#define SND_SEQ_ADDRESS_SUBSCRIBERS 254
+
+#define SND_SEQ_EVENT_NOTEON 6
+#define SND_SEQ_EVENT_NOTEOFF 7
+#define SND_SEQ_EVENT_KEYPRESS 8
+#define SND_SEQ_EVENT_CONTROLLER 10
+#define SND_SEQ_EVENT_PGMCHANGE 11
+#define SND_SEQ_EVENT_CHANPRESS 12
+#define SND_SEQ_EVENT_PITCHBEND 13
+
+// struct snd_seq_event from the kernel's sound/asequencer.h, which is fixed ABI
+typedef struct {
+    uint8_t type;
+    uint8_t flags;              // 0: tick time stamp, absolute, fixed length
+    uint8_t tag;
+    uint8_t queue;
+    uint32_t time[2];
+    uint8_t source_client;
+    uint8_t source_port;
+    uint8_t dest_client;
+    uint8_t dest_port;
+    union {
+        struct {
+            uint8_t channel;
+            uint8_t note;
+            uint8_t velocity;
+            uint8_t off_velocity;
+            uint32_t duration;
+        } note;
+        struct {
+            uint8_t channel;
+            uint8_t unused[3];
+            uint32_t param;
+            int32_t value;
+        } control;
+    } data;
+} AlsaSeqEvent;
+
+_Static_assert(sizeof(AlsaSeqEvent) == 28, "snd_seq_event_t layout");
+
+typedef struct {
+    uint8_t client;
+    uint8_t port;
+} AlsaSeqAddr;
+
+typedef struct {
+    void* seq;                  // snd_seq_t*
+    int port;
+    int (*event_output)(void* seq, AlsaSeqEvent* event);
+    int (*drain_output)(void* seq);
+    int (*close)(void* seq);
+} AlsaSink;
+
+// Translate a packed short message; returns false for messages the sequencer has no event for
+inline __attribute__((always_inline)) static bool alsa_event(const uint32_t message, AlsaSeqEvent* event) {
+    const uint8_t status = message & 0xF0;
+    const uint8_t channel = message & 0x0F;
+    const uint8_t data1 = (message >> 8) & 0x7F;
+    const uint8_t data2 = (message >> 16) & 0x7F;
+
+    switch (status) {
+    case 0x80:
+    case 0x90:
+    case 0xA0:
+        event->type = status == 0x80 ? SND_SEQ_EVENT_NOTEOFF : status == 0x90 ? SND_SEQ_EVENT_NOTEON : SND_SEQ_EVENT_KEYPRESS;
+        event->data.note.channel = channel;
+        event->data.note.note = data1;
+        event->data.note.velocity = data2;
+        event->data.note.off_velocity = 0;
+        event->data.note.duration = 0;
+        return true;
+    case 0xB0:
+        event->type = SND_SEQ_EVENT_CONTROLLER;
+        event->data.control.param = data1;
+        event->data.control.value = data2;
+        break;
+    case 0xC0:
+        event->type = SND_SEQ_EVENT_PGMCHANGE;
+        event->data.control.param = 0;
+        event->data.control.value = data1;
+        break;
+    case 0xD0:
+        event->type = SND_SEQ_EVENT_CHANPRESS;
+        event->data.control.param = 0;
+        event->data.control.value = data1;
+        break;
+    case 0xE0:
+        event->type = SND_SEQ_EVENT_PITCHBEND;
+        event->data.control.param = 0;
+        event->data.control.value = (int32_t)(data1 | data2 << 7) - 8192;
+        break;
+    default:
+        return false;
+    }
+
+    event->data.control.channel = channel;
+    memset(event->data.control.unused, 0, sizeof(event->data.control.unused));
+    return true;
+}
+
+static void alsa_submit(MidiSink* sink, const uint32_t* messages, const size_t count) {
+    AlsaSink* alsa = (AlsaSink*)sink->backend;
+
+    // Sent straight to every subscriber of our port, bypassing the sequencer queues
+    AlsaSeqEvent event;
+    memset(&event, 0, sizeof(event));
+    event.queue = SND_SEQ_QUEUE_DIRECT;
+    event.source_port = (uint8_t)alsa->port;
+    event.dest_client = SND_SEQ_ADDRESS_SUBSCRIBERS;
+    event.dest_port = SND_SEQ_ADDRESS_UNKNOWN;
+
+    for (size_t i = 0; i < count; i++) {
+        if (alsa_event(messages[i], &event)) alsa->event_output(alsa->seq, &event);
+    }
+    alsa->drain_output(alsa->seq);
+}
+
+static void alsa_close(MidiSink* sink) {
+    AlsaSink* alsa = (AlsaSink*)sink->backend;
+    alsa->drain_output(alsa->seq);
+    alsa->close(alsa->seq);
+}
+
+static bool open_alsa(MidiSink* sink, const char* device) {
+    void* alsa_lib = dlopen(ALSA_LIBRARY, RTLD_LAZY);
+    if (!alsa_lib) {
+        fprintf(stderr, "Failed to load %s: %s\n", ALSA_LIBRARY, dlerror());
+        return false;
+    }
+
+    dlerror();
+
+    int (*seq_open)(void**, const char*, int, int) = dlsym(alsa_lib, "snd_seq_open");
+    int (*set_client_name)(void*, const char*) = dlsym(alsa_lib, "snd_seq_set_client_name");
+    int (*create_simple_port)(void*, const char*, unsigned int, unsigned int) = dlsym(alsa_lib, "snd_seq_create_simple_port");
+    int (*parse_address)(void*, AlsaSeqAddr*, const char*) = dlsym(alsa_lib, "snd_seq_parse_address");
+    int (*connect_to)(void*, int, int, int) = dlsym(alsa_lib, "snd_seq_connect_to");
+
+    AlsaSink* alsa = calloc(1, sizeof(AlsaSink));
+    if (!alsa) {
+        fprintf(stderr, "Memory allocation failed\n");
+        dlclose(alsa_lib);
+        return false;
+    }
+    alsa->event_output = dlsym(alsa_lib, "snd_seq_event_output");
+    alsa->drain_output = dlsym(alsa_lib, "snd_seq_drain_output");
+    alsa->close = dlsym(alsa_lib, "snd_seq_close");
+
+    const char* dlsym_error = dlerror();
+    if (dlsym_error || !seq_open || !set_client_name || !create_simple_port || !parse_address || !connect_to ||
+        !alsa->event_output || !alsa->drain_output || !alsa->close) {
+        fprintf(stderr, "Cannot load ALSA sequencer: %s\n", dlsym_error ? dlsym_error : "missing symbol");
+        free(alsa);
+        dlclose(alsa_lib);
+        return false;
+    }
+
+    int err = seq_open(&alsa->seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+    if (err < 0) {
+        fprintf(stderr, "Cannot open ALSA sequencer (%d)\n", err);
+        free(alsa);
+        dlclose(alsa_lib);
+        return false;
+    }
+
+    set_client_name(alsa->seq, "c_midiplayer");
+    alsa->port = create_simple_port(alsa->seq, "out", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (alsa->port < 0) {
+        fprintf(stderr, "Cannot create ALSA sequencer port (%d)\n", alsa->port);
+        alsa->close(alsa->seq);
+        free(alsa);
+        dlclose(alsa_lib);
+        return false;
+    }
+
+    // Without a device the port just waits for someone to subscribe, e.g. with aconnect
+    if (device) {
+        AlsaSeqAddr addr;
+        err = parse_address(alsa->seq, &addr, device);
+        if (err >= 0) err = connect_to(alsa->seq, alsa->port, addr.client, addr.port);
+        if (err < 0) {
+            fprintf(stderr, "Cannot connect to ALSA port %s (%d)\n", device, err);
+            alsa->close(alsa->seq);
+            free(alsa);
+            dlclose(alsa_lib);
+            return false;
+        }
+    }
+
+    sink->library = alsa_lib;
+    sink->backend = alsa;
+    sink->submit = alsa_submit;
+    sink->close = alsa_close;
+    return true;
+}
+
+// Null sink
+
+static void null_submit(MidiSink* sink, const uint32_t* messages, const size_t count) {
+    (void)sink;
+    (void)messages;
+    (void)count;
+}
+
+bool open_midi_sink(MidiSink* sink, const MidiSinkType type, const char* device) {
+    memset(sink, 0, sizeof(MidiSink));
+    sink->type = type;
+
+    switch (type) {
+    case MIDI_SINK_OMNIMIDI:
+        return open_omnimidi(sink, device);
+    case MIDI_SINK_ALSA:
+        return open_alsa(sink, device);
+    case MIDI_SINK_NULL:
+        sink->submit = null_submit;
+        return true;
+    }
+
+    fprintf(stderr, "Unknown MIDI sink %d\n", (int)type);
+    return false;
+}
+
+void close_midi_sink(MidiSink* sink) {
+    if (sink->close) sink->close(sink);
+    free(sink->backend);
+    if (sink->library) dlclose(sink->library);
+    memset(sink, 0, sizeof(MidiSink));
+}
+
+const char* midi_sink_name(const MidiSinkType type) {
+    switch (type) {
+    case MIDI_SINK_OMNIMIDI: return "omnimidi";
+    case MIDI_SINK_ALSA: return "alsa";
+    case MIDI_SINK_NULL: return "null";
+    }
+    return "unknown";
+}
+
+bool parse_midi_sink(const char* name, MidiSinkType* type) {
+    if (strcmp(name, "omnimidi") == 0 || strcmp(name, "kdmapi") == 0) {
+        *type = MIDI_SINK_OMNIMIDI;
+    } else if (strcmp(name, "alsa") == 0) {
+        *type = MIDI_SINK_ALSA;
+    } else if (strcmp(name, "null") == 0) {
+        *type = MIDI_SINK_NULL;
+    } else {
+        return false;
+    }
+    return true;
+}
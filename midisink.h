@@ -0,0 +1,44 @@
+// midi_sink.h
+#ifndef MIDI_SINK_H
+#define MIDI_SINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Where playback sends its MIDI messages
+typedef enum {
+    MIDI_SINK_OMNIMIDI,         // KDMAPI through libOmniMIDI.so
+    MIDI_SINK_ALSA,             // ALSA sequencer client, libasound is loaded at runtime
+    MIDI_SINK_NULL,             // Counts messages and drops them, for measuring the player alone
+} MidiSinkType;
+
+typedef struct MidiSink MidiSink;
+
+// Takes every message due at one instant in a single call
+typedef void (*MidiSinkSubmitFunc)(MidiSink* sink, const uint32_t* messages, size_t count);
+
+struct MidiSink {
+    MidiSinkType type;
+    MidiSinkSubmitFunc submit;
+    void (*close)(MidiSink* sink);
+    void* library;              // dlopen handle of the backend, or NULL
+    void* backend;              // Backend state
+    uint64_t message_count;     // Messages submitted so far
+    uint64_t batch_count;       // Submit calls so far
+};
+
+// device is the OmniMIDI library path or the ALSA "client:port" to connect to; NULL for the default
+bool open_midi_sink(MidiSink* sink, MidiSinkType type, const char* device);
+void close_midi_sink(MidiSink* sink);
+const char* midi_sink_name(MidiSinkType type);
+bool parse_midi_sink(const char* name, MidiSinkType* type);
+
+inline __attribute__((always_inline)) static void submit_midi_sink(MidiSink* sink, const uint32_t* messages, const size_t count) {
+    if (count == 0) return;
+    sink->message_count += count;
+    sink->batch_count++;
+    sink->submit(sink, messages, count);
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+
+#include "miditimer.h"
+
+inline __attribute__((always_inline)) static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+inline __attribute__((always_inline)) static struct timespec to_timespec(const uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ns / 1000000000ULL);
+    ts.tv_nsec = (long)(ns % 1000000000ULL);
+    return ts;
+}
+
+void midi_timer_init(MidiTimer* timer, const uint64_t spin_ns) {
+    memset(timer, 0, sizeof(MidiTimer));
+    timer->spin_ns = spin_ns;
+}
+
+// Sleep until spin_ns before the deadline, then spin the rest. An absolute sleep can't accumulate
+// oversleep the way a relative nanosleep does. Returns how late the deadline was met. With a cancel flag
+// the sleep is cut into slices; a cancelled wait returns early, counts for nothing and reports 0.
+uint64_t midi_timer_wait_until(MidiTimer* timer, const uint64_t deadline_ns) {
+    uint64_t now = midi_timer_now_ns();
+    timer->entered_ns = now;
+
+    if (now < deadline_ns) {
+        if (deadline_ns - now > timer->spin_ns) {
+            const uint64_t wake_ns = deadline_ns - timer->spin_ns;
+            while (now < wake_ns) {
+                if (midi_timer_cancelled(timer)) return 0;
+                const uint64_t slice_ns = timer->cancel && wake_ns - now > MIDI_TIMER_CANCEL_SLICE_NS
+                    ? now + MIDI_TIMER_CANCEL_SLICE_NS : wake_ns;
+                const struct timespec wake = to_timespec(slice_ns);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {}
+                now = midi_timer_now_ns();
+            }
+            if (midi_timer_cancelled(timer)) return 0;
+        }
+
+        if (now < deadline_ns) {
+            timer->spins++;
+            while ((now = midi_timer_now_ns()) < deadline_ns) {
+                cpu_relax();
+            }
+        }
+    }
+
+    const uint64_t lateness = now - deadline_ns;
+    timer->waits++;
+    timer->total_lateness_ns += lateness;
+    if (lateness > timer->max_lateness_ns) timer->max_lateness_ns = lateness;
+    if (lateness >= MIDI_TIMER_MISS_NS) timer->misses++;
+    return lateness;
+}
+
+// Plain relative sleep, for polling loops that don't have a deadline
+void midi_timer_sleep_ns(const uint64_t duration_ns) {
+    struct timespec req = to_timespec(duration_ns);
+    while (nanosleep(&req, &req) == EINTR) {}
+}
+
+// Add another timer's waits to this one, for one report over several threads
+void midi_timer_merge(MidiTimer* timer, const MidiTimer* other) {
+    timer->waits += other->waits;
+    timer->total_lateness_ns += other->total_lateness_ns;
+    if (other->max_lateness_ns > timer->max_lateness_ns) timer->max_lateness_ns = other->max_lateness_ns;
+    timer->misses += other->misses;
+    timer->spins += other->spins;
+}
+
+void midi_timer_report(const MidiTimer* timer) {
+    if (timer->waits == 0) return;
+    printf("Timing: %lu deadlines, mean lateness %.1fμs, max %.1fμs, %lu over %lums, %lu spun.\n",
+        (unsigned long)timer->waits, (double)timer->total_lateness_ns / (double)timer->waits / 1000.0,
+        (double)timer->max_lateness_ns / 1000.0, (unsigned long)timer->misses,
+        (unsigned long)(MIDI_TIMER_MISS_NS / 1000000ULL), (unsigned long)timer->spins);
+}
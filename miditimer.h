@@ -0,0 +1,46 @@
+// midi_timer.h
+#ifndef MIDI_TIMER_H
+#define MIDI_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Lateness at or above this counts as a miss in the report
+#define MIDI_TIMER_MISS_NS 1000000ULL
+
+// Longest sleep between two looks at the cancel flag, so a pause from the render thread costs well under a frame
+#define MIDI_TIMER_CANCEL_SLICE_NS 2000000ULL
+
+// Sleeps to absolute deadlines on CLOCK_MONOTONIC and keeps track of how late it woke up
+typedef struct {
+    uint64_t spin_ns;           // Last stretch before a deadline that is spun instead of slept
+    uint64_t waits;
+    uint64_t total_lateness_ns;
+    uint64_t max_lateness_ns;
+    uint64_t misses;            // Waits that woke MIDI_TIMER_MISS_NS or more late
+    uint64_t spins;             // Waits that ended in the spin phase
+    uint64_t entered_ns;        // When the last wait began; it woke at its deadline plus the lateness it returned
+    const atomic_bool* cancel;  // Set by another thread to cut waits short, or NULL
+} MidiTimer;
+
+// Monotonic clock, immune to NTP slews and clock steps
+inline __attribute__((always_inline)) static uint64_t midi_timer_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Whether the wait that just returned was cut short, and every later one will be
+inline __attribute__((always_inline)) static bool midi_timer_cancelled(const MidiTimer* timer) {
+    return timer->cancel && atomic_load_explicit(timer->cancel, memory_order_relaxed);
+}
+
+void midi_timer_init(MidiTimer* timer, uint64_t spin_ns);
+uint64_t midi_timer_wait_until(MidiTimer* timer, uint64_t deadline_ns);
+void midi_timer_sleep_ns(uint64_t duration_ns);
+void midi_timer_merge(MidiTimer* timer, const MidiTimer* other);
+void midi_timer_report(const MidiTimer* timer);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "raymath.h"
+#include "noterender.h"
+
+// The quad comes from gl_VertexID, so the only vertex data is per instance
+static const char* note_vertex_shader =
+    "#version 330\n"
+    "layout(location = 0) in vec4 noteRect;\n"
+    "layout(location = 1) in vec4 noteColor;\n"
+    "uniform mat4 mvp;\n"
+    "out vec4 fragColor;\n"
+    "const vec2 corners[6] = vec2[6](vec2(0.0, 0.0), vec2(0.0, 1.0), vec2(1.0, 1.0), vec2(0.0, 0.0), vec2(1.0, 1.0), vec2(1.0, 0.0));\n"
+    "void main() {\n"
+    "    fragColor = noteColor;\n"
+    "    gl_Position = mvp * vec4(noteRect.xy + corners[gl_VertexID] * noteRect.zw, 0.0, 1.0);\n"
+    "}\n";
+
+static const char* note_fragment_shader =
+    "#version 330\n"
+    "in vec4 fragColor;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    finalColor = fragColor;\n"
+    "}\n";
+
+bool note_renderer_init(NoteRenderer* renderer) {
+    memset(renderer, 0, sizeof(NoteRenderer));
+    renderer->rects = malloc(NOTE_RENDER_CAPACITY * sizeof(Rectangle));
+    renderer->colors = malloc(NOTE_RENDER_CAPACITY * sizeof(Color));
+    if (!renderer->rects || !renderer->colors) {
+        fprintf(stderr, "Memory allocation failed\n");
+        note_renderer_free(renderer);
+        return false;
+    }
+
+    // rlgl hands back its default shader when ours doesn't compile
+    renderer->shader = rlLoadShaderCode(note_vertex_shader, note_fragment_shader);
+    if (renderer->shader == 0 || renderer->shader == rlGetShaderIdDefault()) {
+        fprintf(stderr, "Instanced note shader unavailable, drawing notes one by one\n");
+        renderer->shader = 0;
+        return true;
+    }
+    renderer->mvp_location = rlGetLocationUniform(renderer->shader, "mvp");
+
+    // One buffer per attribute, so both start at offset 0
+    renderer->vao = rlLoadVertexArray();
+    rlEnableVertexArray(renderer->vao);
+
+    renderer->rect_buffer = rlLoadVertexBuffer(NULL, NOTE_RENDER_CAPACITY * sizeof(Rectangle), true);
+    rlSetVertexAttribute(0, 4, RL_FLOAT, false, 0, 0);
+    rlEnableVertexAttribute(0);
+    rlSetVertexAttributeDivisor(0, 1);
+
+    renderer->color_buffer = rlLoadVertexBuffer(NULL, NOTE_RENDER_CAPACITY * sizeof(Color), true);
+    rlSetVertexAttribute(1, 4, RL_UNSIGNED_BYTE, true, 0, 0);
+    rlEnableVertexAttribute(1);
+    rlSetVertexAttributeDivisor(1, 1);
+
+    rlDisableVertexArray();
+    renderer->instanced = renderer->vao != 0 && renderer->rect_buffer != 0 && renderer->color_buffer != 0;
+    if (!renderer->instanced) fprintf(stderr, "Instanced note buffers unavailable, drawing notes one by one\n");
+    return true;
+}
+
+void note_renderer_free(NoteRenderer* renderer) {
+    if (renderer->rect_buffer) rlUnloadVertexBuffer(renderer->rect_buffer);
+    if (renderer->color_buffer) rlUnloadVertexBuffer(renderer->color_buffer);
+    if (renderer->vao) rlUnloadVertexArray(renderer->vao);
+    if (renderer->shader) rlUnloadShaderProgram(renderer->shader);
+    free(renderer->rects);
+    free(renderer->colors);
+    memset(renderer, 0, sizeof(NoteRenderer));
+}
+
+// Draw everything pushed so far into the current target, after whatever raylib has batched before it
+void note_renderer_flush(NoteRenderer* renderer) {
+    if (renderer->count == 0) return;
+
+    if (!renderer->instanced) {
+        for (size_t i = 0; i < renderer->count; i++) {
+            DrawRectangleRec(renderer->rects[i], renderer->colors[i]);
+        }
+        renderer->count = 0;
+        return;
+    }
+
+    rlDrawRenderBatchActive();
+
+    rlUpdateVertexBuffer(renderer->rect_buffer, renderer->rects, (int)(renderer->count * sizeof(Rectangle)), 0);
+    rlUpdateVertexBuffer(renderer->color_buffer, renderer->colors, (int)(renderer->count * sizeof(Color)), 0);
+
+    rlEnableShader(renderer->shader);
+    rlSetUniformMatrix(renderer->mvp_location, MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection()));
+    rlEnableVertexArray(renderer->vao);
+    rlDrawVertexArrayInstanced(0, 6, (int)renderer->count);
+    rlDisableVertexArray();
+    rlDisableShader();
+
+    renderer->count = 0;
+    renderer->draw_calls++;
+}
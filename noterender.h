@@ -0,0 +1,41 @@
+// note_render.h
+#ifndef NOTE_RENDER_H
+#define NOTE_RENDER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "raylib.h"
+
+// Instances per draw call; a full buffer is drawn and refilled
+#define NOTE_RENDER_CAPACITY 65536
+
+// Collects note rectangles and draws them with one instanced call per flush: each instance is a rectangle
+// and a color, expanded to a quad in the vertex shader. Without GLSL 330 it falls back to DrawRectangleRec.
+typedef struct {
+    unsigned int shader;
+    int mvp_location;
+    unsigned int vao;
+    unsigned int rect_buffer;
+    unsigned int color_buffer;
+    bool instanced;             // Shader and buffers loaded
+
+    Rectangle* rects;           // Pending instances, drawn in order
+    Color* colors;
+    size_t count;
+    size_t draw_calls;          // Since init, for the HUD
+} NoteRenderer;
+
+bool note_renderer_init(NoteRenderer* renderer);
+void note_renderer_free(NoteRenderer* renderer);
+void note_renderer_flush(NoteRenderer* renderer);
+
+// Draw order is push order, so later notes paint over earlier ones like they would with DrawRectangleRec
+inline __attribute__((always_inline)) static void note_renderer_push(NoteRenderer* renderer, const Rectangle rect, const Color color) {
+    if (renderer->count == NOTE_RENDER_CAPACITY) note_renderer_flush(renderer);
+    renderer->rects[renderer->count] = rect;
+    renderer->colors[renderer->count] = color;
+    renderer->count++;
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "raylib.h"
+#include "rollstrip.h"
+
+bool roll_strip_init(RollStrip* strip, const int texture_width, const int texture_height, const float key_y[ROLL_STRIP_KEYS],
+    const float key_height, const Color palette[ROLL_STRIP_CHANNELS]) {
+    memset(strip, 0, sizeof(RollStrip));
+    strip->texture_width = texture_width;
+    strip->texture_height = texture_height;
+    strip->capacity = texture_width;
+    strip->cells = malloc((size_t)ROLL_STRIP_KEYS * strip->capacity);
+    strip->pixels = malloc((size_t)ROLL_STRIP_UPLOAD_COLUMNS * texture_height * sizeof(Color));
+    if (!strip->cells || !strip->pixels) {
+        fprintf(stderr, "Memory allocation failed\n");
+        roll_strip_free(strip);
+        return false;
+    }
+    memcpy(strip->palette, palette, sizeof(strip->palette));
+
+    // A key is drawn from key_y - key_height to key_y; texture rows count from the bottom, drawing rows from the top
+    for (int n = 0; n < ROLL_STRIP_KEYS; n++) {
+        int top = texture_height - (int)ceil(key_y[n] - 0.5);
+        int bottom = texture_height - (int)ceil(key_y[n] - key_height - 0.5);
+        if (top < 0) top = 0;
+        if (bottom > texture_height) bottom = texture_height;
+        strip->key_top[n] = top;
+        strip->key_bottom[n] = bottom > top ? bottom : top;
+    }
+    return true;
+}
+
+void roll_strip_free(RollStrip* strip) {
+    free(strip->cells);
+    free(strip->pixels);
+    memset(strip, 0, sizeof(RollStrip));
+}
+
+// Start a frame's stretch [start_x, end_x), empty. Past the capacity only the newest columns are kept.
+void roll_strip_begin(RollStrip* strip, const double start_x, const double end_x) {
+    const int64_t first = roll_strip_column(start_x);
+    const int64_t end = roll_strip_column(end_x);
+    int64_t columns = end > first ? end - first : 0;
+    strip->first = columns > strip->capacity ? end - strip->capacity : first;
+    strip->columns = (int)(columns > strip->capacity ? strip->capacity : columns);
+
+    for (int n = 0; n < ROLL_STRIP_KEYS; n++) {
+        memset(strip->cells + (size_t)n * strip->capacity, 0, strip->columns);
+    }
+}
+
+// Everything outside a note is black, so the stretch is cleared in the same upload
+void roll_strip_upload(RollStrip* strip, const Texture2D texture) {
+    const int height = strip->texture_height;
+    int start = 0;
+
+    while (start < strip->columns) {
+        // Chunks never cross the wrap of the texture
+        const int x = (int)(((strip->first + start) % strip->texture_width + strip->texture_width) % strip->texture_width);
+        int count = strip->columns - start;
+        if (count > ROLL_STRIP_UPLOAD_COLUMNS) count = ROLL_STRIP_UPLOAD_COLUMNS;
+        if (count > strip->texture_width - x) count = strip->texture_width - x;
+
+        for (int i = 0; i < count * height; i++) {
+            strip->pixels[i] = BLACK;
+        }
+
+        for (int n = 0; n < ROLL_STRIP_KEYS; n++) {
+            const uint8_t* row = strip->cells + (size_t)n * strip->capacity + start;
+            for (int c = 0; c < count; c++) {
+                if (!row[c]) continue;
+                const Color color = strip->palette[row[c] - 1];
+                for (int y = strip->key_top[n]; y < strip->key_bottom[n]; y++) {
+                    strip->pixels[(size_t)y * count + c] = color;
+                }
+            }
+        }
+
+        UpdateTextureRec(texture, (Rectangle){ (float)x, 0, (float)count, (float)height }, strip->pixels);
+        start += count;
+    }
+}
@@ -0,0 +1,56 @@
+// roll_strip.h
+#ifndef ROLL_STRIP_H
+#define ROLL_STRIP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "raylib.h"
+
+#define ROLL_STRIP_KEYS 128
+#define ROLL_STRIP_CHANNELS 16
+#define ROLL_STRIP_UPLOAD_COLUMNS 256   // Columns rasterized and uploaded per UpdateTextureRec
+
+// Level of detail for the piano roll: the stretch of texture revealed in a frame is rasterized on the CPU into
+// one cell per key and pixel column, then written into the texture directly. However many notes share a cell,
+// it costs one byte, so a frame costs at most keys x columns no matter how dense the song is.
+typedef struct {
+    int texture_width;
+    int texture_height;
+    int capacity;               // Most columns in one frame
+    int64_t first;              // Song position, in whole pixels, of the strip's first column
+    int columns;
+    uint8_t* cells;             // ROLL_STRIP_KEYS rows of capacity cells: channel + 1, 0 where no note is
+    Color* pixels;              // ROLL_STRIP_UPLOAD_COLUMNS x texture_height upload buffer
+    int key_top[ROLL_STRIP_KEYS];    // Texture rows each key covers, as DrawRectangle would fill them
+    int key_bottom[ROLL_STRIP_KEYS];
+    Color palette[ROLL_STRIP_CHANNELS];
+} RollStrip;
+
+bool roll_strip_init(RollStrip* strip, int texture_width, int texture_height, const float key_y[ROLL_STRIP_KEYS],
+    float key_height, const Color palette[ROLL_STRIP_CHANNELS]);
+void roll_strip_free(RollStrip* strip);
+void roll_strip_begin(RollStrip* strip, double start_x, double end_x);
+void roll_strip_upload(RollStrip* strip, Texture2D texture);
+
+// Pixel columns whose centers lie in [x, ...), the same ones a rectangle starting at x would fill
+inline __attribute__((always_inline)) static int64_t roll_strip_column(const double x) {
+    return (int64_t)ceil(x - 0.5);
+}
+
+// Paint a note over [start_x, end_x); later notes cover earlier ones, like overlapping rectangles
+inline __attribute__((always_inline)) static void roll_strip_note(RollStrip* strip, const double start_x, const double end_x,
+    const uint8_t key, const uint8_t channel) {
+    int64_t from = roll_strip_column(start_x) - strip->first;
+    int64_t to = roll_strip_column(end_x) - strip->first;
+    if (from < 0) from = 0;
+    if (to > strip->columns) to = strip->columns;
+
+    uint8_t* row = strip->cells + (size_t)key * strip->capacity;
+    for (int64_t c = from; c < to; c++) {
+        row[c] = (uint8_t)(channel + 1);
+    }
+}
+
+#endif
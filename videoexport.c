@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/wait.h>
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "miditimer.h"
+#include "videoexport.h"
+
+extern char** environ;
+
+static bool write_all(const int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static void* video_writer(void* arg) {
+    VideoExport* video = (VideoExport*)arg;
+    const size_t frame_bytes = (size_t)video->width * video->height * 4;
+
+    pthread_mutex_lock(&video->lock);
+    while (true) {
+        while (video->tail == video->head && !video->closing) pthread_cond_wait(&video->queued, &video->lock);
+        if (video->tail == video->head) break;
+        void* frame = video->frames[video->tail % VIDEO_EXPORT_QUEUE];
+        const bool failed = video->failed;
+        pthread_mutex_unlock(&video->lock);
+
+        // The pipe write is the slow part, so it runs with the queue unlocked
+        const bool ok = failed || write_all(video->pipe_fd, frame, frame_bytes);
+        if (!failed && ok) video->written++;
+        MemFree(frame);
+
+        pthread_mutex_lock(&video->lock);
+        if (!ok) {
+            fprintf(stderr, "Encoder stopped taking frames\n");
+            video->failed = true;
+        }
+        video->tail++;
+        pthread_cond_signal(&video->taken);
+    }
+    pthread_mutex_unlock(&video->lock);
+    return NULL;
+}
+
+// The encoder gets frames of width x height RGBA pixels on stdin, bottom row first as OpenGL reads them.
+// Without a command of its own it is ffmpeg writing H.264 to path. A custom command runs through the shell
+// and finds the frame layout and the path in VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FPS and VIDEO_OUTPUT.
+bool video_export_open(VideoExport* video, const char* path, const char* encoder, const int width, const int height, const int fps) {
+    memset(video, 0, sizeof(VideoExport));
+    video->width = width;
+    video->height = height;
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "Could not create the encoder pipe: %s\n", strerror(errno));
+        return false;
+    }
+
+    char size[32];
+    char rate[16];
+    snprintf(size, sizeof(size), "%dx%d", width, height);
+    snprintf(rate, sizeof(rate), "%d", fps);
+
+    // The child may only exec, so a custom command's environment is put together here
+    char variables[4][PATH_MAX + 32];
+    size_t environ_count = 0;
+    while (environ[environ_count]) environ_count++;
+    char** env = encoder ? malloc((environ_count + 5) * sizeof(char*)) : NULL;
+    if (encoder) {
+        if (!env) {
+            fprintf(stderr, "Memory allocation failed\n");
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        snprintf(variables[0], sizeof(variables[0]), "VIDEO_WIDTH=%d", width);
+        snprintf(variables[1], sizeof(variables[1]), "VIDEO_HEIGHT=%d", height);
+        snprintf(variables[2], sizeof(variables[2]), "VIDEO_FPS=%d", fps);
+        snprintf(variables[3], sizeof(variables[3]), "VIDEO_OUTPUT=%s", path);
+        memcpy(env, environ, environ_count * sizeof(char*));
+        for (int i = 0; i < 4; i++) env[environ_count + i] = variables[i];
+        env[environ_count + 4] = NULL;
+    }
+
+    video->encoder = fork();
+    if (video->encoder == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (encoder) {
+            execle("/bin/sh", "sh", "-c", encoder, (char*)NULL, env);
+        } else {
+            execlp("ffmpeg", "ffmpeg", "-hide_banner", "-loglevel", "error", "-y",
+                "-f", "rawvideo", "-pixel_format", "rgba", "-video_size", size, "-framerate", rate, "-i", "-",
+                "-vf", "vflip", "-c:v", "libx264", "-preset", "veryfast", "-pix_fmt", "yuv420p", path, (char*)NULL);
+        }
+        static const char message[] = "Could not run the encoder\n";
+        const ssize_t ignored = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)ignored;
+        _exit(127);
+    }
+    free(env);
+    close(fds[0]);
+    if (video->encoder < 0) {
+        fprintf(stderr, "Could not start the encoder: %s\n", strerror(errno));
+        close(fds[1]);
+        return false;
+    }
+    video->pipe_fd = fds[1];
+
+    // An encoder that exits early shows up as a failed write instead of killing the export
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&video->lock, NULL);
+    pthread_cond_init(&video->queued, NULL);
+    pthread_cond_init(&video->taken, NULL);
+    if (pthread_create(&video->writer, NULL, video_writer, video) != 0) {
+        fprintf(stderr, "Could not start the encoder writer thread\n");
+        close(video->pipe_fd);
+        waitpid(video->encoder, NULL, 0);
+        pthread_cond_destroy(&video->taken);
+        pthread_cond_destroy(&video->queued);
+        pthread_mutex_destroy(&video->lock);
+        return false;
+    }
+    return true;
+}
+
+// Read the finished frame back and queue it, waiting for room if the encoder is behind
+bool video_export_frame(VideoExport* video, const RenderTexture2D target) {
+    if (target.texture.width != video->width || target.texture.height != video->height ||
+        target.texture.format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) {
+        fprintf(stderr, "Exported frames must be %dx%d RGBA\n", video->width, video->height);
+        return false;
+    }
+
+    pthread_mutex_lock(&video->lock);
+    const bool failed = video->failed;
+    pthread_mutex_unlock(&video->lock);
+    if (failed) return false;
+
+    void* pixels = rlReadTexturePixels(target.texture.id, target.texture.width, target.texture.height, target.texture.format);
+    if (!pixels) {
+        fprintf(stderr, "Could not read the frame back\n");
+        return false;
+    }
+
+    pthread_mutex_lock(&video->lock);
+    if (video->head - video->tail == VIDEO_EXPORT_QUEUE) {
+        const uint64_t start = midi_timer_now_ns();
+        while (video->head - video->tail == VIDEO_EXPORT_QUEUE) pthread_cond_wait(&video->taken, &video->lock);
+        video->wait_ns += midi_timer_now_ns() - start;
+    }
+    const bool ok = !video->failed;
+    if (ok) {
+        video->frames[video->head % VIDEO_EXPORT_QUEUE] = pixels;
+        video->head++;
+        pthread_cond_signal(&video->queued);
+    }
+    pthread_mutex_unlock(&video->lock);
+
+    if (!ok) MemFree(pixels);
+    return ok;
+}
+
+// Flush the queue, close the pipe and wait for the encoder to finish the file
+bool video_export_close(VideoExport* video) {
+    pthread_mutex_lock(&video->lock);
+    video->closing = true;
+    pthread_cond_signal(&video->queued);
+    pthread_mutex_unlock(&video->lock);
+    pthread_join(video->writer, NULL);
+    close(video->pipe_fd);
+
+    int status = 0;
+    bool ok = !video->failed;
+    if (waitpid(video->encoder, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Encoder failed (status %d)\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        ok = false;
+    }
+
+    pthread_cond_destroy(&video->taken);
+    pthread_cond_destroy(&video->queued);
+    pthread_mutex_destroy(&video->lock);
+    return ok;
+}
@@ -0,0 +1,39 @@
+// video_export.h
+#ifndef VIDEO_EXPORT_H
+#define VIDEO_EXPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "raylib.h"
+
+#define VIDEO_EXPORT_QUEUE 4    // Frames read back and waiting for the encoder
+
+// Raw RGBA frames piped into an encoder process. The renderer reads each frame back and queues it; a writer
+// thread feeds the pipe while the next frame renders, and the encoder runs in a process of its own. A full queue
+// makes the renderer wait, so a slow encoder slows the export down instead of dropping frames.
+typedef struct {
+    int width;
+    int height;
+    pid_t encoder;
+    int pipe_fd;                // Encoder's stdin
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // A frame was queued, or the export is closing
+    pthread_cond_t taken;       // The writer took a frame
+    void* frames[VIDEO_EXPORT_QUEUE];
+    uint64_t head;              // Frames queued
+    uint64_t tail;              // Frames taken by the writer
+    bool closing;
+    bool failed;                // The pipe broke; later frames are thrown away
+    uint64_t written;           // Writer only
+    uint64_t wait_ns;           // Renderer only: time spent waiting for room in the queue
+} VideoExport;
+
+bool video_export_open(VideoExport* video, const char* path, const char* encoder, int width, int height, int fps);
+bool video_export_frame(VideoExport* video, RenderTexture2D target);
+bool video_export_close(VideoExport* video);
+
+#endif